@@ -0,0 +1,343 @@
+#include <stdarg.h>
+#include "advisor.h"
+
+static const char regnames[] = "A123456X";
+// The conditions of JL-JLE (F=4-9), and of the register jumps that
+// test the same against 0 (F=0-5)
+static const char *jumpnames[] = {"JL", "JE", "JG", "JGE", "JNE", "JLE"};
+static const char *regjumpnames[] = {"N", "Z", "P", "NN", "NZ", "NP"};
+
+typedef struct {
+  advice *list;
+  int num, max;
+} advicelist;
+
+static void suggest(advicelist *l, int kind, int cell, long saved, const char *fmt, ...) {
+  if (saved <= 0)
+    return;
+  if (l->num == l->max) {
+    l->max = l->max == 0 ? 64 : 2*l->max;
+    l->list = realloc(l->list, l->max * sizeof(advice));
+  }
+  advice *a = &l->list[l->num++];
+  a->kind = kind;
+  a->cell = cell;
+  a->saved = saved;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(a->text, sizeof(a->text), fmt, args);
+  va_end(args);
+}
+
+static int compareadvice(const void *x, const void *y) {
+  const advice *a = x, *b = y;
+  if (a->saved != b->saved)
+    return a->saved > b->saved ? -1 : 1;
+  return a->cell - b->cell;
+}
+
+// The address of instr, leaving out the index.
+static int address(word instr) {
+  word A = getA(instr);
+  int addr = A & ONES(12);
+  return A >> 12 ? addr : -addr;
+}
+
+// Whether instr uses the whole word at an address that isn't indexed.
+static bool plain(word instr) {
+  return getI(instr) == 0 && getF(instr) == 5 && 0 <= address(instr) && address(instr) < 4000;
+}
+
+// Whether instr may change register r (0 for rA, 1-6 for rI1-rI6, 7
+// for rX).
+static bool writesreg(word instr, int r) {
+  byte C = getC(instr), F = getF(instr);
+  if (C == 8+r || C == 16+r || C == 48+r)       // LDr, LDrN, ENTr etc.
+    return true;
+  if (C == 7)                                   // MOVE
+    return r == 1;
+  if (r == 0)
+    return 1 <= C && C <= 6;
+  if (r == 7)
+    return C == 3 || C == 4 || C == 5 || (C == 6 && F >= 2);
+  return false;
+}
+
+// Whether instr may change the word at addr.
+static bool writesmem(word instr, int addr) {
+  byte C = getC(instr);
+  return (24 <= C && C <= 33 && (getI(instr) != 0 || address(instr) == addr)) || C == 7 || C == 36;
+}
+
+// Whether block b is in the loop at header h.
+static bool inloop(cfg *g, int b, int h) {
+  for (int x = g->blocks[b].header; x >= 0; x = g->blocks[x].outer)
+    if (x == h)
+      return true;
+  return false;
+}
+
+// How often control came into the loop at h from outside, as far as
+// the counts tell: as often as the last cell of a block that can only
+// go to h, and at most as often as that for the others.
+static long loopentries(cfg *g, int *counts, int h) {
+  long n = 0;
+  for (int e = 0; e < g->numedges; e++) {
+    edge *ed = &g->edges[e];
+    if (ed->to != h || inloop(g, ed->from, h))
+      continue;
+    block *from = &g->blocks[ed->from];
+    int c = counts[from->last];
+    n += from->numedges == 1 ? c : (c < counts[g->blocks[h].first] ? c : counts[g->blocks[h].first]);
+  }
+  return n > 0 ? n : 1;
+}
+
+// Whether the word at addr stays the same in the loop at h: nothing
+// in it may store there, and it doesn't call anything that could.
+static bool invariant(word *mem, cfg *g, int h, int addr) {
+  for (int b = 0; b < g->numblocks; b++) {
+    block *bl = &g->blocks[b];
+    if (!inloop(g, b, h))
+      continue;
+    if (bl->unknownexit)
+      return false;
+    for (int e = bl->firstedge; e < bl->firstedge + bl->numedges; e++)
+      if (g->edges[e].kind == EDGE_CALL)
+	return false;
+    for (int c = bl->first; c <= bl->last; c++)
+      if (writesmem(mem[c], addr))
+	return false;
+  }
+  return true;
+}
+
+// A load of the word that was just stored from the same register,
+// with nothing in between changing either.
+static void findreloads(word *mem, int *counts, block *bl, advicelist *l) {
+  for (int c = bl->first; c <= bl->last; c++) {
+    byte C = getC(mem[c]);
+    if (C < 24 || C > 31 || !plain(mem[c]))
+      continue;
+    int r = C-24, addr = address(mem[c]);
+    for (int d = c+1; d <= bl->last; d++) {
+      word w = mem[d];
+      if (getC(w) == 8+r && plain(w) && address(w) == addr) {
+	suggest(l, ADVICE_RELOAD, d, (long)counts[d] * fixedtime(w),
+		"LD%c %04d reloads what ST%c stored at %04d; leave it out",
+		regnames[r], addr, regnames[r], c);
+	break;
+      }
+      if (writesreg(w, r) || writesmem(w, addr))
+	break;
+    }
+  }
+}
+
+// Loads in a loop of words that the loop doesn't change, other than
+// literals, which findliterals() deals with.
+static void findinvariants(word *mem, cfg *g, int *counts, bool *literal, block *bl, advicelist *l) {
+  if (bl->depth == 0)
+    return;
+  for (int c = bl->first; c <= bl->last; c++) {
+    word w = mem[c];
+    byte C = getC(w);
+    int addr = address(w);
+    if (C < 8 || C > 23 || getI(w) != 0 || addr < 0 || addr >= 4000 || literal[addr] ||
+	g->blockof[addr] >= 0 || counts[c] == 0)
+      continue;
+    if (!invariant(mem, g, bl->header, addr))
+      continue;
+    long entries = loopentries(g, counts, bl->header);
+    suggest(l, ADVICE_INVARIANT, c, (counts[c] - entries) * fixedtime(w),
+	    "LD%c%s %04d in the loop at %04d, which doesn't change it; load it before the loop",
+	    regnames[(C-8)%8], C >= 16 ? "N" : "", addr, g->blocks[bl->header].first);
+  }
+}
+
+// Whether the word at addr is data that the program never stores
+// into (other than through an index).
+static bool constant(cfg *g, bool *stored, int addr) {
+  return g->blockof[addr] < 0 && !stored[addr];
+}
+
+static bool iscmpjump(word instr) {
+  return getC(instr) == 39 && 4 <= getF(instr) && getF(instr) <= 9;
+}
+
+// CMPr of a word that is always 0, followed by a jump on the result,
+// which a jump on rA, rX or rIi does in one instruction.
+static void findregjumps(word *mem, cfg *g, int *counts, bool *stored, block *bl, advicelist *l) {
+  int c = bl->last-1;
+  if (c < bl->first)
+    return;
+  word w = mem[c], j = mem[c+1];
+  byte C = getC(w);
+  if (C < 56 || C > 63 || !plain(w) || !constant(g, stored, address(w)) ||
+      MAG(mem[address(w)]) != 0 || !iscmpjump(j))
+    return;
+  // The comparison mustn't be used again after the jump.
+  if ((c+2 < 4000 && iscmpjump(mem[c+2])) ||
+      (getI(j) == 0 && 0 <= address(j) && address(j) < 4000 && iscmpjump(mem[address(j)])))
+    return;
+  int r = C-56;
+  suggest(l, ADVICE_REGJUMP, c, (long)counts[c] * fixedtime(w),
+	  "CMP%c %04d is a comparison with 0; replace it and %s by J%c%s",
+	  regnames[r], address(w), jumpnames[getF(j)-4], regnames[r], regjumpnames[getF(j)-4]);
+}
+
+// Three or more pairs of CMPr with a constant and JE, which a jump
+// table can replace: a range check and JMP TABLE,i take about 5u.
+static int findtable(word *mem, cfg *g, int *counts, bool *stored, int c, advicelist *l) {
+  byte C = getC(mem[c]);
+  if (C < 56 || C > 63)
+    return c+1;
+  int n = 0;
+  long time = 0;
+  for (int d = c; d+1 < 4000; d += 2, n++) {
+    word w = mem[d], j = mem[d+1];
+    if (getC(w) != C || !plain(w) || !constant(g, stored, address(w)) ||
+	getC(j) != 39 || getF(j) != 5)
+      break;
+    time += (long)counts[d] * fixedtime(w) + (long)counts[d+1] * fixedtime(j);
+  }
+  if (n < 3)
+    return c+1;
+  suggest(l, ADVICE_TABLE, c, time - 5L*counts[c],
+	  "%d comparisons of r%c with JE; use a jump table, JMP TABLE,i",
+	  n, regnames[C-56]);
+  return c + 2*n;
+}
+
+// Calls of subroutines of a few cells, whose linkage (JMP, STJ and the
+// JMP back) takes 4u a call.
+static void findinlines(cfg *g, int *counts, block *bl, advicelist *l) {
+  for (int e = bl->firstedge; e < bl->firstedge + bl->numedges; e++) {
+    if (g->edges[e].kind != EDGE_CALL)
+      continue;
+    for (int r = 0; r < g->numroutines; r++) {
+      if (g->routines[r].entry != g->edges[e].to)
+	continue;
+      int size = 0;
+      for (int b = 0; b < g->numblocks; b++)
+	if (g->blocks[b].routine == r)
+	  size += g->blocks[b].last - g->blocks[b].first + 1;
+      if (size <= 8)
+	suggest(l, ADVICE_INLINE, bl->last, 4L*counts[bl->last],
+		"call of %s (%d cells); write it in place to save the linkage",
+		g->routines[r].name[0] ? g->routines[r].name : "subroutine", size);
+    }
+  }
+}
+
+// Words copied with pairs of LDA/STA (or LDX/STX): n of them take 4n
+// u, while ENT1 and MOVE take 2n+2.  Also a loop copying one word each
+// time round, which MOVE does in 2u a word.
+static void findmoves(word *mem, cfg *g, int *counts, block *bl, advicelist *l) {
+  for (int c = bl->first; c+1 <= bl->last; c++) {
+    int n = 0;
+    for (int d = c; d+1 <= bl->last; d += 2, n++) {
+      word ld = mem[d], st = mem[d+1];
+      byte C = getC(ld);
+      if ((C != 8 && C != 15) || getC(st) != C+16 || !plain(ld) || !plain(st) ||
+	  getC(ld) != getC(mem[c]) || address(ld) != address(mem[c]) + n ||
+	  address(st) != address(mem[c+1]) + n)
+	break;
+    }
+    if (n >= 2) {
+      suggest(l, ADVICE_MOVE, c, (2L*n - 2) * counts[c],
+	      "%d words copied one at a time; use ENT1 %04d and MOVE %04d(%d)",
+	      n, address(mem[c+1]), address(mem[c]), n);
+      c += 2*n - 1;
+    }
+  }
+
+  int b = bl - g->blocks;
+  if (bl->header != b || bl->last - bl->first != 3 || getI(mem[bl->last]) != 0 ||
+      address(mem[bl->last]) != bl->first)
+    return;
+  word ld = mem[bl->first], st = mem[bl->first+1], inc = mem[bl->first+2];
+  byte C = getC(ld), i = getI(ld);
+  if ((C != 8 && C != 15) || getC(st) != C+16 || i == 0 || getI(st) != i ||
+      getF(ld) != 5 || getF(st) != 5 || getC(inc) != 48+i || getF(inc) > 1 ||
+      address(inc) != 1 || getI(inc) != 0)
+    return;
+  long words = counts[bl->first], entries = loopentries(g, counts, b);
+  suggest(l, ADVICE_MOVE, bl->first, words*bl->time - (2*words + 2*entries),
+	  "the loop at %04d copies a word each time round; use MOVE if the length is fixed",
+	  bl->first);
+}
+
+// LDr, LDrN, ADD or SUB of a small literal in a loop, which ENTr,
+// ENNr, INCA or DECA do in 1u instead of 2u.
+static void findliterals(word *mem, int *counts, bool *literal, block *bl, advicelist *l) {
+  if (bl->depth == 0)
+    return;
+  for (int c = bl->first; c <= bl->last; c++) {
+    word w = mem[c];
+    byte C = getC(w);
+    if (!plain(w) || !literal[address(w)] || !(C == 1 || C == 2 || (8 <= C && C <= 23)))
+      continue;
+    int v = INT(mem[address(w)]);
+    if (v <= -4096 || v >= 4096)
+      continue;
+    char op[5], imm[5];
+    int r = (C-8)%8;
+    if (C == 1 || C == 2) {
+      strcpy(op, C == 1 ? "ADD" : "SUB");
+      strcpy(imm, C == 1 ? "INCA" : "DECA");
+    }
+    else {
+      sprintf(op, "LD%c%s", regnames[r], C >= 16 ? "N" : "");
+      sprintf(imm, "EN%c%c", C >= 16 ? 'N' : 'T', regnames[r]);
+    }
+    suggest(l, ADVICE_LITERAL, c, counts[c],
+	    "%s =%d= in a loop; use %s %d", op, v, imm, v);
+  }
+}
+
+int advise(word *mem, cfg *g, int *counts, parsestate *ps, advice *out, int n) {
+  static bool literal[4000], stored[4000];
+  memset(literal, 0, sizeof(literal));
+  memset(stored, 0, sizeof(stored));
+  for (int i = 0; ps != NULL && i < ps->numfuturerefs; i++) {
+    futureref *fr = &ps->futurerefs[i];
+    if (fr->which && 0 <= fr->addr && fr->addr < 4000) {
+      int addr = address(mem[fr->addr]);
+      if (0 <= addr && addr < 4000)
+	literal[addr] = true;
+    }
+  }
+  for (int c = 0; c < 4000; c++) {
+    byte C = getC(mem[c]);
+    if (g->blockof[c] >= 0 && 24 <= C && C <= 33 && getI(mem[c]) == 0 &&
+	0 <= address(mem[c]) && address(mem[c]) < 4000)
+      stored[address(mem[c])] = true;
+  }
+
+  advicelist l = {NULL, 0, 0};
+  for (int b = 0; b < g->numblocks; b++) {
+    block *bl = &g->blocks[b];
+    if (counts[bl->first] == 0)
+      continue;
+    findreloads(mem, counts, bl, &l);
+    findinvariants(mem, g, counts, literal, bl, &l);
+    findregjumps(mem, g, counts, stored, bl, &l);
+    findinlines(g, counts, bl, &l);
+    findmoves(mem, g, counts, bl, &l);
+    findliterals(mem, counts, literal, bl, &l);
+  }
+  for (int c = 0; c < 4000; ) {
+    if (g->blockof[c] < 0 || counts[c] == 0)
+      c++;
+    else
+      c = findtable(mem, g, counts, stored, c, &l);
+  }
+
+  qsort(l.list, l.num, sizeof(advice), compareadvice);
+  if (n > l.num)
+    n = l.num;
+  memcpy(out, l.list, n * sizeof(advice));
+  free(l.list);
+  return n;
+}
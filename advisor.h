@@ -0,0 +1,31 @@
+#ifndef _ADVISOR_H
+#define _ADVISOR_H
+#include "cfg.h"
+
+// Rewrites that would make a program faster, found from its
+// control-flow graph and the counts of a run.  The time each would
+// save is estimated from the counts, so the rewrites of the code that
+// ran the most come first.  They are only suggestions: whether a
+// rewrite is right depends on more than the advisor looks at, e.g.
+// whether a register is free to hold a value over a loop.
+#define ADVICE_RELOAD    0  // A load of the word that was just stored
+#define ADVICE_INVARIANT 1  // A load in a loop of a word the loop doesn't change
+#define ADVICE_REGJUMP   2  // A comparison with 0 that a register jump makes
+#define ADVICE_TABLE     3  // A chain of comparisons that a jump table replaces
+#define ADVICE_INLINE    4  // A call of a short subroutine
+#define ADVICE_MOVE      5  // Words copied one at a time
+#define ADVICE_LITERAL   6  // A literal in a loop that ENTx/INCx/DECx can hold
+
+typedef struct {
+  int kind;
+  int cell;            // Where the code to rewrite starts
+  long saved;          // The time it would have saved in the run
+  char text[100];
+} advice;
+
+// Find the rewrites of the program in mem, whose graph is g and whose
+// cells were executed counts[i] times, and put the n that save the
+// most into out, the most first.  ps, if not NULL, tells which cells
+// hold literals.  Return how many were put into out.
+int advise(word *mem, cfg *g, int *counts, parsestate *ps, advice *out, int n);
+#endif
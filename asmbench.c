@@ -0,0 +1,132 @@
+// Throughput of the assembler on large generated MIXAL sources, to
+// track regressions in the symbol table, opcode lookup and source
+// reading.  Each corpus stresses one part of the assembler: symbols
+// defined with EQU and looked up, forward references resolved at END,
+// literals, and local symbols; the last one mixes them.  The programs
+// don't fit into memory, so they start again from location 0 every
+// 3000 cells.
+//
+// Usage: asmbench [lines]
+
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "emulator.h"
+#include "assembler.h"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+  char *buf;
+  size_t len, size;
+  int cells;
+} source;
+
+static void addline(source *src, bool cell, const char *fmt, ...) {
+  if (cell && src->cells++ % 3000 == 0)
+    addline(src, false, " ORIG 0\n");
+  if (src->len + LINELEN > src->size) {
+    src->size *= 2;
+    src->buf = realloc(src->buf, src->size);
+  }
+  va_list args;
+  va_start(args, fmt);
+  src->len += vsnprintf(src->buf + src->len, LINELEN, fmt, args);
+  va_end(args);
+}
+
+#define SYMBOLS  0
+#define FORWARD  1
+#define LITERALS 2
+#define LOCAL    3
+#define MIXED    4
+
+// Generate about n lines of the given kind of corpus.
+static void generate(int kind, int n, source *src) {
+  src->size = 1 << 16;
+  src->buf = malloc(src->size);
+  src->len = 0;
+  src->cells = 0;
+  srand(1);
+  int numsyms = 0;
+  // In the mixed corpus, only every 4th line has a label Fi.
+  int step = kind == MIXED ? 4 : 1;
+  for (int i = 0; i < n; i++) {
+    switch (kind == MIXED ? i%4 : kind) {
+    case SYMBOLS:
+      if (numsyms == 0 || rand()%2 == 0) {
+	addline(src, false, "S%d EQU %d\n", numsyms, numsyms%4000);
+	numsyms++;
+      }
+      else
+	addline(src, true, "L%d LDA S%d,1\n", i, rand()%numsyms);
+      break;
+    case FORWARD:
+      addline(src, true, "F%d JMP F%d\n", i, i + step*(1 + rand()%25));
+      break;
+    case LITERALS:
+      addline(src, true, " LDA =%d=\n", rand()%500);
+      break;
+    case LOCAL:
+      if (i%3 == 0)
+	addline(src, true, "%dH ENTA %d\n", i%10, i%10);
+      else
+	addline(src, true, " JMP %d%c\n", rand()%10, i%3 == 1 ? 'B' : 'F');
+      break;
+    }
+  }
+  // The labels that are jumped to after the end
+  for (int i = n; i < n+101; i++)
+    addline(src, true, "F%d NOP\n", i);
+  addline(src, false, " END 0\n");
+}
+
+// The memory allocated for the parse state.
+static size_t psmemory(parsestate *ps) {
+  return ps->maxsyms * sizeof(symbol) + ps->symtablesize * sizeof(int) +
+    ps->maxfuturerefs * sizeof(futureref) + ps->maxlines * sizeof(lineinfo) +
+    ps->maxsymrefs * sizeof(int) + 4000 * sizeof(int);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 300000;
+  static mix mix;
+  static sourceinfo info;
+  char *names[] = {"symbols", "forward references", "literals", "local symbols", "mixed"};
+  for (int kind = SYMBOLS; kind <= MIXED; kind++) {
+    source src;
+    generate(kind, n, &src);
+    int lines = 0;
+    for (size_t i = 0; i < src.len; i++)
+      lines += src.buf[i] == '\n';
+
+    // The best of 3 runs
+    double best = 1e9;
+    size_t memory;
+    for (int run = 0; run < 3; run++) {
+      parsestate ps;
+      initparsestate(&ps);
+      initmix(&mix);
+      double start = now();
+      if (!assemble(src.buf, src.len, &ps, &mix, &info)) {
+	printf("Assembler error at line %d of the %s corpus\n", info.errline, names[kind]);
+	return 1;
+      }
+      double t = now() - start;
+      best = t < best ? t : best;
+      memory = psmemory(&ps);
+      freeparsestate(&ps);
+    }
+    printf("%-20s %7d lines %10.0f lines/s %8.1f MB/s %8zu KB allocated\n", names[kind],
+	   lines, lines / best, src.len / best / 1e6, memory / 1024);
+    free(src.buf);
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("Peak memory: %ld KB\n", usage.ru_maxrss);
+  return 0;
+}
@@ -1,90 +1,260 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "assembler.h"
 
-char *MIXOPS[] = {
-  "NOP", "ADD", "SUB", "MUL", "DIV", "NUM", "CHAR", "HLT", "SLA", "SRA", "SLAX", "SRAX", "SLC", "SRC", "MOVE",
-  "LDA", "LD1", "LD2", "LD3", "LD4", "LD5", "LD6", "LDX",
-  "LDAN", "LD1N", "LD2N", "LD3N", "LD4N", "LD5N", "LD6N", "LDXN",
-  "STA", "ST1", "ST2", "ST3", "ST4", "ST5", "ST6", "STX",
-  "STJ", "STZ", "JBUS", "IOC", "IN", "OUT", "JRED", "JMP", "JSJ", "JOV", "JNOV", "JL", "JE", "JG", "JGE", "JNE", "JLE",
-  "JAN", "JAZ", "JAP", "JANN", "JANZ", "JANP",
-  "J1N", "J1Z", "J1P", "J1NN", "J1NZ", "J1NP",
-  "J2N", "J2Z", "J2P", "J2NN", "J2NZ", "J2NP",
-  "J3N", "J3Z", "J3P", "J3NN", "J3NZ", "J3NP",
-  "J4N", "J4Z", "J4P", "J4NN", "J4NZ", "J4NP",
-  "J5N", "J5Z", "J5P", "J5NN", "J5NZ", "J5NP",
-  "J6N", "J6Z", "J6P", "J6NN", "J6NZ", "J6NP",
-  "JXN", "JXZ", "JXP", "JXNN", "JXNZ", "JXNP",
-  "INCA", "DECA", "ENTA", "ENNA", "INC1", "DEC1", "ENT1", "ENN1",
-  "INC2", "DEC2", "ENT2", "ENN2", "INC3", "DEC3", "ENT3", "ENN3",
-  "INC4", "DEC4", "ENT4", "ENN4", "INC5", "DEC5", "ENT5", "ENN5",
-  "INC6", "DEC6", "ENT6", "ENN6", "INCX", "DECX", "ENTX", "ENNX",
-  "CMPA", "CMP1", "CMP2", "CMP3", "CMP4", "CMP5", "CMP6", "CMPX"
-};
-
-word DEFAULTOPFIELDS[] = {
-  0, 5, 5, 5, 5, 0, 1, 2, 0, 1, 2, 3, 4, 5, 1,
-  5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5,
-  5, 5, 5, 5, 5, 5, 5, 5,
-  2, 5, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 4, 5,
-  0, 1, 2, 3, 0, 1, 2, 3,
-  0, 1, 2, 3, 0, 1, 2, 3,
-  0, 1, 2, 3, 0, 1, 2, 3,
-  0, 1, 2, 3, 0, 1, 2, 3,
-  5, 5, 5, 5, 5, 5, 5, 5
-};
-
-word OPCODES[] = {
-  0, 1, 2, 3, 4, 5, 5, 5, 6, 6, 6, 6, 6, 6, 7,
-  8, 9, 10, 11, 12, 13, 14, 15,
-  16, 17, 18, 19, 20, 21, 22, 23,
-  24, 25, 26, 27, 28, 29, 30, 31,
-  32, 33, 34, 35, 36, 37, 38, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
-  40, 40, 40, 40, 40, 40,
-  41, 41, 41, 41, 41, 41, 
-  42, 42, 42, 42, 42, 42, 
-  43, 43, 43, 43, 43, 43, 
-  44, 44, 44, 44, 44, 44, 
-  45, 45, 45, 45, 45, 45, 
-  46, 46, 46, 46, 46, 46,  
-  47, 47, 47, 47, 47, 47, 
-  48, 48, 48, 48, 49, 49, 49, 49,
-  50, 50, 50, 50, 51, 51, 51, 51,
-  52, 52, 52, 52, 53, 53, 53, 53,
-  54, 54, 54, 54, 55, 55, 55, 55,
-  56, 57, 58, 59, 60, 61, 62, 63
+// Every MIX operation with its default field and opcode.  The index
+// of an operation in this table is the opidx returned by parseOP().
+const mixop MIXOPS[] = {
+  {"NOP", 0, 0}, {"ADD", 5, 1}, {"SUB", 5, 2}, {"MUL", 5, 3}, {"DIV", 5, 4},
+  {"NUM", 0, 5}, {"CHAR", 1, 5}, {"HLT", 2, 5}, {"SLA", 0, 6}, {"SRA", 1, 6},
+  {"SLAX", 2, 6}, {"SRAX", 3, 6}, {"SLC", 4, 6}, {"SRC", 5, 6}, {"MOVE", 1, 7},
+  {"LDA", 5, 8}, {"LD1", 5, 9}, {"LD2", 5, 10}, {"LD3", 5, 11},
+  {"LD4", 5, 12}, {"LD5", 5, 13}, {"LD6", 5, 14}, {"LDX", 5, 15},
+  {"LDAN", 5, 16}, {"LD1N", 5, 17}, {"LD2N", 5, 18}, {"LD3N", 5, 19},
+  {"LD4N", 5, 20}, {"LD5N", 5, 21}, {"LD6N", 5, 22}, {"LDXN", 5, 23},
+  {"STA", 5, 24}, {"ST1", 5, 25}, {"ST2", 5, 26}, {"ST3", 5, 27},
+  {"ST4", 5, 28}, {"ST5", 5, 29}, {"ST6", 5, 30}, {"STX", 5, 31},
+  {"STJ", 2, 32}, {"STZ", 5, 33}, {"JBUS", 0, 34}, {"IOC", 0, 35}, {"IN", 0, 36},
+  {"OUT", 0, 37}, {"JRED", 0, 38}, {"JMP", 0, 39}, {"JSJ", 1, 39}, {"JOV", 2, 39},
+  {"JNOV", 3, 39}, {"JL", 4, 39}, {"JE", 5, 39}, {"JG", 6, 39}, {"JGE", 7, 39},
+  {"JNE", 8, 39}, {"JLE", 9, 39},
+  {"JAN", 0, 40}, {"JAZ", 1, 40}, {"JAP", 2, 40}, {"JANN", 3, 40}, {"JANZ", 4, 40}, {"JANP", 5, 40},
+  {"J1N", 0, 41}, {"J1Z", 1, 41}, {"J1P", 2, 41}, {"J1NN", 3, 41}, {"J1NZ", 4, 41}, {"J1NP", 5, 41},
+  {"J2N", 0, 42}, {"J2Z", 1, 42}, {"J2P", 2, 42}, {"J2NN", 3, 42}, {"J2NZ", 4, 42}, {"J2NP", 5, 42},
+  {"J3N", 0, 43}, {"J3Z", 1, 43}, {"J3P", 2, 43}, {"J3NN", 3, 43}, {"J3NZ", 4, 43}, {"J3NP", 5, 43},
+  {"J4N", 0, 44}, {"J4Z", 1, 44}, {"J4P", 2, 44}, {"J4NN", 3, 44}, {"J4NZ", 4, 44}, {"J4NP", 5, 44},
+  {"J5N", 0, 45}, {"J5Z", 1, 45}, {"J5P", 2, 45}, {"J5NN", 3, 45}, {"J5NZ", 4, 45}, {"J5NP", 5, 45},
+  {"J6N", 0, 46}, {"J6Z", 1, 46}, {"J6P", 2, 46}, {"J6NN", 3, 46}, {"J6NZ", 4, 46}, {"J6NP", 5, 46},
+  {"JXN", 0, 47}, {"JXZ", 1, 47}, {"JXP", 2, 47}, {"JXNN", 3, 47}, {"JXNZ", 4, 47}, {"JXNP", 5, 47},
+  {"INCA", 0, 48}, {"DECA", 1, 48}, {"ENTA", 2, 48}, {"ENNA", 3, 48},
+  {"INC1", 0, 49}, {"DEC1", 1, 49}, {"ENT1", 2, 49}, {"ENN1", 3, 49},
+  {"INC2", 0, 50}, {"DEC2", 1, 50}, {"ENT2", 2, 50}, {"ENN2", 3, 50},
+  {"INC3", 0, 51}, {"DEC3", 1, 51}, {"ENT3", 2, 51}, {"ENN3", 3, 51},
+  {"INC4", 0, 52}, {"DEC4", 1, 52}, {"ENT4", 2, 52}, {"ENN4", 3, 52},
+  {"INC5", 0, 53}, {"DEC5", 1, 53}, {"ENT5", 2, 53}, {"ENN5", 3, 53},
+  {"INC6", 0, 54}, {"DEC6", 1, 54}, {"ENT6", 2, 54}, {"ENN6", 3, 54},
+  {"INCX", 0, 55}, {"DECX", 1, 55}, {"ENTX", 2, 55}, {"ENNX", 3, 55},
+  {"CMPA", 5, 56}, {"CMP1", 5, 57}, {"CMP2", 5, 58}, {"CMP3", 5, 59},
+  {"CMP4", 5, 60}, {"CMP5", 5, 61}, {"CMP6", 5, 62}, {"CMPX", 5, 63},
+  {"FADD", 6, 1}, {"FSUB", 6, 2}, {"FMUL", 6, 3}, {"FDIV", 6, 4}, {"FLOT", 6, 5},
+  {"FIX", 7, 5}, {"FCMP", 6, 56},
+  {"SLB", 6, 6}, {"SRB", 7, 6}, {"JAE", 6, 40}, {"JAO", 7, 40}, {"J1E", 6, 41},
+  {"J1O", 7, 41}, {"J2E", 6, 42}, {"J2O", 7, 42}, {"J3E", 6, 43}, {"J3O", 7, 43},
+  {"J4E", 6, 44}, {"J4O", 7, 44}, {"J5E", 6, 45}, {"J5O", 7, 45},
+  {"J6E", 6, 46}, {"J6O", 7, 46}, {"JXE", 6, 47}, {"JXO", 7, 47},
+  {"INT", 9, 5}
 };
+const int NUMMIXOPS = sizeof(MIXOPS)/sizeof(mixop);
 
 void initparsestate(parsestate *ps) {
   ps->star = 0;
   ps->numsyms = 0;
+  ps->maxsyms = 256;
+  ps->syms = malloc(ps->maxsyms * sizeof(symbol));
+  ps->symtablesize = 512;
+  ps->symtable = malloc(ps->symtablesize * sizeof(int));
+  for (int i = 0; i < ps->symtablesize; i++)
+    ps->symtable[i] = -1;
   ps->numfuturerefs = 0;
+  ps->maxfuturerefs = 256;
+  ps->futurerefs = malloc(ps->maxfuturerefs * sizeof(futureref));
   for (int i = 0; i < 10; i++)
     ps->localsymcounts[i] = 0;
+  ps->line = 0;
+  ps->lastdefined = -1;
+  ps->numlines = 0;
+  ps->maxlines = 256;
+  ps->lines = malloc(ps->maxlines * sizeof(lineinfo));
+  ps->numsymrefs = 0;
+  ps->maxsymrefs = 256;
+  ps->symrefs = malloc(ps->maxsymrefs * sizeof(int));
+  ps->relocs = malloc(4000 * sizeof(int));
+  for (int i = 0; i < 4000; i++)
+    ps->relocs[i] = RELOC_ABS;
+  ps->exprreloc = RELOC_ABS;
+  ps->pooled = 0;
+  ps->nummacros = 0;
+  ps->maxmacros = 16;
+  ps->macros = malloc(ps->maxmacros * sizeof(macro));
+  ps->rept.body = NULL;
+  ps->rept.len = ps->rept.size = 0;
+  ps->reptcount = 0;
+  ps->recording = MACRO_NONE;
+  ps->recorddepth = 0;
+  ps->expanddepth = 0;
+  ps->ifdepth = 0;
+  ps->skipfrom = 0;
 }
 
-bool lookupsym(char *sym, word *val, parsestate *ps) {
-  for (int i = 0; i < ps->numsyms; i++) {
-    if (!strcmp(sym, ps->syms[i])) {
-      *val = ps->symvals[i];
-      return true;
-    }
+void freeparsestate(parsestate *ps) {
+  free(ps->syms);
+  free(ps->symtable);
+  free(ps->futurerefs);
+  free(ps->lines);
+  free(ps->symrefs);
+  free(ps->relocs);
+  for (int i = 0; i < ps->nummacros; i++)
+    free(ps->macros[i].body);
+  free(ps->macros);
+  free(ps->rept.body);
+}
+
+uint64_t hashsource(const char *buf, size_t len) {
+  uint64_t h = 14695981039346656037u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)buf[i]) * 1099511628211u;
+  return h;
+}
+
+// FNV-1a
+static uint32_t hashsym(char *sym) {
+  uint32_t h = 2166136261u;
+  while (*sym)
+    h = (h ^ (unsigned char)*(sym++)) * 16777619u;
+  return h;
+}
+
+// The slot in the hash table holding the symbol, or the empty slot
+// where it would go.
+static int *findslot(char *sym, parsestate *ps) {
+  uint32_t mask = ps->symtablesize - 1;
+  uint32_t h = hashsym(sym) & mask;
+  while (ps->symtable[h] >= 0 && strcmp(ps->syms[ps->symtable[h]].name, sym))
+    h = (h+1) & mask;
+  return &ps->symtable[h];
+}
+
+// Find the symbol, adding it as undefined if it is not there yet.
+static symbol *findsym(char *sym, parsestate *ps) {
+  int *slot = findslot(sym, ps);
+  if (*slot >= 0)
+    return &ps->syms[*slot];
+
+  if (ps->numsyms == ps->maxsyms) {
+    ps->maxsyms *= 2;
+    ps->syms = realloc(ps->syms, ps->maxsyms * sizeof(symbol));
   }
-  return false;
+  // Keep the table at most half full.
+  if (2*(ps->numsyms+1) > ps->symtablesize) {
+    free(ps->symtable);
+    ps->symtablesize *= 2;
+    ps->symtable = malloc(ps->symtablesize * sizeof(int));
+    for (int i = 0; i < ps->symtablesize; i++)
+      ps->symtable[i] = -1;
+    for (int i = 0; i < ps->numsyms; i++)
+      *findslot(ps->syms[i].name, ps) = i;
+    slot = findslot(sym, ps);
+  }
+  symbol *s = &ps->syms[ps->numsyms];
+  strcpy(s->name, sym);
+  s->val = POS(0);
+  s->defined = false;
+  s->fixups = -1;
+  s->reloc = RELOC_ABS;
+  s->external = false;
+  s->exported = false;
+  *slot = ps->numsyms++;
+  return s;
+}
+
+// The index of the symbol if it is defined (by the current line), or -1.
+static int findvisible(char *sym, parsestate *ps) {
+  int i = *findslot(sym, ps);
+  if (i < 0 || !ps->syms[i].defined || ps->syms[i].line > ps->line)
+    return -1;
+  return i;
+}
+
+bool lookupsym(char *sym, word *val, parsestate *ps) {
+  int i = findvisible(sym, ps);
+  if (i < 0)
+    return false;
+  *val = ps->syms[i].val;
+  return true;
+}
+
+static void definesym(char *sym, word val, byte reloc, parsestate *ps) {
+  symbol *s = findsym(sym, ps);
+  ps->lastdefined = s - ps->syms;
+  // Like lookups always did, keep the first definition.
+  if (s->defined)
+    return;
+  s->val = val;
+  s->reloc = reloc;
+  s->defined = true;
+  s->line = ps->line;
 }
 
 void addsym(char *sym, word val, parsestate *ps) {
-  strcpy(ps->syms[ps->numsyms], sym);
-  ps->symvals[ps->numsyms] = val;
-  ps->numsyms++;
+  definesym(sym, val, RELOC_ABS, ps);
+}
+
+// Define the symbol as the current location.
+static void addlabel(char *sym, parsestate *ps) {
+  definesym(sym, FROMINT(ps->star), ps->star >= 0 ? RELOC_REL : RELOC_ABS, ps);
+}
+
+// The relocation of an address given by symbol i.
+static int symreloc(int i, parsestate *ps) {
+  return ps->syms[i].external ? RELOC_EXT+i : ps->syms[i].reloc;
+}
+
+static void setreloc(int addr, int reloc, parsestate *ps) {
+  if (0 <= addr && addr < 4000)
+    ps->relocs[addr] = reloc;
+}
+
+// Record that the current line uses the symbol.
+static void addsymref(int i, parsestate *ps) {
+  if (ps->numsymrefs == ps->maxsymrefs) {
+    ps->maxsymrefs *= 2;
+    ps->symrefs = realloc(ps->symrefs, ps->maxsymrefs * sizeof(int));
+  }
+  ps->symrefs[ps->numsymrefs++] = i;
+}
+
+// Look the symbol up for an expression, recording the use and its
+// relocation.
+static bool usesym(char *sym, word *val, parsestate *ps) {
+  int i = findvisible(sym, ps);
+  if (i < 0)
+    return false;
+  addsymref(i, ps);
+  *val = ps->syms[i].val;
+  ps->exprreloc = symreloc(i, ps);
+  return true;
+}
+
+static void addfutureref(futureref fr, parsestate *ps) {
+  if (ps->numfuturerefs == ps->maxfuturerefs) {
+    ps->maxfuturerefs *= 2;
+    ps->futurerefs = realloc(ps->futurerefs, ps->maxfuturerefs * sizeof(futureref));
+  }
+  fr.next = -1;
+  if (!fr.which) {
+    symbol *s = findsym(fr.sym, ps);
+    fr.next = s->fixups;
+    s->fixups = ps->numfuturerefs;
+    addsymref(s - ps->syms, ps);
+  }
+  ps->futurerefs[ps->numfuturerefs++] = fr;
+}
+
+// Take the future reference out of its symbol's chain.
+static void unlinkfutureref(int i, parsestate *ps) {
+  futureref *fr = &ps->futurerefs[i];
+  if (fr->which)
+    return;
+  int *j = &findsym(fr->sym, ps)->fixups;
+  while (*j >= 0 && *j != i)
+    j = &ps->futurerefs[*j].next;
+  if (*j == i)
+    *j = fr->next;
+  fr->next = -1;
 }
 
 bool parsesym(char **s, char *sym) {
@@ -112,29 +282,75 @@ err:
   return false;
 }
 
-#define ISSPECIALOP(s) (!strcmp(s, "EQU") || !strcmp(s, "ORIG") || !strcmp(s, "CON") || \
-			!strcmp(s, "ALF") || !strcmp(s, "END"))
+char *SPECIALOPS[] = { "EQU", "ORIG", "CON", "ALF", "END", "EXT", "ENT",
+		       "MAC", "ENDM", "REPT", "ENDR", "IF", "ELSE", "FI" };
+
+// Mnemonics are looked up by packing their (up to 4) characters into
+// an integer, and hashing it by multiplication into a table of
+// 1<<OPHASHBITS slots.  The multiplier was found by trying random odd
+// numbers until every mnemonic got a slot of its own, so a lookup is a
+// single probe; if an operation is added that collides, the lookup
+// still works through linear probing, but a new multiplier should be
+// found.
+#define OPHASHBITS 11
+#define OPHASHMULT 0x53740903u
+#define OPHASH(key) ((uint32_t)((key) * OPHASHMULT) >> (32-OPHASHBITS))
+
+static uint32_t opkeys[1 << OPHASHBITS];
+// 0 for an empty slot, -1 for an assembler directive, and i+1 for
+// MIXOPS[i].
+static int16_t opslots[1 << OPHASHBITS];
+
+static uint32_t packop(const char *op) {
+  uint32_t key = 0;
+  for (int i = 0; op[i] != '\0'; i++)
+    key |= (uint32_t)(unsigned char)op[i] << 8*i;
+  return key;
+}
+
+static void addop(const char *op, int16_t val) {
+  uint32_t key = packop(op);
+  uint32_t h = OPHASH(key);
+  while (opslots[h] != 0)
+    h = (h+1) & ((1 << OPHASHBITS) - 1);
+  opkeys[h] = key;
+  opslots[h] = val;
+}
+
+static void buildophash() {
+  for (int i = 0; i < NUMMIXOPS; i++)
+    addop(MIXOPS[i].name, i+1);
+  for (int i = 0; i < sizeof(SPECIALOPS)/sizeof(char*); i++)
+    addop(SPECIALOPS[i], -1);
+}
 
 bool parseOP(char **s, char *op, int *opidx) {
+  static bool built = false;
+  if (!built) {
+    buildophash();
+    built = true;
+  }
+
   SKIPSPACES(*s);
-  char *t = *s, *start = *s, *opstart = op;
+  char *t = *s, *start = *s;
+  uint32_t key = 0;
   int i = 0;
   char c;
-  while (i++, !isspace(c = *(t++))) {
-    if (i > 4) goto err;
-    *(op++) = toupper(c);
+  while (!isspace(c = *(t++))) {
+    if (i >= 4) goto err;
+    c = toupper(c);
+    key |= (uint32_t)(unsigned char)c << 8*i;
+    op[i++] = c;
   }
   *s = t-1;
-  *op = '\0';
-  if (ISSPECIALOP(opstart)) {
-    *opidx = -1;
-    return true;
-  }
-  for (int i = 0; i < sizeof(MIXOPS)/sizeof(char*); i++) {
-    if (!strcmp(opstart, MIXOPS[i])) {
-      *opidx = i;
+  op[i] = '\0';
+  uint32_t h = OPHASH(key);
+  while (opslots[h] != 0) {
+    if (opkeys[h] == key) {
+      *opidx = opslots[h] > 0 ? opslots[h]-1 : -1;
       return true;
     }
+    h = (h+1) & ((1 << OPHASHBITS) - 1);
   }
 err:
   *s = start;
@@ -176,22 +392,20 @@ bool parseatomic(char **s, word *val, parsestate *ps) {
   int i;
   if (isdigit(**s) && parsenum(s, &i)) {
     *val = POS(i);
+    ps->exprreloc = RELOC_ABS;
   }
   else if (**s == '*') {
     (*s)++;
-    *val = POS(ps->star);
+    *val = FROMINT(ps->star);
+    ps->exprreloc = ps->star >= 0 ? RELOC_REL : RELOC_ABS;
   }
   else {
     char sym[11];
     if (!parsesym(s, sym))
       goto err;
-    if (isdigit(sym[0]) && sym[1] == 'B' && sym[2] == '\0') {
-      sym[1] = 'H';
-      sym[2] = '#';
-      sym[3] = '0' + ps->localsymcounts[sym[0]-'0'] - 1;
-      sym[4] = '\0';
-    }
-    if (!lookupsym(sym, &i, ps))
+    if (isdigit(sym[0]) && sym[1] == 'B' && sym[2] == '\0')
+      snprintf(sym+1, sizeof(sym)-1, "H#%d", ps->localsymcounts[sym[0]-'0'] - 1);
+    if (!usesym(sym, &i, ps))
       goto err;
     *val = i;
   }
@@ -206,6 +420,10 @@ bool parseexpr(char **s, word *val, parsestate *ps) {
   char *start = *s;
   word final = POS(0), w;
   char prevsign = '\0';
+  // The relocation of the expression: how many times a location is
+  // added in, and the imported symbol added in, if any.
+  int rel = 0, ext = -1;
+  bool bad = false;
   if (**s == '+') {
     (*s)++;
     prevsign = '+';
@@ -217,7 +435,24 @@ bool parseexpr(char **s, word *val, parsestate *ps) {
 start:
   if (!parseatomic(s, &w, ps))
     goto err;
-  
+
+  int r = ps->exprreloc;
+  if (r == RELOC_BAD)
+    bad = true;
+  if (prevsign == '\0' || prevsign == '+') {
+    rel += r == RELOC_REL;
+    if (r >= RELOC_EXT) {
+      bad = bad || ext >= 0;
+      ext = r - RELOC_EXT;
+    }
+  }
+  else if (prevsign == '-') {
+    rel -= r == RELOC_REL;
+    bad = bad || r >= RELOC_EXT;
+  }
+  else
+    bad = bad || rel != 0 || ext >= 0 || r != RELOC_ABS;
+
   if (prevsign == '\0')
     final = w;
   else if (prevsign == '+')
@@ -257,6 +492,10 @@ start:
     goto start;
   }
   *val = final;
+  if (bad || rel < 0 || rel > 1 || (rel == 1 && ext >= 0))
+    ps->exprreloc = RELOC_BAD;
+  else
+    ps->exprreloc = ext >= 0 ? RELOC_EXT+ext : rel;
   return true;
 err:
   *s = start;
@@ -271,18 +510,14 @@ bool parseA(char **s, word *val, parsestate *ps) {
   if (parseexpr(s, val, ps))
     return true;
   else if (parsesym(s, sym)) {  // If it is a future reference
-    if (isdigit(sym[0]) && sym[1] == 'F' && sym[2] == '\0') {
-      sym[1] = 'H';
-      sym[2] = '#';
-      sym[3] = '0' + ps->localsymcounts[sym[0]-'0'];
-      sym[4] = '\0';
-    }
+    if (isdigit(sym[0]) && sym[1] == 'F' && sym[2] == '\0')
+      sprintf(sym+1, "H#%d", ps->localsymcounts[sym[0]-'0']);
     futureref fr;
     fr.resolved = false;
     fr.addr = ps->star;
     fr.which = false;
     strcpy(fr.sym, sym);
-    ps->futurerefs[ps->numfuturerefs++] = fr;
+    addfutureref(fr, ps);
   }
   else if (**s == '=') {        // If it is a local constant
     word w;
@@ -296,9 +531,10 @@ bool parseA(char **s, word *val, parsestate *ps) {
     fr.addr = ps->star;
     fr.which = true;
     fr.literal = w;
-    ps->futurerefs[ps->numfuturerefs++] = fr;
+    addfutureref(fr, ps);
   }
   *val = POS(0);  // The A-field will be filled in later.
+  ps->exprreloc = RELOC_ABS;
   return true;
 err:
   *s = start;
@@ -374,11 +610,176 @@ err:
   return false;
 }
 
+// The operation of the line, in upper case, or "" for a comment.
+static void lineop(char *line, char *op) {
+  int i = 0;
+  if (line[0] != '*') {
+    while (!isspace(*line))
+      line++;
+    SKIPSPACES(line);
+    for (; i < 10 && !isspace(line[i]); i++)
+      op[i] = toupper(line[i]);
+  }
+  op[i] = '\0';
+}
+
+static void appendline(macro *m, char *line) {
+  int len = strchr(line, '\n') - line + 1;
+  if (m->len + len > m->size) {
+    m->size = 2*(m->len + len);
+    m->body = realloc(m->body, m->size);
+  }
+  memcpy(m->body + m->len, line, len);
+  m->len += len;
+}
+
+static int findmacro(char *name, parsestate *ps) {
+  for (int i = 0; i < ps->nummacros; i++)
+    if (!strcmp(ps->macros[i].name, name))
+      return i;
+  return -1;
+}
+
+// Parse the lines of the macro (or REPT), with each parameter replaced
+// by its argument, or nothing if there are fewer arguments.
+static bool expand(macro *m, char **args, int numargs, parsestate *ps, mix *mix) {
+  // Don't let a macro use itself forever.
+  if (ps->expanddepth >= 64)
+    return false;
+  ps->expanddepth++;
+  char out[4*LINELEN];
+  extraparseinfo extraparseinfo;
+  bool ok = true;
+  for (char *line = m->body; ok && line < m->body + m->len; ) {
+    char *next = memchr(line, '\n', m->body + m->len - line) + 1;
+    int n = 0;
+    for (char *t = line; ok && t < next; ) {
+      char *with = t, *end = t+1;
+      if (isalnum(*t)) {
+	while (isalnum(*end))
+	  end++;
+	for (int i = 0; i < m->numparams; i++) {
+	  if (strlen(m->params[i]) == end-t && !strncasecmp(m->params[i], t, end-t)) {
+	    with = i < numargs ? args[i] : "";
+	    break;
+	  }
+	}
+      }
+      int len = with == t ? end-t : strlen(with);
+      ok = n + len < sizeof(out);
+      if (ok) {
+	memcpy(out+n, with, len);
+	n += len;
+      }
+      t = end;
+    }
+    out[n] = '\0';
+    ok = ok && parseline(out, ps, mix, &extraparseinfo) && !extraparseinfo.isend;
+    line = next;
+  }
+  ps->expanddepth--;
+  return ok;
+}
+
+// Record a line of a macro or REPT, up to its ENDM or ENDR.  At ENDR,
+// the lines are repeated.
+static bool recordline(char *line, parsestate *ps, mix *mix, extraparseinfo *extraparseinfo) {
+  extraparseinfo->kind = LINE_MACRO;
+  char op[11];
+  lineop(line, op);
+  bool end = !strcmp(op, "ENDM") || !strcmp(op, "ENDR");
+  if (!strcmp(op, "MAC") || !strcmp(op, "REPT"))
+    ps->recorddepth++;
+  else if (end && ps->recorddepth > 0)
+    ps->recorddepth--;
+  else if (end) {
+    bool rept = ps->recording == MACRO_REPT;
+    ps->recording = MACRO_NONE;
+    if (strcmp(op, rept ? "ENDR" : "ENDM"))
+      return false;
+    if (!rept)
+      return true;
+    // Take the lines out of ps->rept, in case they have a REPT too.
+    macro m = ps->rept;
+    ps->rept.body = NULL;
+    ps->rept.len = ps->rept.size = 0;
+    // The count too, as a REPT in the lines sets it.
+    int reptcount = ps->reptcount;
+    bool ok = true;
+    for (int i = 0; ok && i < reptcount; i++) {
+      char count[11];
+      char *args[1] = {count};
+      sprintf(count, "%d", i);
+      ok = expand(&m, args, 1, ps, mix);
+    }
+    free(m.body);
+    return ok;
+  }
+  appendline(ps->recording == MACRO_REPT ? &ps->rept : &ps->macros[ps->recording], line);
+  return true;
+}
+
+// Skip a line of an IF or ELSE whose lines aren't assembled, keeping
+// track of the IFs in it.
+static bool skipline(char *line, parsestate *ps, extraparseinfo *extraparseinfo) {
+  extraparseinfo->kind = LINE_MACRO;
+  char op[11];
+  lineop(line, op);
+  if (!strcmp(op, "IF"))
+    ps->ifdepth++;
+  else if (!strcmp(op, "ELSE") && ps->skipfrom == ps->ifdepth)
+    ps->skipfrom = 0;
+  else if (!strcmp(op, "FI")) {
+    if (ps->skipfrom == ps->ifdepth)
+      ps->skipfrom = 0;
+    ps->ifdepth--;
+  }
+  return true;
+}
+
+// Use the macro in line, whose label (if any) is in sym.
+static bool callmacro(char *line, bool parseLOC, char *sym, parsestate *ps, mix *mix) {
+  char name[11];
+  int i;
+  if (!parsesym(&line, name) || (i = findmacro(name, ps)) < 0)
+    return false;
+  if (parseLOC)
+    addlabel(sym, ps);
+
+  // The arguments are separated by commas, and end at a blank.
+  SKIPSPACES(line);
+  int len = 0;
+  while (!isspace(line[len]))
+    len++;
+  char argtext[len+1];
+  memcpy(argtext, line, len);
+  argtext[len] = '\0';
+  char *args[10];
+  int numargs = 0;
+  for (char *arg = argtext; len > 0; arg++) {
+    if (numargs == ps->macros[i].numparams)
+      return false;
+    args[numargs++] = arg;
+    arg = strchr(arg, ',');
+    if (arg == NULL)
+      break;
+    *arg = '\0';
+  }
+  // The macro is copied, since it can define macros.
+  macro m = ps->macros[i];
+  return expand(&m, args, numargs, ps, mix);
+}
+
 // Parse line, returning the status and updating the parse state and
 // mix instance.
 bool parseline(char *line, parsestate *ps, mix *mix, extraparseinfo *extraparseinfo) {
   extraparseinfo->setdebugline = false;
   extraparseinfo->isend = false;
+  extraparseinfo->kind = LINE_NONE;
+  if (ps->recording != MACRO_NONE)
+    return recordline(line, ps, mix, extraparseinfo);
+  if (ps->skipfrom > 0)
+    return skipline(line, ps, extraparseinfo);
   if (line[0] == '*')  // Ignore comments
     return true;
 
@@ -393,91 +794,204 @@ bool parseline(char *line, parsestate *ps, mix *mix, extraparseinfo *extraparsei
   // Annotate local symbol with its current instance number.
   // Note the new symbol has a # which is non-alphanumeric, hence
   // it will not collide with a user-defined symbol.
-  if (isdigit(sym[0]) && sym[1] == 'H' && sym[2] == '\0') {
+  if (parseLOC && isdigit(sym[0]) && sym[1] == 'H' && sym[2] == '\0') {
     int i = sym[0]-'0';
-    if (ps->localsymcounts[i] >= 9)
+    if (ps->localsymcounts[i] >= 9999999)
       return false;
-    sym[2] = '#';
-    sym[3] = '0' + (ps->localsymcounts[i])++;
-    sym[4] = '\0';
+    snprintf(sym+2, sizeof(sym)-2, "#%d", ps->localsymcounts[i]++);
   }
 
-  if (!parseOP(&line, op, &opidx))
-    return false;
+  if (!parseOP(&line, op, &opidx)) {
+    extraparseinfo->kind = LINE_MACRO;
+    return callmacro(line, parseLOC, sym, ps, mix);
+  }
   if (opidx >= 0) {
-    C = POS(OPCODES[opidx]);
-    F = POS(DEFAULTOPFIELDS[opidx]);
+    C = POS(MIXOPS[opidx].code);
+    F = POS(MIXOPS[opidx].field);
   }
 
   if (parseLOC && !strcmp(op, "EQU")) {
     if (!parseW(&line, &val, ps))
       return false;
-    addsym(sym, val, ps);
+    definesym(sym, val, ps->exprreloc < RELOC_EXT ? ps->exprreloc : RELOC_BAD, ps);
+    extraparseinfo->kind = LINE_EQU;
+  }
+  else if (!strcmp(op, "EXT")) {
+    // The symbol is defined in another module, and is 0 until the
+    // modules are linked.
+    if (!parseLOC || findsym(sym, ps)->defined)
+      return false;
+    definesym(sym, POS(0), RELOC_ABS, ps);
+    ps->syms[ps->lastdefined].external = true;
+    extraparseinfo->kind = LINE_LINK;
   }
+  else if (!strcmp(op, "ENT")) {
+    char export[11];
+    if (parseLOC || !parsesym(&line, export))
+      return false;
+    findsym(export, ps)->exported = true;
+    extraparseinfo->kind = LINE_LINK;
+  }
+  else if (!strcmp(op, "MAC")) {
+    if (!parseLOC || findmacro(sym, ps) >= 0)
+      return false;
+    macro m;
+    strcpy(m.name, sym);
+    m.numparams = 0;
+    SKIPSPACES(line);
+    while (!isspace(*line)) {
+      if (m.numparams == 10 || !parsesym(&line, m.params[m.numparams++]))
+	return false;
+      if (*line == ',')
+	line++;
+    }
+    m.body = NULL;
+    m.len = m.size = 0;
+    if (ps->nummacros == ps->maxmacros) {
+      ps->maxmacros *= 2;
+      ps->macros = realloc(ps->macros, ps->maxmacros * sizeof(macro));
+    }
+    ps->recording = ps->nummacros;
+    ps->recorddepth = 0;
+    ps->macros[ps->nummacros++] = m;
+    extraparseinfo->kind = LINE_MACRO;
+  }
+  else if (!strcmp(op, "REPT")) {
+    // The label is replaced by the number of the repetition, from 0.
+    if (!parseW(&line, &val, ps) || (int)INT(val) < 0)
+      return false;
+    ps->reptcount = INT(val);
+    ps->rept.numparams = parseLOC;
+    if (parseLOC)
+      strcpy(ps->rept.params[0], sym);
+    ps->rept.len = 0;
+    ps->recording = MACRO_REPT;
+    ps->recorddepth = 0;
+    extraparseinfo->kind = LINE_MACRO;
+  }
+  else if (!strcmp(op, "IF")) {
+    if (parseLOC || !parseW(&line, &val, ps))
+      return false;
+    ps->ifdepth++;
+    if (MAG(val) == 0)
+      ps->skipfrom = ps->ifdepth;
+    extraparseinfo->kind = LINE_MACRO;
+  }
+  else if (!strcmp(op, "ELSE") || !strcmp(op, "FI")) {
+    // The lines up to here were assembled, so the ELSE part isn't.
+    if (parseLOC || ps->ifdepth == 0)
+      return false;
+    if (op[0] == 'E')
+      ps->skipfrom = ps->ifdepth;
+    else
+      ps->ifdepth--;
+    extraparseinfo->kind = LINE_MACRO;
+  }
+  else if (!strcmp(op, "ENDM") || !strcmp(op, "ENDR"))
+    return false;
   else if (!strcmp(op, "ORIG")) {
     if (parseLOC)
-      addsym(sym, POS(ps->star), ps);
+      addlabel(sym, ps);
     if (!parseW(&line, &val, ps))
       return false;
-    if (INT(val) < 0 || INT(val) >= 4000)
+    // Negative locations hold the control state code (see README).
+    if ((int)INT(val) <= -4000 || (int)INT(val) >= 4000)
       return false;
     ps->star = INT(val);
+    extraparseinfo->kind = LINE_ORIG;
   }
   else if (!strcmp(op, "CON")) {
     if (parseLOC)
-      addsym(sym, POS(ps->star), ps);
+      addlabel(sym, ps);
     if (!parseW(&line, &val, ps))
       return false;
-    mix->mem[ps->star++] = val;
+    MEMORY(mix, ps->star) = val;
+    setreloc(ps->star, RELOC_ABS, ps);
+    ps->star++;
     extraparseinfo->setdebugline = true;
+    extraparseinfo->kind = LINE_CELL;
   }
   else if (!strcmp(op, "ALF")) {
     if (parseLOC)
-      addsym(sym, POS(ps->star), ps);
+      addlabel(sym, ps);
     char alf[5];
     if (!parseALF(&line, alf, ps))
       return false;
     for (int i = 0; i < 5; i++)
       alf[i] = mixord(alf[i]);
-    mix->mem[ps->star++] = WORD(true, alf[0], alf[1], alf[2], alf[3], alf[4]);
+    MEMORY(mix, ps->star) = WORD(true, alf[0], alf[1], alf[2], alf[3], alf[4]);
+    setreloc(ps->star, RELOC_ABS, ps);
+    ps->star++;
     extraparseinfo->setdebugline = true;
+    extraparseinfo->kind = LINE_CELL;
   }
   else if (!strcmp(op, "END")) {
-    // Handle future references
-    for (int i = 0; i < ps->numfuturerefs; i++) {
-      futureref *fr = &ps->futurerefs[i];
-      if (!fr->which && lookupsym(fr->sym, &val, ps)) {
+    if (ps->ifdepth > 0)
+      return false;
+    // Handle future references, by following each defined symbol's
+    // chain of references.
+    for (int i = 0; i < ps->numsyms; i++) {
+      symbol *s = &ps->syms[i];
+      if (!s->defined)
+	continue;
+      for (int j = s->fixups; j >= 0; j = ps->futurerefs[j].next) {
+	futureref *fr = &ps->futurerefs[j];
 	fr->resolved = true;
-	word instr = mix->mem[fr->addr];
-	mix->mem[fr->addr] = INSTR(ADDR(INT(val)), getI(instr), getF(instr), getC(instr));
+	word instr = MEMORY(mix, fr->addr);
+	MEMORY(mix, fr->addr) = INSTR(ADDR(INT(s->val)), getI(instr), getF(instr), getC(instr));
+	setreloc(fr->addr, symreloc(i, ps), ps);
       }
     }
 
-    // Handle literal constants and undefined symbols
+    // Handle literal constants and undefined symbols.  Literals with
+    // the same value share a cell, which is found through a hash table
+    // of the cells by their values.
+    int bits = 1;
+    while ((1 << bits) < 2*ps->numfuturerefs)
+      bits++;
+    int *pool = malloc((1 << bits) * sizeof(int));
+    for (int i = 0; i < 1 << bits; i++)
+      pool[i] = INT_MIN;
     for (int i = 0; i < ps->numfuturerefs; i++) {
       futureref *fr = &ps->futurerefs[i];
-      word val = fr->which ? fr->literal : POS(0);
+      if (fr->resolved)
+	continue;
       int addr = ps->star;
-      if (!fr->resolved) {
-	// Check if the symbol is already defined
-	// (happens with the non-first instances of an undefined symbol).
-	if (!fr->which) {
-	  word tmp;
-	  if (lookupsym(fr->sym, &tmp, ps))
-	    addr = INT(tmp);
-	  else
-	    addsym(fr->sym, POS(ps->star), ps);
+      if (fr->which) {
+	uint32_t h = (uint32_t)(fr->literal * 0x9e3779b1u) >> (32-bits);
+	while (pool[h] != INT_MIN && MEMORY(mix, pool[h]) != fr->literal)
+	  h = (h+1) & ((1 << bits) - 1);
+	if (pool[h] != INT_MIN) {
+	  addr = pool[h];
+	  ps->pooled++;
+	}
+	else
+	  pool[h] = addr;
+      }
+      else {
+	// The symbol is defined by its first reference.
+	word tmp;
+	if (lookupsym(fr->sym, &tmp, ps)) {
+	  addr = INT(tmp);
+	  ps->pooled++;
 	}
-	word instr = mix->mem[fr->addr];
-	mix->mem[fr->addr] = INSTR(ADDR(addr), getI(instr), getF(instr), getC(instr));
-	mix->mem[ps->star] = val;
+	else
+	  addlabel(fr->sym, ps);
+      }
+      if (addr == ps->star) {
+	MEMORY(mix, ps->star) = fr->which ? fr->literal : POS(0);
+	setreloc(ps->star, RELOC_ABS, ps);
 	ps->star++;
-	fr->resolved = true;
       }
+      word instr = MEMORY(mix, fr->addr);
+      MEMORY(mix, fr->addr) = INSTR(ADDR(addr), getI(instr), getF(instr), getC(instr));
+      setreloc(fr->addr, addr >= 0 ? RELOC_REL : RELOC_ABS, ps);
+      fr->resolved = true;
     }
+    free(pool);
 
     if (parseLOC)
-      addsym(sym, POS(ps->star), ps);
+      addlabel(sym, ps);
 
     if (!parseW(&line, &val, ps))
       return false;
@@ -485,18 +999,296 @@ bool parseline(char *line, parsestate *ps, mix *mix, extraparseinfo *extraparsei
       return false;
     mix->PC = INT(val);
     extraparseinfo->isend = true;
+    extraparseinfo->kind = LINE_END;
   }
   else {  // Parse a normal MIX operation
     if (parseLOC)
-      addsym(sym, POS(ps->star), ps);
+      addlabel(sym, ps);
     if (!parseA(&line, &A, ps)) return false;
+    int reloc = ps->exprreloc;
     if (!parseI(&line, &I, ps)) return false;
     if (!parseF(&line, &F, ps)) return false;
     if (INT(I) < 0 || INT(I) > 6) return false;
     if (INT(F) < 0 || INT(F) >= 64) return false;
-    mix->mem[ps->star++] = INSTR(ADDR(INT(A)), (byte)I, INT(F), INT(C));
+    MEMORY(mix, ps->star) = INSTR(ADDR(INT(A)), (byte)I, INT(F), INT(C));
+    setreloc(ps->star, reloc, ps);
+    ps->star++;
     extraparseinfo->setdebugline = true;
+    extraparseinfo->kind = LINE_CELL;
+  }
+
+  return true;
+}
+
+static void addline(lineinfo li, parsestate *ps) {
+  if (ps->numlines == ps->maxlines) {
+    ps->maxlines *= 2;
+    ps->lines = realloc(ps->lines, ps->maxlines * sizeof(lineinfo));
   }
+  ps->lines[ps->numlines++] = li;
+}
 
+bool assemble(char *src, size_t len, parsestate *ps, mix *mix, sourceinfo *info) {
+  for (int i = 0; i < 4000; i++)
+    info->srcoffsets[i] = -1;
+  info->errline = 0;
+  extraparseinfo extraparseinfo;
+  char *end = src + len;
+  for (char *line = src; line < end; ) {
+    char *next = memchr(line, '\n', end-line);
+    next = next == NULL ? end : next+1;
+    ps->line++;
+    lineinfo li;
+    li.hash = hashsource(line, next-line);
+    li.offset = line - src;
+    li.star = ps->star;
+    memcpy(li.localsymcounts, ps->localsymcounts, sizeof(li.localsymcounts));
+    li.firstsymref = ps->numsymrefs;
+    int numfuturerefs = ps->numfuturerefs;
+    ps->lastdefined = -1;
+    if (!parseline(line, ps, mix, &extraparseinfo)) {
+      info->errline = ps->line;
+      return false;
+    }
+    li.kind = extraparseinfo.kind;
+    li.sym = ps->lastdefined;
+    li.ref = ps->numfuturerefs > numfuturerefs ? numfuturerefs : -1;
+    li.numsymrefs = ps->numsymrefs - li.firstsymref;
+    addline(li, ps);
+    if (extraparseinfo.setdebugline && ps->star > 0)
+      info->srcoffsets[ps->star-1] = line - src;
+    // The cells of a macro are shown with the line using it.
+    if (li.kind == LINE_MACRO)
+      for (int i = li.star < 0 ? 0 : li.star; i < ps->star && i < 4000; i++)
+	info->srcoffsets[i] = line - src;
+    if (extraparseinfo.isend)
+      return true;
+    line = next;
+  }
+  // A MAC, REPT or IF that isn't closed
+  if (ps->recording != MACRO_NONE || ps->ifdepth > 0) {
+    info->errline = ps->line;
+    return false;
+  }
   return true;
-}
\ No newline at end of file
+}
+
+// The address in the A-field of an instruction.
+static int addressof(word instr) {
+  int A = getA(instr);
+  return (A >> 12) & 1 ? A & ONES(12) : -(A & ONES(12));
+}
+
+// Parse line number i (counting from 0) again, in the state the
+// assembler was in before it.  If the line is an EQU whose value
+// changed, set *changed to its symbol.
+static bool reparseline(char *line, int i, int lastline, parsestate *ps, mix *mix, int *changed) {
+  lineinfo *li = &ps->lines[i];
+  if (li->kind == LINE_ORIG || li->kind == LINE_END || li->kind == LINE_LINK ||
+      li->kind == LINE_MACRO)
+    return false;
+  ps->line = i+1;
+  ps->star = li->star;
+  memcpy(ps->localsymcounts, li->localsymcounts, sizeof(li->localsymcounts));
+
+  // Let an EQU define its symbol again.
+  word oldval;
+  byte oldreloc;
+  if (li->kind == LINE_EQU) {
+    oldval = ps->syms[li->sym].val;
+    oldreloc = ps->syms[li->sym].reloc;
+    ps->syms[li->sym].defined = false;
+  }
+  // The cell that was allocated for the line's literal, if any.
+  int literalcell = -1;
+  if (li->ref >= 0 && ps->futurerefs[li->ref].which)
+    literalcell = addressof(MEMORY(mix, li->star));
+
+  int numsymrefs = ps->numsymrefs;
+  int numfuturerefs = ps->numfuturerefs;
+  extraparseinfo extraparseinfo;
+  ps->lastdefined = -1;
+  if (!parseline(line, ps, mix, &extraparseinfo))
+    return false;
+  if (extraparseinfo.kind != li->kind || ps->lastdefined != li->sym ||
+      ps->star != li->star + (li->kind == LINE_CELL))
+    return false;
+  if (li->kind == LINE_EQU &&
+      (ps->syms[li->sym].val != oldval || ps->syms[li->sym].reloc != oldreloc))
+    *changed = li->sym;
+
+  // Resolve the line's future reference straight away, as END would.
+  int ref = ps->numfuturerefs > numfuturerefs ? numfuturerefs : -1;
+  if (ref >= 0) {
+    futureref *fr = &ps->futurerefs[ref];
+    int addr, reloc;
+    if (fr->which) {
+      if (literalcell < 0)
+	return false;
+      addr = literalcell;
+      reloc = addr >= 0 ? RELOC_REL : RELOC_ABS;
+      // Literals with the same value share a cell, so the cell can only
+      // change if no other literal is in it, and no other cell has the
+      // new value.
+      if (MEMORY(mix, addr) != fr->literal) {
+	for (int j = 0; j < ps->numfuturerefs; j++) {
+	  futureref *other = &ps->futurerefs[j];
+	  if (j == li->ref || j == ref || !other->which || !other->resolved)
+	    continue;
+	  int cell = addressof(MEMORY(mix, other->addr));
+	  if (cell == addr || MEMORY(mix, cell) == fr->literal)
+	    return false;
+	}
+	MEMORY(mix, addr) = fr->literal;
+      }
+    }
+    else {
+      ps->line = lastline;
+      int sym = findvisible(fr->sym, ps);
+      ps->line = i+1;
+      // Undefined symbols would need a new cell.
+      if (sym < 0)
+	return false;
+      addr = INT(ps->syms[sym].val);
+      reloc = symreloc(sym, ps);
+    }
+    word instr = MEMORY(mix, fr->addr);
+    MEMORY(mix, fr->addr) = INSTR(ADDR(addr), getI(instr), getF(instr), getC(instr));
+    setreloc(fr->addr, reloc, ps);
+    fr->resolved = true;
+  }
+  if (li->ref >= 0) {
+    unlinkfutureref(li->ref, ps);
+    ps->futurerefs[li->ref].resolved = false;
+  }
+  li->ref = ref;
+  li->firstsymref = numsymrefs;
+  li->numsymrefs = ps->numsymrefs - numsymrefs;
+  return true;
+}
+
+bool reassemble(char *src, size_t len, parsestate *ps, mix *mix, sourceinfo *info) {
+  int n = ps->numlines;
+  if (n == 0 || ps->lines[n-1].kind != LINE_END)
+    return false;
+
+  // Split the new source into as many lines as the old one had up to
+  // END.
+  char **lines = malloc(n * sizeof(char *));
+  bool *dirty = malloc(n * sizeof(bool));
+  char *end = src + len, *line = src;
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    if (line >= end) {
+      ok = false;
+      break;
+    }
+    char *next = memchr(line, '\n', end-line);
+    next = next == NULL ? end : next+1;
+    uint64_t hash = hashsource(line, next-line);
+    lines[i] = line;
+    dirty[i] = hash != ps->lines[i].hash;
+    ps->lines[i].hash = hash;
+    ps->lines[i].offset = line - src;
+    line = next;
+  }
+
+  // Parse the dirty lines, and mark the lines using a symbol that
+  // changed as dirty too.  They can be before the EQU, if they used it
+  // as a future reference.
+  int star = ps->star, lastline = ps->line;
+  int localsymcounts[10];
+  memcpy(localsymcounts, ps->localsymcounts, sizeof(localsymcounts));
+  for (int i = 0; ok && i < n; i++) {
+    if (!dirty[i])
+      continue;
+    dirty[i] = false;
+    int changed = -1;
+    ok = reparseline(lines[i], i, lastline, ps, mix, &changed);
+    if (ok && changed >= 0) {
+      int first = n;
+      for (int j = 0; j < n; j++) {
+	lineinfo *li = &ps->lines[j];
+	for (int k = 0; k < li->numsymrefs; k++) {
+	  if (ps->symrefs[li->firstsymref + k] == changed) {
+	    dirty[j] = true;
+	    if (j < first)
+	      first = j;
+	    break;
+	  }
+	}
+      }
+      if (first < i)
+	i = first-1;
+    }
+  }
+  ps->star = star;
+  ps->line = lastline;
+  memcpy(ps->localsymcounts, localsymcounts, sizeof(localsymcounts));
+  free(lines);
+  free(dirty);
+  if (!ok)
+    return false;
+
+  for (int i = 0; i < 4000; i++)
+    info->srcoffsets[i] = -1;
+  info->errline = 0;
+  for (int i = 0; i < n; i++) {
+    lineinfo *li = &ps->lines[i];
+    if (li->kind == LINE_CELL && li->star >= 0)
+      info->srcoffsets[li->star] = li->offset;
+  }
+  return true;
+}
+
+bool opensource(sourcefile *sf, char *filename) {
+  sf->buf = NULL;
+  sf->len = 0;
+  sf->mapped = false;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  sf->len = st.st_size;
+  char last = '\0';
+  if (sf->len > 0 && pread(fd, &last, 1, sf->len-1) != 1) {
+    close(fd);
+    return false;
+  }
+  if (last == '\n') {
+    sf->buf = mmap(NULL, sf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (sf->buf == MAP_FAILED) {
+      sf->buf = NULL;
+      close(fd);
+      return false;
+    }
+    madvise(sf->buf, sf->len, MADV_SEQUENTIAL);
+    sf->mapped = true;
+  }
+  else {
+    sf->buf = malloc(sf->len+1);
+    if (pread(fd, sf->buf, sf->len, 0) != sf->len) {
+      free(sf->buf);
+      sf->buf = NULL;
+      close(fd);
+      return false;
+    }
+    sf->buf[sf->len++] = '\n';
+  }
+  close(fd);
+  return true;
+}
+
+void closesource(sourcefile *sf) {
+  if (sf->mapped)
+    munmap(sf->buf, sf->len);
+  else
+    free(sf->buf);
+  sf->buf = NULL;
+  sf->len = 0;
+  sf->mapped = false;
+}
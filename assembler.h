@@ -6,7 +6,20 @@
 
 #define LINELEN 100
 
-#define SKIPSPACES(t) while (isspace(*((t)++))); (t)--
+// Skip blanks, but not the newline at the end of a line, since lines
+// are parsed in place in the source buffer.
+#define ISBLANK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+#define SKIPSPACES(t) while (ISBLANK(*(t))) (t)++
+
+// A MIX operation: its mnemonic, default field and opcode.
+typedef struct {
+  char name[5];
+  byte field;
+  byte code;
+} mixop;
+
+extern const mixop MIXOPS[];
+extern const int NUMMIXOPS;
 
 // Stores information about a future reference or a literal constant
 // to be filled in later.
@@ -16,27 +29,131 @@ typedef struct {
   bool which;              // False for sym, true for literal.
   char sym[11];
   word literal;
+  int next;                // The next future reference to the same symbol, or -1.
 } futureref;
 
-#define MAXSYMS 1000
+// How an address changes when the linker moves a module (see object.h):
+// not at all, by the distance the module is moved, or not in any way
+// the linker can follow (e.g. twice a location).  A cell whose A-field
+// refers to an imported symbol i has the relocation RELOC_EXT+i.
+#define RELOC_ABS 0
+#define RELOC_REL 1
+#define RELOC_BAD 2
+#define RELOC_EXT 3
+
+// A symbol that has been defined, or only used in future references so
+// far.  The future references to it are chained through futureref.next.
+typedef struct {
+  char name[11];
+  word val;
+  bool defined;
+  int line;                // The line it was defined on.
+  int fixups;              // The first future reference to it, or -1.
+  byte reloc;              // RELOC_ABS, RELOC_REL or RELOC_BAD
+  bool external;           // Imported with EXT
+  bool exported;           // Exported with ENT
+} symbol;
+
+// What a line of MIXAL does, as far as reassembly is concerned.
+#define LINE_NONE 0        // Comments
+#define LINE_CELL 1        // Instructions, CON and ALF, which fill one cell
+#define LINE_EQU  2
+#define LINE_ORIG 3
+#define LINE_END  4
+#define LINE_LINK 5        // EXT and ENT
+#define LINE_MACRO 6       // Macro definitions and uses, REPT and IF blocks
+
+// A macro defined with MAC, or the lines to repeat with REPT.  body
+// holds the lines up to ENDM/ENDR, each ending with a newline.
+typedef struct {
+  char name[11];
+  int numparams;
+  char params[10][11];
+  char *body;
+  int len, size;
+} macro;
+
+// Recorded by assemble() for each line up to END, so that reassemble()
+// can tell what a changed line affects.
+typedef struct {
+  uint64_t hash;           // hashsource() of the line, with its newline
+  int offset;              // Where the line starts in the source
+  int star;                // The location counter before the line
+  int localsymcounts[10];  // localsymcounts before the line
+  byte kind;
+  int sym;                 // The symbol the line defines, or -1
+  int ref;                 // The future reference the line made, or -1
+  int firstsymref, numsymrefs;  // The symbols the line uses, in symrefs
+} lineinfo;
+
 typedef struct {
   int star;
-  int numsyms, numfuturerefs;
-  char syms[MAXSYMS][11];
-  word symvals[MAXSYMS];
-  futureref futurerefs[MAXSYMS];
+  int numsyms, maxsyms;
+  symbol *syms;
+  // Open addressing hash table of indices into syms, with -1 for empty
+  // slots.  symtablesize is a power of 2.
+  int *symtable;
+  int symtablesize;
+  int numfuturerefs, maxfuturerefs;
+  futureref *futurerefs;
   int localsymcounts[10];  // The current number of instances of each local symbol <n>H.
+  // Only symbols defined on lines up to this one can be looked up, as
+  // when the lines are assembled in order.
+  int line;
+  int lastdefined;         // The symbol added or looked up by the last addsym()
+  int numlines, maxlines;
+  lineinfo *lines;
+  int numsymrefs, maxsymrefs;
+  int *symrefs;
+  int *relocs;             // The relocation of the A-field of each cell 0-3999
+  int exprreloc;           // The relocation of the last expression parsed
+  int pooled;              // The cells END saved by sharing them between literals,
+                           // and between the uses of an undefined symbol
+  int nummacros, maxmacros;
+  macro *macros;
+  macro rept;              // The lines of the REPT being recorded
+  int reptcount;
+  // The macro whose lines are being recorded, MACRO_REPT for rept, or
+  // MACRO_NONE; recorddepth counts the MACs and REPTs in the lines.
+  int recording, recorddepth;
+  int expanddepth;         // The macros and REPTs being expanded
+  int ifdepth;             // The IFs that are not closed by FI yet
+  int skipfrom;            // The IF whose lines are being skipped, or 0
 } parsestate;
 
+#define MACRO_NONE -1
+#define MACRO_REPT -2
+
 // Returned by reference in parseline() for mmm to use.
 typedef struct {
   bool setdebugline;
   bool isend;
+  byte kind;               // LINE_NONE, LINE_CELL etc.
 } extraparseinfo;
 
+// MIXAL source in memory: memory-mapped from the file, or read into a
+// buffer if the file doesn't end with a newline (one is added, since
+// the parser relies on it).
+typedef struct {
+  char *buf;
+  size_t len;
+  bool mapped;
+} sourcefile;
+
+// Returned by reference in assemble().
+typedef struct {
+  int srcoffsets[4000];  // Offset of the line each cell was assembled from, or -1.
+  int errline;           // The line with an error (counting from 1), or 0.
+} sourceinfo;
+
+bool opensource(sourcefile *sf, char *filename);
+void closesource(sourcefile *sf);
+
 void initparsestate(parsestate *ps);
+void freeparsestate(parsestate *ps);
 
 bool lookupsym(char *sym, word *val, parsestate *ps);
+void addsym(char *sym, word val, parsestate *ps);
 
 bool parsesym(char **s, char *sym);
 bool parseOP(char **s, char *op, int *opidx);
@@ -54,4 +171,22 @@ bool parseF(char **s, word *val, parsestate *ps);
 bool parseW(char **s, word *val, parsestate *ps);
 
 bool parseline(char *line, parsestate *ps, mix *mix, extraparseinfo *extraparseinfo);
+
+// 64-bit FNV-1a hash of the source (or a line of it).
+uint64_t hashsource(const char *buf, size_t len);
+
+// Assemble the source in src[0..len) up to the END line, parsing each
+// line in place.  The source must end with a newline.
+bool assemble(char *src, size_t len, parsestate *ps, mix *mix, sourceinfo *info);
+
+// Given ps and the memory of mix as left by assembling a previous
+// version of the source, update them for the new source in src[0..len)
+// by parsing only the lines that changed, and the lines using symbols
+// whose values changed.  This only works when no code moves and no
+// symbol appears or disappears: every changed line must do the same
+// kind of thing as before, define the same symbol, fill the same cell,
+// and not need a new cell for a literal or undefined symbol.  If it
+// doesn't, return false; ps and mix are then left half updated, and
+// the source has to be assembled from scratch.
+bool reassemble(char *src, size_t len, parsestate *ps, mix *mix, sourceinfo *info);
 #endif
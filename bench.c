@@ -0,0 +1,92 @@
+// Throughput of the character translation used by the card reader,
+// line printer and tapes: character at a time with mixord()/mixchr(),
+// as the device layer used to do, against the bulk translators in
+// charset.c.  Build with CFLAGS="-O2 -march=native" to measure the
+// vectorized versions.
+//
+// Usage: bench [megabytes]
+
+#include <time.h>
+#include "emulator.h"
+#include "charset.h"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Character at a time, the way readchars() used to do it.
+static void readslow(const char *chars, word *words, int n) {
+  for (int i = 0; i < n; i++)
+    words[i] = 0;
+  for (int i = 0; i < 5*n; i++)
+    words[i/5] |= mixord(chars[i]) << 6*(4-i%5);
+}
+
+// Character at a time, the way writechars() used to do it.
+static void writeslow(const word *words, char *chars, int n) {
+  for (int i = 0; i < 5*n; i++) {
+    unsigned char extra;
+    unsigned char c = mixchr((words[i/5] >> 6*(4-i%5)) & ONES(6), &extra);
+    if (extra == 0x94) c = '!';
+    else if (extra == 0xa3) c = '[';
+    else if (extra == 0xa0) c = ']';
+    chars[i] = c;
+  }
+}
+
+typedef void (*readfn)(const char *, word *, int);
+typedef void (*writefn)(const word *, char *, int);
+
+// Translate the whole buffer in blocks of n words and report the
+// throughput in MB of characters per second.
+static void benchread(char *name, readfn f, const char *chars, word *words, long total, int n) {
+  double start = now();
+  for (long i = 0; i+n <= total; i += n)
+    f(chars + 5*i, words + i, n);
+  printf("  %-24s %8.1f MB/s\n", name, 5*total / (now()-start) / 1e6);
+}
+
+static void benchwrite(char *name, writefn f, const word *words, char *chars, long total, int n) {
+  double start = now();
+  for (long i = 0; i+n <= total; i += n)
+    f(words + i, chars + 5*i, n);
+  printf("  %-24s %8.1f MB/s\n", name, 5*total / (now()-start) / 1e6);
+}
+
+int main(int argc, char **argv) {
+  long megabytes = argc > 1 ? atol(argv[1]) : 100;
+  long total = megabytes * 1000000 / 5 / 400 * 400;  // Words
+  char *chars = malloc(5*total);
+  word *words = malloc(total * sizeof(word));
+  char *out = malloc(5*total);
+  srand(1);
+  for (long i = 0; i < 5*total; i++)
+    chars[i] = MIXTOASCII[rand() % 64];
+
+#if defined(__AVX2__)
+  printf("Bulk translators use AVX2\n");
+#elif defined(__SSSE3__)
+  printf("Bulk translators use SSSE3\n");
+#else
+  printf("Bulk translators use table lookups\n");
+#endif
+
+  struct { char *name; int n; } sizes[] = {
+    {"cards (16 words)", 16}, {"lines (24 words)", 24}, {"tape blocks (100 words)", 100}
+  };
+  for (int s = 0; s < 3; s++) {
+    int n = sizes[s].n;
+    printf("%s, %ld MB:\n", sizes[s].name, megabytes);
+    benchread("mixord()", readslow, chars, words, total, n);
+    benchread("asciitowords()", asciitowords, chars, words, total, n);
+    benchwrite("mixchr()", writeslow, words, out, total, n);
+    benchwrite("wordstoascii()", wordstoascii, words, out, total, n);
+    if (memcmp(chars, out, 5*total) != 0) {
+      printf("Translation round trip failed\n");
+      return 1;
+    }
+  }
+  return 0;
+}
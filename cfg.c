@@ -0,0 +1,365 @@
+#include "cfg.h"
+
+// The address of a jump, or -1 if it is indexed or outside memory.
+static int target(word instr) {
+  if (getI(instr) != 0)
+    return -1;
+  word A = getA(instr);
+  int addr = A & ONES(12);
+  if (!(A >> 12))
+    addr = -addr;
+  return addr < 4000 ? addr : -1;
+}
+
+static bool isjump(word instr) {
+  byte C = getC(instr), F = getF(instr);
+  return C == 34 || C == 38 || (C == 39 && F <= 9) || (40 <= C && C <= 47 && F <= 7);
+}
+
+// JMP and JSJ never go on to the next cell.
+static bool isgoto(word instr) {
+  return getC(instr) == 39 && getF(instr) <= 1;
+}
+
+static bool ishalt(word instr) {
+  return getC(instr) == 5 && getF(instr) == 2;
+}
+
+// If instr is a jump to a subroutine, i.e. to a cell holding STJ (and
+// not JSJ, which leaves rJ alone), return the location of the
+// subroutine's exit, and otherwise -1.
+static int callexit(word *mem, word instr) {
+  int t = target(instr);
+  if (t < 0 || !isjump(instr) || (getC(instr) == 39 && getF(instr) == 1))
+    return -1;
+  if (getC(mem[t]) != 32)
+    return -1;
+  int exit = target(mem[t]);
+  return exit >= 0 && isgoto(mem[exit]) ? exit : -1;
+}
+
+// Mark the cells reached from the ones in seeds as code, and the exits
+// of the subroutines called on the way.  The jump at an exit returns
+// to after the calls, so its address (usually * or 0) is not followed.
+static void discover(word *mem, int *seeds, int numseeds, bool *code, bool *isexit) {
+  int stack[4000], n = 0;
+  memset(code, 0, 4000*sizeof(bool));
+#define PUSH(c) if (0 <= (c) && (c) < 4000 && !code[c]) { code[c] = true; stack[n++] = (c); }
+  for (int i = 0; i < numseeds; i++)
+    PUSH(seeds[i])
+  while (n > 0) {
+    int c = stack[--n];
+    word w = mem[c];
+    if (isjump(w)) {
+      int exit = callexit(mem, w);
+      if (exit >= 0) {
+	isexit[exit] = true;
+	PUSH(c+1)
+      }
+      if (!isexit[c])
+	PUSH(target(w))
+      if (!isgoto(w))
+	PUSH(c+1)
+    }
+    else if (!ishalt(w))
+      PUSH(c+1)
+  }
+#undef PUSH
+}
+
+static void addedge(int from, int to, byte kind, cfg *g) {
+  if (to < 0 || g->numedges == sizeof(g->edges)/sizeof(edge))
+    return;
+  g->edges[g->numedges++] = (edge){from, to, kind};
+}
+
+// The name of the routine at cell c: a label there, or failing that,
+// any other symbol with its value (the symbols of an object file don't
+// say which are labels).
+static void routinename(int c, parsestate *ps, char *name) {
+  name[0] = '\0';
+  if (ps == NULL)
+    return;
+  for (int i = 0; i < ps->numsyms; i++) {
+    symbol *s = &ps->syms[i];
+    if (!s->defined || (int)INT(s->val) != c || strchr(s->name, '#') != NULL)
+      continue;
+    if (name[0] == '\0' || s->reloc == RELOC_REL)
+      strcpy(name, s->name);
+    if (s->reloc == RELOC_REL)
+      return;
+  }
+}
+
+// The blocks that follow b within its routine: a call is followed by
+// the cell it returns to rather than the subroutine.
+static int successors(cfg *g, int b, int *succs) {
+  int n = 0;
+  block *bl = &g->blocks[b];
+  for (int i = bl->firstedge; i < bl->firstedge + bl->numedges; i++) {
+    edge *e = &g->edges[i];
+    int to = e->kind == EDGE_CALL ? (bl->last+1 < 4000 ? g->blockof[bl->last+1] : -1)
+      : e->kind == EDGE_RETURN ? -1 : e->to;
+    if (to >= 0 && (n == 0 || succs[n-1] != to))
+      succs[n++] = to;
+  }
+  return n;
+}
+
+// Number the blocks of routine r in postorder, from its entry.
+static int postorder(cfg *g, int r, int *order, int *number) {
+  int stack[4000], next[4000], n = 0, count = 0;
+  int succs[3];
+  int entry = g->routines[r].entry;
+  stack[n] = entry;
+  next[n++] = 0;
+  number[entry] = 0;
+  while (n > 0) {
+    int b = stack[n-1];
+    int numsuccs = successors(g, b, succs);
+    if (next[n-1] < numsuccs) {
+      int s = succs[next[n-1]++];
+      if (g->blocks[s].routine == r && number[s] < 0) {
+	number[s] = 0;
+	stack[n] = s;
+	next[n++] = 0;
+      }
+    }
+    else {
+      number[b] = count;
+      order[count++] = b;
+      n--;
+    }
+  }
+  return count;
+}
+
+// Find the loops in routine r.  A loop is formed by a jump back to a
+// block that dominates the jump, i.e. that every path from the entry
+// to the jump goes through (Cooper, Harvey and Kennedy, "A Simple,
+// Fast Dominance Algorithm").  The loop is then made of the blocks
+// from which the jump can be reached without going through the header.
+static void findloops(cfg *g, int r) {
+  static int order[4000], number[4000], idom[4000], inloop[4000];
+  static int preds[3*4000], firstpred[4001];
+  int succs[3];
+  for (int b = 0; b < g->numblocks; b++)
+    number[b] = idom[b] = inloop[b] = -1;
+  int n = postorder(g, r, order, number);
+
+  // Predecessors within the routine
+  for (int b = 0; b <= g->numblocks; b++)
+    firstpred[b] = 0;
+  for (int i = 0; i < n; i++) {
+    int numsuccs = successors(g, order[i], succs);
+    for (int j = 0; j < numsuccs; j++)
+      firstpred[succs[j]+1]++;
+  }
+  for (int b = 0; b < g->numblocks; b++)
+    firstpred[b+1] += firstpred[b];
+  int fill[4000];
+  memcpy(fill, firstpred, g->numblocks*sizeof(int));
+  for (int i = 0; i < n; i++) {
+    int numsuccs = successors(g, order[i], succs);
+    for (int j = 0; j < numsuccs; j++)
+      preds[fill[succs[j]]++] = order[i];
+  }
+
+  int entry = g->routines[r].entry;
+  idom[entry] = entry;
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (int i = n-2; i >= 0; i--) {
+      int b = order[i], newidom = -1;
+      for (int j = firstpred[b]; j < firstpred[b+1]; j++) {
+	int p = preds[j];
+	if (number[p] < 0 || idom[p] < 0)
+	  continue;
+	if (newidom < 0) {
+	  newidom = p;
+	  continue;
+	}
+	int x = p, y = newidom;
+	while (x != y) {
+	  while (number[x] < number[y]) x = idom[x];
+	  while (number[y] < number[x]) y = idom[y];
+	}
+	newidom = x;
+      }
+      if (idom[b] != newidom) {
+	idom[b] = newidom;
+	changed = true;
+      }
+    }
+  }
+
+  for (int i = n-1; i >= 0; i--) {
+    int h = order[i];
+    // The blocks of the loop at h, if there is one, marked with h in
+    // inloop and kept on a stack while their predecessors are added.
+    int stack[4000], sp = 0;
+    bool found = false;
+    for (int j = firstpred[h]; j < firstpred[h+1]; j++) {
+      int u = preds[j];
+      if (number[u] < 0)
+	continue;
+      int d = u;
+      while (d != h && d != entry)
+	d = idom[d];
+      if (d != h)
+	continue;
+      inloop[h] = h;
+      found = true;
+      if (inloop[u] != h) {
+	inloop[u] = h;
+	stack[sp++] = u;
+      }
+    }
+    while (sp > 0) {
+      int b = stack[--sp];
+      for (int j = firstpred[b]; j < firstpred[b+1]; j++) {
+	int p = preds[j];
+	if (number[p] >= 0 && inloop[p] != h) {
+	  inloop[p] = h;
+	  stack[sp++] = p;
+	}
+      }
+    }
+    if (!found)
+      continue;
+    g->blocks[h].outer = g->blocks[h].header;
+    // Loops are found from the outside in, so each block ends up with
+    // the innermost header.
+    for (int j = 0; j < n; j++) {
+      int b = order[j];
+      if (inloop[b] == h) {
+	g->blocks[b].depth++;
+	g->blocks[b].header = h;
+      }
+    }
+  }
+}
+
+void buildcfg(word *mem, int start, int *counts, parsestate *ps, cfg *g) {
+  static bool code[4000], isexit[4000], leader[4000];
+  static int seeds[4001];
+  memset(isexit, 0, sizeof(isexit));
+  memset(leader, 0, sizeof(leader));
+  // The exits found on the way change what is reached, so go again
+  // with them.  Then add the code that was executed without being
+  // reached from the start.
+  int numseeds = 0;
+  if (0 <= start && start < 4000)
+    seeds[numseeds++] = start;
+  discover(mem, seeds, numseeds, code, isexit);
+  discover(mem, seeds, numseeds, code, isexit);
+  if (counts != NULL) {
+    for (int c = 0; c < 4000; c++)
+      if (counts[c] > 0 && !code[c])
+	seeds[numseeds++] = c;
+    discover(mem, seeds, numseeds, code, isexit);
+  }
+
+  // Blocks start at jump targets, after jumps, and where the code starts
+  for (int c = 0; c < 4000; c++) {
+    if (!code[c])
+      continue;
+    word w = mem[c];
+    if (c == start || c == 0 || !code[c-1])
+      leader[c] = true;
+    if (isjump(w) || ishalt(w)) {
+      if (c+1 < 4000)
+	leader[c+1] = true;
+      if (!isexit[c] && target(w) >= 0)
+	leader[target(w)] = true;
+    }
+  }
+  g->numblocks = 0;
+  for (int c = 0; c < 4000; c++) {
+    g->blockof[c] = -1;
+    if (!code[c])
+      continue;
+    if (leader[c]) {
+      block *b = &g->blocks[g->numblocks++];
+      b->first = c;
+      b->time = 0;
+      b->unknownexit = false;
+      b->routine = b->header = b->outer = -1;
+      b->depth = 0;
+    }
+    block *b = &g->blocks[g->numblocks-1];
+    b->last = c;
+    b->time += fixedtime(mem[c]);
+    g->blockof[c] = g->numblocks-1;
+  }
+
+  // Routines: the program, then the subroutines in the order of their
+  // entries
+  static int routineof[4000];
+  for (int c = 0; c < 4000; c++)
+    routineof[c] = -1;
+  g->numroutines = 0;
+  if (0 <= start && start < 4000) {
+    routineof[start] = g->numroutines++;
+    g->routines[0].entry = g->blockof[start];
+    g->routines[0].exit = -1;
+  }
+  for (int c = 0; c < 4000; c++) {
+    if (!code[c] || callexit(mem, mem[c]) < 0)
+      continue;
+    int t = target(mem[c]);
+    if (routineof[t] < 0) {
+      routineof[t] = g->numroutines++;
+      g->routines[routineof[t]].entry = g->blockof[t];
+    }
+    g->routines[routineof[t]].exit = callexit(mem, mem[c]);
+  }
+  for (int r = 0; r < g->numroutines; r++)
+    routinename(g->blocks[g->routines[r].entry].first, ps, g->routines[r].name);
+
+  g->numedges = 0;
+  for (int i = 0; i < g->numblocks; i++) {
+    block *b = &g->blocks[i];
+    b->firstedge = g->numedges;
+    int c = b->last;
+    word w = mem[c];
+    bool next = c+1 < 4000 && code[c+1];
+    if (isexit[c]) {
+      for (int s = 0; s < 4000; s++) {
+	if (code[s] && callexit(mem, mem[s]) == c && s+1 < 4000 && code[s+1])
+	  addedge(i, g->blockof[s+1], EDGE_RETURN, g);
+      }
+    }
+    else if (isjump(w)) {
+      int t = target(w);
+      if (t < 0)
+	b->unknownexit = true;
+      else
+	addedge(i, g->blockof[t], callexit(mem, w) >= 0 ? EDGE_CALL : EDGE_JUMP, g);
+      if (!isgoto(w) && next)
+	addedge(i, i+1, EDGE_FALL, g);
+    }
+    else if (!ishalt(w) && next)
+      addedge(i, i+1, EDGE_FALL, g);
+    b->numedges = g->numedges - b->firstedge;
+  }
+
+  // Each routine gets the blocks it reaches without calls, unless an
+  // earlier routine got them first.
+  for (int r = 0; r < g->numroutines; r++)
+    g->blocks[g->routines[r].entry].routine = r;
+  for (int r = 0; r < g->numroutines; r++) {
+    int stack[4000], n = 0, succs[3];
+    stack[n++] = g->routines[r].entry;
+    while (n > 0) {
+      int numsuccs = successors(g, stack[--n], succs);
+      for (int j = 0; j < numsuccs; j++) {
+	if (g->blocks[succs[j]].routine < 0) {
+	  g->blocks[succs[j]].routine = r;
+	  stack[n++] = succs[j];
+	}
+      }
+    }
+    findloops(g, r);
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef _CFG_H
+#define _CFG_H
+#include "emulator.h"
+#include "assembler.h"
+
+// The control-flow graph of a program in memory, recovered from the
+// instructions alone.  The code is found by following the jumps from
+// the start address, and split into basic blocks: runs of cells that
+// are only entered at the first one and only left after the last one.
+//
+// Subroutines are recognized by the usual linkage of TAOCP 1.4.1,
+//   SUB    STJ  EXIT
+//          ...
+//   EXIT   JMP  *
+// so a jump to a cell holding STJ is a call, which returns to the cell
+// after the jump, and the jump at EXIT returns to after each of the
+// calls of SUB.  A jump whose address is indexed goes somewhere that
+// can't be told without running the program, so code only reached
+// that way is not found, unless a profile says it was executed.
+#define EDGE_FALL   0  // On to the next cell
+#define EDGE_JUMP   1
+#define EDGE_CALL   2  // To the entry of a subroutine
+#define EDGE_RETURN 3  // From the exit of a subroutine to after a call
+
+typedef struct {
+  int from, to;        // Blocks
+  byte kind;
+} edge;
+
+typedef struct {
+  int first, last;     // Cells
+  int time;            // Time of executing each cell once (fixedtime())
+  int firstedge, numedges;  // Its outgoing edges, in cfg.edges
+  bool unknownexit;    // Ends with a jump to an indexed address
+  int routine;         // The routine it belongs to, or -1
+  int header;          // The header of the innermost loop it is in, or -1
+  int depth;           // How many loops it is in
+  int outer;           // For a loop header, the header of the loop around it, or -1
+} block;
+
+typedef struct {
+  int entry;           // Block
+  char name[11];       // The symbol at the entry, or ""
+  int exit;            // The cell at the end of the STJ linkage, or -1
+} routine;
+
+typedef struct {
+  int numblocks;
+  block blocks[4000];
+  int numedges;
+  edge edges[3*4000];
+  // The program itself (reached from the start address) is routine 0,
+  // and the subroutines follow.
+  int numroutines;
+  routine routines[4000];
+  int blockof[4000];   // The block each cell is in, or -1 for data
+} cfg;
+
+// Build the graph of the program in mem that starts at start.  If
+// counts is not NULL, the cells with nonzero counts (as in
+// mix.execcounts) are code too.  If ps is not NULL, the routines are
+// named after the symbols at their entries.
+void buildcfg(word *mem, int start, int *counts, parsestate *ps, cfg *g);
+
+#endif
@@ -0,0 +1,150 @@
+#include "charset.h"
+#ifdef __SSSE3__
+#include <immintrin.h>
+#endif
+
+const char MIXTOASCII[64] = {
+  ' ', 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', '!', 'J', 'K', 'L', 'M', 'N',
+  'O', 'P', 'Q', 'R', '[', ']', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '0', '1',
+  '2', '3', '4', '5', '6', '7', '8', '9', '.', ',', '(', ')', '+', '-', '*', '/',
+  '=', '$', '<', '>', '@', ';', ':', '\'', 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h'
+};
+
+// Everything not listed is 63, like mixord().
+#define X 63
+const byte ASCIITOMIX[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+// ' ' '!' '"' '#' '$' '%' '&' ''' '(' ')' '*' '+' ',' '-' '.' '/'
+   0, 10,  X,  X, 49,  X,  X, 55, 42, 43, 46, 44, 41, 45, 40, 47,
+// '0' '1' '2' '3' '4' '5' '6' '7' '8' '9' ':' ';' '<' '=' '>' '?'
+  30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 54, 53, 50, 48, 51,  X,
+// '@' 'A' 'B' 'C' 'D' 'E' 'F' 'G' 'H' 'I' 'J' 'K' 'L' 'M' 'N' 'O'
+  52,  1,  2,  3,  4,  5,  6,  7,  8,  9, 11, 12, 13, 14, 15, 16,
+// 'P' 'Q' 'R' 'S' 'T' 'U' 'V' 'W' 'X' 'Y' 'Z' '[' '\' ']' '^' '_'
+  17, 18, 19, 22, 23, 24, 25, 26, 27, 28, 29, 20,  X, 21,  X,  X,
+// '`' 'a' 'b' 'c' 'd' 'e' 'f' 'g' 'h'
+   X, 56, 57, 58, 59, 60, 61, 62, 63,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+};
+#undef X
+
+// The vectorized lookups work like this: pshufb looks up a 16-entry
+// table by the low nibble of each byte, so a table of 16k entries is
+// looked up as k pieces, keeping the result from the piece selected by
+// the high nibble.
+
+#if defined(__AVX2__)
+#define VECLEN 32
+typedef __m256i vec;
+#define LOAD(p)        _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v)    _mm256_storeu_si256((__m256i *)(p), v)
+#define LOADTABLE(p)   _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p)))
+#define SET1(x)        _mm256_set1_epi8(x)
+#define AND(a, b)      _mm256_and_si256(a, b)
+#define OR(a, b)       _mm256_or_si256(a, b)
+#define CMPEQ(a, b)    _mm256_cmpeq_epi8(a, b)
+#define CMPLT0(a)      _mm256_cmpgt_epi8(_mm256_setzero_si256(), a)
+#define SHUFFLE(t, v)  _mm256_shuffle_epi8(t, v)
+#define HINIBBLE(v)    _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f))
+#elif defined(__SSSE3__)
+#define VECLEN 16
+typedef __m128i vec;
+#define LOAD(p)        _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v)    _mm_storeu_si128((__m128i *)(p), v)
+#define LOADTABLE(p)   _mm_loadu_si128((const __m128i *)(p))
+#define SET1(x)        _mm_set1_epi8(x)
+#define AND(a, b)      _mm_and_si128(a, b)
+#define OR(a, b)       _mm_or_si128(a, b)
+#define CMPEQ(a, b)    _mm_cmpeq_epi8(a, b)
+#define CMPLT0(a)      _mm_cmplt_epi8(a, _mm_setzero_si128())
+#define SHUFFLE(t, v)  _mm_shuffle_epi8(t, v)
+#define HINIBBLE(v)    _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f))
+#endif
+
+void mixtoascii(const byte *codes, char *chars, int n) {
+  int i = 0;
+#ifdef VECLEN
+  vec tables[4];
+  for (int k = 0; k < 4; k++)
+    tables[k] = LOADTABLE(MIXTOASCII + 16*k);
+  for (; i+VECLEN <= n; i += VECLEN) {
+    vec v = LOAD(codes+i);
+    vec hi = HINIBBLE(v);
+    vec r = SET1(0);
+    for (int k = 0; k < 4; k++)
+      r = OR(r, AND(CMPEQ(hi, SET1(k)), SHUFFLE(tables[k], v)));
+    STORE(chars+i, r);
+  }
+#endif
+  for (; i < n; i++)
+    chars[i] = MIXTOASCII[codes[i] & 63];
+}
+
+void asciitomix(const char *chars, byte *codes, int n) {
+  int i = 0;
+#ifdef VECLEN
+  // Only the first half of ASCIITOMIX needs to be looked up; bytes
+  // >= 128 all become 63.
+  vec tables[8];
+  for (int k = 0; k < 8; k++)
+    tables[k] = LOADTABLE(ASCIITOMIX + 16*k);
+  for (; i+VECLEN <= n; i += VECLEN) {
+    vec v = LOAD(chars+i);
+    vec hi = HINIBBLE(v);
+    vec r = AND(CMPLT0(v), SET1(63));
+    for (int k = 0; k < 8; k++)
+      r = OR(r, AND(CMPEQ(hi, SET1(k)), SHUFFLE(tables[k], v)));
+    STORE(codes+i, r);
+  }
+#endif
+  for (; i < n; i++)
+    codes[i] = ASCIITOMIX[(unsigned char)chars[i]];
+}
+
+void wordstocodes(const word *words, byte *codes, int n) {
+  for (int i = 0; i < n; i++) {
+    word w = words[i];
+    codes[5*i]   = (w >> 24) & ONES(6);
+    codes[5*i+1] = (w >> 18) & ONES(6);
+    codes[5*i+2] = (w >> 12) & ONES(6);
+    codes[5*i+3] = (w >>  6) & ONES(6);
+    codes[5*i+4] =  w        & ONES(6);
+  }
+}
+
+void codestowords(const byte *codes, word *words, int n) {
+  for (int i = 0; i < n; i++) {
+    const byte *b = codes + 5*i;
+    words[i] = b[0] << 24 | b[1] << 18 | b[2] << 12 | b[3] << 6 | b[4];
+  }
+}
+
+// Words are translated in chunks, so that the bytes stay in cache.
+#define CHUNK 100
+
+void wordstoascii(const word *words, char *chars, int n) {
+  byte codes[5*CHUNK];
+  for (int i = 0; i < n; i += CHUNK) {
+    int m = n-i < CHUNK ? n-i : CHUNK;
+    wordstocodes(words+i, codes, m);
+    mixtoascii(codes, chars + 5*i, 5*m);
+  }
+}
+
+void asciitowords(const char *chars, word *words, int n) {
+  byte codes[5*CHUNK];
+  for (int i = 0; i < n; i += CHUNK) {
+    int m = n-i < CHUNK ? n-i : CHUNK;
+    asciitomix(chars + 5*i, codes, 5*m);
+    codestowords(codes, words+i, m);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef _CHARSET_H
+#define _CHARSET_H
+#include "emulator.h"
+
+// Bulk translation between MIX character codes and ASCII, for moving
+// whole cards, lines and tape blocks at a time.
+//
+// As in the card and tape formats (see README), the codes 10, 20 and
+// 21 (Delta, Sigma, Pi) are written as !, [ and ], and the codes 56-63
+// as abcdefgh.  Characters outside the MIX character set are read as
+// code 63, like mixord().
+//
+// If the compiler targets SSSE3 or AVX2 (e.g. with -march=native), the
+// translations use pshufb to look up 16 or 32 characters at once.
+
+extern const char MIXTOASCII[64];
+extern const byte ASCIITOMIX[256];
+
+void mixtoascii(const byte *codes, char *chars, int n);
+void asciitomix(const char *chars, byte *codes, int n);
+
+// Split n words into their 5n bytes, ignoring the signs.
+void wordstocodes(const word *words, byte *codes, int n);
+// Pack 5n bytes into n words.  The signs are left as 0.
+void codestowords(const byte *codes, word *words, int n);
+
+// The same as above, but going straight between words and characters.
+void wordstoascii(const word *words, char *chars, int n);
+void asciitowords(const char *chars, word *words, int n);
+#endif
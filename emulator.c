@@ -1,4 +1,5 @@
 #include "emulator.h"
+#include "io.h"
 
 //                                                 v MOVE has variable time
 static int instrtimes[64] = { 1, 2, 2,10,12,10, 2,-1,
@@ -12,6 +13,21 @@ static int instrtimes[64] = { 1, 2, 2,10,12,10, 2,-1,
 
 int max(int a, int b) { return a >= b ? a : b; }
 
+int fixedtime(word instr) {
+  byte C = getC(instr), F = getF(instr);
+  if (C == 7)                                   // MOVE
+    return 1 + 2*F;
+  if ((1 <= C && C <= 4 && F == 6) || (C == 56 && F == 6))
+    return C == 3 ? 9 : C == 4 ? 11 : 4;        // FADD/FSUB/FMUL/FDIV/FCMP
+  if (C == 5 && (F == 6 || F == 7))             // FLOT/FIX
+    return 3;
+  if (C == 5 && F == 9)                         // INT
+    return 2;
+  if (35 <= C && C <= 37)                       // IOC/IN/OUT
+    return 1;
+  return instrtimes[C];
+}
+
 word ADDR(int x) {
   int pos = x < 0 ? -x : x;
   assert(pos <= 1<<12);
@@ -213,6 +229,20 @@ void shiftrightwords(word *destA, word *destX, int M) {
   *destX = WITHSIGN(w & ONES(30),         SIGN(*destX));
 }
 
+void shiftleftbinary(word *destA, word *destX, int M) {
+  uint64_t w = COMBINE(*destA, *destX);
+  w = M >= 60 ? 0 : (w << M) & ONES(60);
+  *destA = WITHSIGN((w >> 30) & ONES(30), SIGN(*destA));
+  *destX = WITHSIGN(w & ONES(30),         SIGN(*destX));
+}
+
+void shiftrightbinary(word *destA, word *destX, int M) {
+  uint64_t w = COMBINE(*destA, *destX);
+  w = M >= 60 ? 0 : w >> M;
+  *destA = WITHSIGN((w >> 30) & ONES(30), SIGN(*destA));
+  *destX = WITHSIGN(w & ONES(30),         SIGN(*destX));
+}
+
 void shiftleftcirc(word *destA, word *destX, int M) {
   uint64_t w = (MAG(*destA) << 30) | MAG(*destX);
   int shift_amt = (6*M) % 60;
@@ -266,6 +296,139 @@ void numtochar(word *destA, word *destX) {
   *destX = WORD(SIGN(*destX), b6, b7, b8, b9, b10);
 }
 
+// Floating point numbers (TAOCP 4.2.1) are stored as +- e f1 f2 f3 f4,
+// where e is the exponent in excess 32 and f1-f4 the fraction.  A
+// number is normalized when f1 is nonzero, or when it is 0.
+
+// Normalize and round a floating point result, following Algorithm
+// 4.2.1N.  Its fraction is f/64^(4+g), i.e. f has g extra bytes to be
+// rounded off, and sticky says whether the exact value was slightly
+// larger than that.  Return true on exponent overflow or underflow.
+static bool normalize(word *dest, bool sign, int e, uint64_t f, int g, bool sticky) {
+  if (f == 0 && !sticky) {
+    *dest = WITHSIGN(0, sign);
+    return false;
+  }
+  uint64_t top = (uint64_t)1 << 6*(4+g);
+  while (f >= top) {          // Scale right
+    sticky |= (f & ONES(6)) != 0;
+    f >>= 6;
+    e++;
+  }
+  while (f < top>>6) {        // Scale left
+    f <<= 6;
+    e--;
+  }
+  // Round to nearest, with ties going to an even fraction.
+  uint64_t rem = f & ONES(6*g), half = (uint64_t)1 << (6*g-1);
+  f >>= 6*g;
+  if (rem > half || (rem == half && (sticky || (f & 1))))
+    f++;
+  if (f == (uint64_t)1 << 24) {
+    f >>= 6;
+    e++;
+  }
+  bool overflow = e < 0 || e > 63;
+  *dest = WITHSIGN((word)(e & ONES(6)) << 24 | f, sign);
+  return overflow;
+}
+
+#define EXPONENT(w) (((w) >> 24) & ONES(6))
+#define FRACTION(w) ((w) & ONES(24))
+
+bool faddword(word *dest, word src) {
+  word u = *dest, v = src;
+  if (EXPONENT(u) < EXPONENT(v)) {
+    word t = u; u = v; v = t;
+  }
+  int diff = EXPONENT(u) - EXPONENT(v);
+  // v is too small to make a difference.
+  if (diff >= 6)
+    return normalize(dest, SIGN(u), EXPONENT(u), (uint64_t)FRACTION(u) << 6, 1, false);
+  // Line up the fractions, with 6 extra bytes so that nothing is lost.
+  uint64_t fu = (uint64_t)FRACTION(u) << 36;
+  uint64_t fv = (uint64_t)FRACTION(v) << (36 - 6*diff);
+  if (SIGN(u) == SIGN(v))
+    return normalize(dest, SIGN(u), EXPONENT(u), fu+fv, 6, false);
+  else if (fu >= fv)
+    return normalize(dest, fu == fv || SIGN(u), EXPONENT(u), fu-fv, 6, false);
+  else
+    return normalize(dest, SIGN(v), EXPONENT(u), fv-fu, 6, false);
+}
+
+bool fsubword(word *dest, word src) {
+  return faddword(dest, negword(src));
+}
+
+bool fmulword(word *dest, word src) {
+  uint64_t f = (uint64_t)FRACTION(*dest) * FRACTION(src);
+  int e = EXPONENT(*dest) + EXPONENT(src) - 32;
+  return normalize(dest, SIGN(*dest) == SIGN(src), e, f, 4, false);
+}
+
+bool fdivword(word *dest, word src) {
+  if (FRACTION(src) == 0)
+    return true;
+  uint64_t fu = (uint64_t)FRACTION(*dest) << 36;
+  uint64_t f = fu / FRACTION(src);
+  bool sticky = fu % FRACTION(src) != 0;
+  int e = EXPONENT(*dest) - EXPONENT(src) + 32;
+  return normalize(dest, SIGN(*dest) == SIGN(src), e, f, 2, sticky);
+}
+
+bool flotword(word *dest) {
+  // An integer is a fraction of 5 bytes with exponent 5.
+  return normalize(dest, SIGN(*dest), 32+5, MAG(*dest), 1, false);
+}
+
+bool fixword(word *dest) {
+  uint64_t f = FRACTION(*dest);
+  int shift = 6 * (EXPONENT(*dest) - 32 - 4);
+  uint64_t n;
+  bool overflow = false;
+  if (f == 0)
+    n = 0;
+  else if (shift >= 0) {
+    overflow = shift >= 30 || f << shift > ONES(30);
+    n = shift >= 30 ? 0 : (f << shift) & ONES(30);
+  }
+  else if (-shift >= 64)
+    n = 0;
+  else {
+    // Round to the nearest integer, with halves going away from 0.
+    n = f >> -shift;
+    if (((f >> (-shift-1)) & 1) != 0)
+      n++;
+  }
+  *dest = WITHSIGN((word)n, SIGN(*dest));
+  return overflow;
+}
+
+// 64^n, which a double holds exactly for the exponents of MIX.
+static double pow64(int n) {
+  double x = 1;
+  for (; n > 0; n--) x *= 64;
+  for (; n < 0; n++) x /= 64;
+  return x;
+}
+
+// The value of a floating point number, which a double holds exactly.
+static double fvalue(word w) {
+  double x = FRACTION(w) * pow64(EXPONENT(w) - 32 - 4);
+  return SIGN(w) ? x : -x;
+}
+
+int fcompareword(word dest, word src, word eps) {
+  // Algorithm 4.2.2C: u and v are approximately equal if they differ
+  // by at most eps * 64^(e-q), where e is the larger exponent.
+  int e = max(EXPONENT(dest), EXPONENT(src));
+  double tolerance = FRACTION(eps) * pow64(EXPONENT(eps) - 32 - 4 + e - 32);
+  double diff = fvalue(dest) - fvalue(src);
+  if (diff > tolerance) return 1;
+  if (diff < -tolerance) return -1;
+  return 0;
+}
+
 unsigned char mixchr(byte b, unsigned char *extra) {
   *extra = '\0';
   switch (b) {
@@ -360,12 +523,13 @@ byte mixord(char c) {
   }
 }
 
-void initmix(mix *mix) {
+void resetmix(mix *mix) {
   mix->done = false;
   mix->err = "";
   mix->PC = 0;
   memset(mix->exectimes, 0, 4000*sizeof(int));
   memset(mix->execcounts, 0, 4000*sizeof(int));
+  mix->time = 0;
 
   mix->overflow = false;
   mix->cmp = 0;
@@ -374,189 +538,171 @@ void initmix(mix *mix) {
   for (int i = 0; i < 6; i++)
     mix->Is[i] = POS(0);
   mix->J = POS(0);
-  for (int i = 0; i < 4000; i++)
+  for (int i = 0; i < 4000; i++) {
     mix->mem[i] = POS(0);
-  mix->cardfile = NULL;
-  for (int i = 0; i < 8; i++)
-    mix->tapefiles[i] = NULL;
-
+    mix->controlmem[i] = POS(0);
+  }
+  mix->controlstate = false;
+  mix->pendingints = 0;
   for (int i = 0; i < 21; i++) {
+    mix->iothreads[i].M = POS(0);
+    mix->iothreads[i].F = 0;
+    mix->iothreads[i].C = 0;
+    mix->iothreads[i].X = POS(0);
     mix->iothreads[i].timer = 0;
+    mix->iothreads[i].totaltime = 0;
     mix->iothreads[i].err = "";
+    mix->iothreads[i].pending = false;
   }
+  // The counts were cleared, so profiling has to start again.
+  mix->probes = NULL;
+  mix->probe = NULL;
+  mix->probedata = NULL;
 }
 
-static void _write_char(unsigned char c, unsigned char extra, FILE *fp) {
-  if (extra) {
-    // I don't want to write a unicode Delta/Pi/Sigma to a file, so
-    // instead I use the characters !/[/] respectively.
-    if (extra == 0x94) fputc('!', fp);
-    else if (extra == 0xa3) fputc('[', fp);
-    else if (extra == 0xa0) fputc(']', fp);
-  }
-  else
-    fputc(c, fp);
-}
-
-// Return false if there was an error carrying out the IO operation.
-static bool execute_io(IOthread *iothread, mix *mix) {
-  word M = iothread->M;
-  word F = iothread->F;
-  word C = iothread->C;
-
-  // For each IO operation, the below code runs only *once*, when half
-  // the specified time for the operation has elapsed.
-
-#define CHECKADDR(i)                                        \
-  if ((i)<0 || (i)>=4000) {                                 \
-    iothread->err = "illegal address during IO operation";  \
-    return false;                                           \
-  }
-
-  if (F == 16) {       // Card reader
-    if (mix->cardfile == NULL) {
-      iothread->err = "unspecified card file";
-      return false;
-    }
-    for (int i = 0; i < 80; i++) {
-      char c;
-      if ((c = fgetc(mix->cardfile)) == EOF) {
-	// Fill in the remaining characters with 0s
-	c = ' ';
-	//iothread->err = "unexpected EOF in middle of card";
-	//return false;
-      }
-      if (c == '\n') {
-	i--;
-	continue;
-      }
-      // Shift the character into the appropriate byte of the appropriate word.
-      int pos = i%5 + 1;
-      CHECKADDR(INT(M)+i/5)
-      storeword(&mix->mem[INT(M)+i/5], mixord(c), pos*8 + pos);
-    }
+void initmix(mix *mix) {
+  resetmix(mix);
+  mix->interrupts = false;
+  mix->cardfile.fp = NULL;
+  mix->cardfile.map = NULL;
+  mix->cardfile.index = NULL;
+  for (int i = 0; i < 8; i++) {
+    mix->tapefiles[i].fp = NULL;
+    mix->tapefiles[i].map = NULL;
+    mix->tapefiles[i].index = NULL;
+    mix->diskfiles[i].fp = NULL;
+    mix->diskfiles[i].map = NULL;
+    mix->diskfiles[i].index = NULL;
   }
-
-  else if (F == 18) {  // Line printer
-    // Each line has 120 characters (plus the trailing \n\0), a
-    // character may need 2 bytes to encode (for the codepoints
-    // 10=Delta, 20=Sigma, 21=Pi).
-    unsigned char line[120*2+2];
-    int c = 0;
-    unsigned char extra;
-
-#define ADDCHAR(b) line[c++] = mixchr((b), &extra);	\
-    if (extra) line[c++] = extra;
-
-    for (int i = 0; i < 24; i++) {
-      CHECKADDR(INT(M)+i)
-      word w = mix->mem[INT(M)+i];
-      byte b1 = (w >> 24) & ONES(6); ADDCHAR(b1)
-      byte b2 = (w >> 18) & ONES(6); ADDCHAR(b2)
-      byte b3 = (w >> 12) & ONES(6); ADDCHAR(b3)
-      byte b4 = (w >>  6) & ONES(6); ADDCHAR(b4)
-      byte b5 =  w        & ONES(6); ADDCHAR(b5)
-    }
-    line[c++] = '\n';
-    line[c++] = '\0';
-    printf(line);
+  for (int i = 0; i < 4; i++) {
+    mix->streamfiles[i].in = NULL;
+    mix->streamfiles[i].out = NULL;
   }
+  mix->journal = NULL;
+  mix->replaying = false;
+  mix->printer.buf = NULL;
+  mix->printer.len = mix->printer.cap = 0;
+  mix->printer.keep = false;
+  mix->printer.callback = NULL;
+  mix->printer.data = NULL;
+  mix->asyncio = true;
+}
 
-  else if (0 <= F && F <= 7 && C == 36) {  // Tape IN
-    if (mix->tapefiles[F] == NULL) {
-      iothread->err = "unspecified tape file";
-      return false;
-    }
-    for (int i = 0; i < 600; i++) {
-      char c;
-      if ((c = fgetc(mix->tapefiles[F])) == EOF) {
-	iothread->err = "unexpected EOF in middle of tape";
-	return false;
-      }
-      if (c == '\n') {
-	i--;
-	continue;
-      }
-      CHECKADDR(INT(M)+i/6)
-      if (i%6 == 0) {
-	// Load the word's sign
-	if (c == '#')
-	  mix->mem[INT(M)+i/6] = POS(0);
-	else if (c == '~')
-	  mix->mem[INT(M)+i/6] = NEG(0);
-	else {
-	  iothread->err = "invalid sign in tape, should be # or ~";
-	  return false;
-	}
-      }
-      else {
-	// Shift the character into the appropriate byte of the appropriate word.
-	int pos = i%6;
-	storeword(&mix->mem[INT(M)+i/6], mixord(c), pos*8 + pos);
-      }
-    }
-  }
-
-  else if (0 <= F && F <= 7 && C == 37) {  // Tape OUT
-    FILE *fp = mix->tapefiles[F];
-    if (fp == NULL) {
-      iothread->err = "unspecified tape file";
-      return false;
-    }
-    unsigned char c, extra;
-#define WRITECHAR(b) c = mixchr((b), &extra);	\
-  _write_char(c, extra, fp);
-
-    for (int i = 0; i < 100; i++) {
-      CHECKADDR(INT(M)+i)
-      word w = mix->mem[INT(M)+i];
-      _write_char(SIGN(w) ? '#' : '~', '\0', fp);
-      byte b1 = (w >> 24) & ONES(6); WRITECHAR(b1)
-      byte b2 = (w >> 18) & ONES(6); WRITECHAR(b2)
-      byte b3 = (w >> 12) & ONES(6); WRITECHAR(b3)
-      byte b4 = (w >>  6) & ONES(6); WRITECHAR(b4)
-      byte b5 =  w        & ONES(6); WRITECHAR(b5)
-    }
-    _write_char('\n', '\0', fp);
-  }
+// Save the registers in locations -9 to -1, and enter control state at
+// the given location.
+static void interrupt(mix *mix, int location) {
+  mix->controlmem[9] = mix->A;
+  for (int i = 0; i < 6; i++)
+    mix->controlmem[8-i] = mix->Is[i];
+  mix->controlmem[2] = mix->X;
+  word J = MAG(mix->J);
+  mix->controlmem[1] = WORD(true, 4*mix->overflow + mix->cmp+1, J >> 6, J & ONES(6),
+			    mix->PC >> 6, mix->PC & ONES(6));
+  mix->controlstate = true;
+  mix->PC = location;
+}
 
-  return true;
+// Restore the registers saved by interrupt(), and go back to normal
+// state.
+static void returnfrominterrupt(mix *mix) {
+  mix->A = mix->controlmem[9];
+  for (int i = 0; i < 6; i++)
+    mix->Is[i] = mix->controlmem[8-i];
+  mix->X = mix->controlmem[2];
+  word w = mix->controlmem[1];
+  byte flags = (w >> 24) & ONES(6);
+  mix->overflow = flags >> 2;
+  mix->cmp = (flags & 3) - 1;
+  mix->J = POS((w >> 12) & ONES(12));
+  mix->PC = w & ONES(12);
+  mix->controlstate = false;
 }
 
 void onestep(mix *mix) {
   if (mix->done) return;
 
-#define CHECKADDR(i)                  \
-  if ((i)<0 || (i)>=4000) {           \
-    mix->done = true;	              \
-    mix->err = "illegal address";     \
-    goto noadvance;                   \
+  // Interrupts are only taken in normal state, between instructions.
+  if (mix->pendingints != 0 && !mix->controlstate) {
+    int u = 0;
+    while (!((mix->pendingints >> u) & 1))
+      u++;
+    mix->pendingints &= ~(1u << u);
+    if (mix->probes != NULL)
+      mix->probe(mix, PROBE_INTERRUPT, mix->PC, 0);
+    interrupt(mix, -(20+u));
+  }
+  int oldPC = mix->PC;
+  int instrtime = 0;
+
+  // Negative locations are only accessible in control state.
+#define CHECKADDR(i)                                        \
+  if ((int)(i) >= 4000 || (int)(i) <= -4000 ||              \
+      ((int)(i) < 0 && !mix->controlstate)) {               \
+    mix->done = true;                                       \
+    mix->err = "illegal address";                           \
+    goto noadvance;                                         \
   }
 
   CHECKADDR(mix->PC)
-  word instr = mix->mem[mix->PC];
+  word instr = MEMORY(mix, mix->PC);
   byte C = getC(instr);
   byte F = getF(instr);
   byte I = getI(instr);
   word M = getM(instr, mix);
   // We don't want to evaluate V straight away, because INT(M) may not
   // be a valid address for instructions like ENTA
-#define V() applyfield(mix->mem[INT(M)], F)
+#define V() applyfield(MEMORY(mix, INT(M)), F)
 
   // Update execution count/time
-  int instrtime;
   // The instruction times for MOVE/IN/OUT/IOC are updated in their
   // respective branches, because they are variable.
   if (0 <= C && C <= 63)
     instrtime = instrtimes[C];
-  int oldPC = mix->PC;
 
 #define FIELDSPEC(C) if (!checkfieldspec(F)) {            \
     mix->done = true;                                     \
     mix->err = "invalid field for " #C;                   \
   }
 
-  if (C == 1) {                                 // ADD
+  // Floating point operations use F=6 (and F=7 for FIX), and always
+  // operate on whole words.
+  if ((1 <= C && C <= 5 && (F == 6 || (C == 5 && F == 7))) || (C == 56 && F == 6)) {
+    if (C != 5)
+      CHECKADDR(INT(M))
+    if (C == 1) {                               // FADD
+      instrtime = 4;
+      mix->overflow = faddword(&mix->A, MEMORY(mix, INT(M)));
+    }
+    else if (C == 2) {                          // FSUB
+      instrtime = 4;
+      mix->overflow = fsubword(&mix->A, MEMORY(mix, INT(M)));
+    }
+    else if (C == 3) {                          // FMUL
+      instrtime = 9;
+      mix->overflow = fmulword(&mix->A, MEMORY(mix, INT(M)));
+    }
+    else if (C == 4) {                          // FDIV
+      instrtime = 11;
+      mix->overflow = fdivword(&mix->A, MEMORY(mix, INT(M)));
+    }
+    else if (C == 5 && F == 6) {                // FLOT
+      instrtime = 3;
+      mix->overflow = flotword(&mix->A);
+    }
+    else if (C == 5 && F == 7) {                // FIX
+      instrtime = 3;
+      mix->overflow = fixword(&mix->A);
+    }
+    else if (C == 56) {                         // FCMP
+      instrtime = 4;
+      mix->cmp = fcompareword(mix->A, MEMORY(mix, INT(M)), mix->mem[0]);
+    }
+  }
+
+  else if (C == 0) {                            // NOP
+  }
+
+  else if (C == 1) {                            // ADD
     FIELDSPEC("ADD")
     CHECKADDR(INT(M))
     mix->overflow = addword(&mix->A, V());
@@ -589,6 +735,16 @@ void onestep(mix *mix) {
       mix->done = true;
       mix->err = "";
     }
+    else if (F == 9) {                          // INT
+      instrtime = 2;
+      if (mix->controlstate)
+	returnfrominterrupt(mix);
+      else {
+	mix->PC++;
+	interrupt(mix, -12);
+      }
+      goto noadvance;
+    }
     else {
       mix->done = true;
       mix->err = "invalid field for SPECIAL";
@@ -608,6 +764,10 @@ void onestep(mix *mix) {
       shiftleftcirc(&mix->A, &mix->X, INT(M));  // SLC
     else if (F == 5)
       shiftrightcirc(&mix->A, &mix->X, INT(M)); // SRC
+    else if (F == 6)
+      shiftleftbinary(&mix->A, &mix->X, INT(M));  // SLB
+    else if (F == 7)
+      shiftrightbinary(&mix->A, &mix->X, INT(M)); // SRB
     else {
       mix->done = true;
       mix->err = "invalid field for SHIFT";
@@ -619,7 +779,7 @@ void onestep(mix *mix) {
     for (int i = 0; i < F; i++) {
       CHECKADDR(INT(M)+i)
       CHECKADDR(INT(mix->Is[0]))
-      mix->mem[INT(mix->Is[0])] = mix->mem[INT(M)+i];
+      MEMORY(mix, INT(mix->Is[0])) = MEMORY(mix, INT(M)+i);
       mix->Is[0]++;
     }
   }
@@ -642,25 +802,25 @@ void onestep(mix *mix) {
   else if (24 <= C && C <= 31) {                // STx
     FIELDSPEC("STx")
     CHECKADDR(INT(M))
-    storeword(&mix->mem[INT(M)], *Iaddr(C-24, mix), F);
+    storeword(&MEMORY(mix, INT(M)), *Iaddr(C-24, mix), F);
   }
 
   else if (C == 32) {                           // STJ
     FIELDSPEC("STJ")
     CHECKADDR(INT(M))
-    storeword(&mix->mem[INT(M)], mix->J, F);
+    storeword(&MEMORY(mix, INT(M)), mix->J, F);
   }
 
   else if (C == 33) {                           // STZ
     FIELDSPEC("STZ")
     CHECKADDR(INT(M))
-    storeword(&mix->mem[INT(M)], 0, F);
+    storeword(&MEMORY(mix, INT(M)), 0, F);
   }
 
   else if (C == 34) {                           // JBUS
-    if (0 <= F <= 7 || F == 16 || F == 18) {
+    if (ISUNIT(F)) {
       if (mix->iothreads[F].timer > 0) {
-	mix->J = POS(mix->PC+1);
+	mix->J = FROMINT(mix->PC+1);
 	mix->PC = INT(M);
 	goto noadvance;
       }
@@ -671,35 +831,20 @@ void onestep(mix *mix) {
     }
   }
 
-  else if (C == 35) {                           // IOC
-    // TODO
-  }
-
-  else if (C == 36) {                           // IN
-    if (0 <= F <= 7 || F == 16) {
-      IOthread *iothread = &mix->iothreads[F];
-      instrtime = 1 + iothread->timer;
-      // If IO transmission hasn't happened, do it NOW and
-      // immediately mark the operation as complete.
-      // (Thus simulating a blocking operation.)
-      if (iothread->timer > iothread->totaltime/2)
-	execute_io(iothread, mix);
-      // Reset the arguments.
-      iothread->M = M;
-      iothread->F = F;
-      iothread->C = C;
-      iothread->err = "";
-      iothread->totaltime = mix->INtimes[F];
-      iothread->timer = mix->INtimes[F];
+  else if (35 <= C && C <= 37) {                // IOC/IN/OUT
+    if (C == 35 && !ISUNIT(F)) {
+      mix->done = true;
+      mix->err = "invalid field for IOC";
     }
-    else {
+    else if (C == 36 && !ISINPUT(F)) {
       mix->done = true;
       mix->err = "invalid input device for IN";
     }
-  }
-
-  else if (C == 37) {                           // OUT
-    if (0 <= F <= 7 || F == 18) {
+    else if (C == 37 && !ISOUTPUT(F)) {
+      mix->done = true;
+      mix->err = "invalid output device for OUT";
+    }
+    else {
       IOthread *iothread = &mix->iothreads[F];
       instrtime = 1 + iothread->timer;
       // If IO transmission hasn't happened, do it NOW and
@@ -711,20 +856,24 @@ void onestep(mix *mix) {
       iothread->M = M;
       iothread->F = F;
       iothread->C = C;
-      iothread->err = "";
-      iothread->totaltime = mix->OUTtimes[F];
-      iothread->timer = mix->OUTtimes[F];
-    }
-    else {
-      mix->done = true;
-      mix->err = "invalid output device for OUT";
+      iothread->X = mix->X;
+      if (!startio(iothread, mix)) {
+	mix->done = true;
+	mix->err = iothread->err;
+      }
+      iothread->totaltime = C == 35 ? mix->IOCtimes[F]
+	                  : C == 36 ? mix->INtimes[F] : mix->OUTtimes[F];
+      // Tapes and disks take time to move to the new position.
+      if ((ISTAPE(F) && C == 35) || ISDISK(F))
+	iothread->totaltime += mix->seektimes[F] * seekdistance(iothread, mix);
+      iothread->timer = iothread->totaltime;
     }
   }
 
   else if (C == 38) {                           // JRED
-    if (0 <= F <= 7 || F == 16 || F == 18) {
+    if (ISUNIT(F)) {
       if (mix->iothreads[F].timer == 0) {
-	mix->J = POS(mix->PC+1);
+	mix->J = FROMINT(mix->PC+1);
 	mix->PC = INT(M);
 	goto noadvance;
       }
@@ -746,7 +895,7 @@ void onestep(mix *mix) {
 	(F == 8 && mix->cmp != 0)  ||           // JNE
 	(F == 9 && mix->cmp <= 0)) {            // JLE
       if (F != 1)
-	mix->J = POS(mix->PC+1);
+	mix->J = FROMINT(mix->PC+1);
       CHECKADDR(INT(M))
       mix->PC = INT(M);
       goto noadvance;
@@ -764,12 +913,14 @@ void onestep(mix *mix) {
 	(F == 2 && SIGN(w) && MAG(w) > 0)    ||   // JxP
 	(F == 3 && (SIGN(w) || MAG(w) == 0)) ||   // JxNN
 	(F == 4 && MAG(w) != 0)              ||   // JxNZ
-	(F == 5 && (!SIGN(w) || MAG(w) == 0))) {  // JxNP
+	(F == 5 && (!SIGN(w) || MAG(w) == 0)) ||  // JxNP
+	(F == 6 && MAG(w) % 2 == 0)          ||   // JxE
+	(F == 7 && MAG(w) % 2 == 1)) {            // JxO
       mix->PC = INT(M);
-      mix->J = POS(mix->PC+1);
+      mix->J = FROMINT(mix->PC+1);
       goto noadvance;
     }
-    else if (F >= 6) {
+    else if (F >= 8) {
       mix->done = true;
       mix->err = "invalid field for REGJUMP";
     }
@@ -843,16 +994,54 @@ noadvance:
       }
     }
     iothread->timer -= instrtime;
+    if (iothread->timer <= 0 && mix->interrupts)
+      mix->pendingints |= 1u << i;
   }
 
   if (mix->done) {
-    // Flush the tape files
-    for (int i = 0; i < 7; i++) {
-      if (mix->tapefiles[i] != NULL)
-	fflush(mix->tapefiles[i]);
+    // Wait for outstanding writes, then flush the printer, the tape
+    // files...
+    syncio(mix);
+    flushprinter(mix);
+    for (int i = 0; i < 8; i++) {
+      if (mix->tapefiles[i].fp != NULL)
+	fflush(mix->tapefiles[i].fp);
+    }
+    // ...and the output streams
+    for (int i = 0; i < 4; i++) {
+      if (mix->streamfiles[i].out != NULL)
+	fflush(mix->streamfiles[i].out);
+    }
+    if (mix->journal != NULL)
+      fflush(mix->journal);
+    fflush(stdout);
+  }
+
+  if (mix->probes == NULL) {
+    if (0 <= oldPC && oldPC < 4000) {
+      mix->execcounts[oldPC]++;
+      mix->exectimes[oldPC] += instrtime;
     }
   }
+  else if (0 <= oldPC && oldPC < 4000 && !mix->done && mix->PC == mix->probes[oldPC].to[0]) {
+    if (mix->probes[oldPC].count[0] != NULL)
+      (*mix->probes[oldPC].count[0])++;
+  }
+  else if (0 <= oldPC && oldPC < 4000 && !mix->done && mix->PC == mix->probes[oldPC].to[1]) {
+    if (mix->probes[oldPC].count[1] != NULL)
+      (*mix->probes[oldPC].count[1])++;
+  }
+  else
+    mix->probe(mix, oldPC, mix->PC, instrtime);
+  mix->time += instrtime;
+}
 
-  mix->execcounts[oldPC]++;
-  mix->exectimes[oldPC] += instrtime;
-}
\ No newline at end of file
+bool run(mix *mix, uint32_t *breaks) {
+  while (!mix->done) {
+    onestep(mix);
+    unsigned PC = mix->PC;  // Negative in control state, hence past 4000
+    if (PC < 4000 && ISBREAK(breaks, PC))
+      return !mix->done;
+  }
+  return false;
+}
@@ -25,17 +25,83 @@ typedef uint32_t word;
 #define POS(w) ((w) | (1<<30))
 #define NEG(w) MAG(w)
 #define WITHSIGN(w,s) ((s ? POS(w) : NEG(w)))
+// The word holding the integer x.
+#define FROMINT(x) ((x) < 0 ? NEG(-(x)) : POS(x))
 #define COMBINE(w,v) ((MAG(w) << 30) | MAG(v))
 #define INT(w) (SIGN(w) ? MAG(w) : -MAG(w))
 
+// Host file backing a card deck or tape.
+// Text files (see README) are read and written through fp, while
+// packed binary files (see io.h) are memory-mapped, so that a
+// transfer is a single memcpy.
+typedef struct {
+  FILE *fp;
+  int fd;
+  void *map;        // Mapping of the whole binary file, or NULL
+  size_t maplen;
+  word *blocks;     // Start of the block data inside the mapping
+  int blocksize;    // Number of words per block
+  int numblocks;    // Number of blocks in the binary file
+  int capacity;     // Number of blocks that fit in the mapping
+  int pos;          // Index of the next block to be transferred
+  // Offsets of the blocks of a text file seen so far, so that moving
+  // to a known block is a single fseek.
+  long *index;
+  int indexlen, indexcap;
+} blockdevice;
+
+// The IO units:
+// 0-7 are tapes, 8-15 are disks/drums, 16 is the card reader, 17 is the
+// card punch, 18 is the line printer, 19 is the typewriter terminal and
+// 20 is the paper tape.
+#define ISTAPE(F)   ((F) <= 7)
+#define ISDISK(F)   (8 <= (F) && (F) <= 15)
+#define ISSTREAM(F) (17 <= (F) && (F) <= 20)
+#define ISINPUT(F)  ((F) <= 16 || (F) == 19 || (F) == 20)
+#define ISOUTPUT(F) ((F) <= 15 || (17 <= (F) && (F) <= 20))
+#define ISUNIT(F)   ((F) <= 20)
+
+// Host streams of the card punch, line printer, typewriter and paper
+// tape, which are only read or written sequentially and hence can be
+// pipes.
+typedef struct {
+  FILE *in, *out;
+  bool inpipe, outpipe;  // Whether in/out were opened by popen()
+} streamdevice;
+
+// Where profiling expects control to go after a cell (see profile.h).
+// Going to to[i] adds 1 to *count[i], unless count[i] is NULL.
+typedef struct {
+  int to[2];
+  int *count[2];
+} probepoint;
+
+// Where the line printer's output goes.  Printed lines are collected in
+// buf, and only handed on when it fills up or the program halts (see
+// flushprinter()).  They are passed to callback if it is set, and
+// otherwise written to the printer's output stream (stdout by default).
+// If keep is set, the lines stay in buf instead, which grows as needed.
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  bool keep;
+  void (*callback)(const char *text, size_t len, void *data);
+  void *data;
+} printersink;
+
 // Data relevant to the operation of each IO device
 typedef struct {
   word M, F, C;
+  word X;  // Block number, for disks
   int totaltime, timer;
   char *err;
+  // Block being transferred between memory and the host file.
+  word buf[100];
+  // Whether the worker thread is still reading/writing buf (see io.h).
+  bool pending;
 } IOthread;
 
-typedef struct {
+typedef struct mix {
   bool done;
   char *err;
 
@@ -43,6 +109,7 @@ typedef struct {
   // Keep track of the execution counts and times of each memory cell.
   int execcounts[4000];
   int exectimes[4000];
+  long time;  // Time elapsed since the machine started
 
   bool overflow;
   int cmp;
@@ -52,16 +119,53 @@ typedef struct {
   // (Technically the I and J registers only have 2 bytes, but it is
   //  convenient to reuse the word type.)
   word mem[4000];
+  // Locations -1 to -3999, which are only usable in control state;
+  // location -i is controlmem[i].
+  word controlmem[4000];
 
-  FILE *cardfile;     // File that stores a deck of cards
-  FILE *tapefiles[8]; // Files that store tape data
+  // The interrupt facility of TAOCP 1.4.4 (see README), which is off
+  // unless interrupts is set.
+  bool interrupts;
+  bool controlstate;
+  uint32_t pendingints;  // Bit u is set if unit u has finished an operation
+
+  blockdevice cardfile;     // File that stores a deck of cards
+  blockdevice tapefiles[8]; // Files that store tape data
+  blockdevice diskfiles[8]; // Files that store disk data (units 8-15)
+  // Streams for units 17-20.  The line printer writes to stdout and the
+  // typewriter to stdin/stdout when their streams are NULL.
+  streamdevice streamfiles[4];
+  printersink printer;
   IOthread iothreads[21];
+  bool asyncio;       // Carry out host file IO on a worker thread
+  // If not NULL, every device transfer is recorded in this journal, or
+  // taken from it when replaying (see io.h).
+  FILE *journal;
+  bool replaying;
+
+  // If probes is not NULL, execcounts and exectimes are left alone
+  // (see profile.h).  A step from cell from that goes to one of the
+  // cells in probes[from].to only adds to its count, and any other step,
+  // or one that stops the machine, calls probe(mix, from, to, time)
+  // instead.  probe() is also called with from = PROBE_INTERRUPT when
+  // an interrupt is taken before the instruction at to is executed.
+  probepoint *probes;
+  void (*probe)(struct mix *mix, int from, int to, int time);
+  void *probedata;
 
   int INtimes[21];
   int OUTtimes[21];
   int IOCtimes[21];
+  int seektimes[21];  // Time for a tape or disk to move over one block
 } mix;
 
+// Below any location, so that they can't be mistaken for one.
+#define PROBE_INTERRUPT -4000
+#define PROBE_NOWHERE   -4001  // For probepoint.to, which control never goes to
+
+// The memory cell at location addr, for -3999 <= addr <= 3999.
+#define MEMORY(mix, addr) (*((int)(addr) >= 0 ? &(mix)->mem[(int)(addr)] : &(mix)->controlmem[-(int)(addr)]))
+
 // Construct a 13-bit value consisting of a sign and 2 bytes.
 // The 2 bytes store the magnitude of x, i.e. not using two's
 // complement.
@@ -94,14 +198,42 @@ void shiftleftword(word *dest, int M);
 void shiftrightword(word *dest, int M);
 void shiftleftwords(word *destA, word *destX, int M);
 void shiftrightwords(word *destA, word *destX, int M);
+// Shift the magnitude of AX by M bits (binary MIX).
+void shiftleftbinary(word *destA, word *destX, int M);
+void shiftrightbinary(word *destA, word *destX, int M);
 void shiftleftcirc(word *destA, word *destX, int M);
 void shiftrightcirc(word *destA, word *destX, int M);
 
 void wordtonum(word *destA, word *destX);
 void numtochar(word *destA, word *destX);
 
+// Floating point operations (TAOCP 4.2.1).  They return true if the
+// exponent overflows or underflows (or for fdivword, on division by 0).
+bool faddword(word *dest, word src);
+bool fsubword(word *dest, word src);
+bool fmulword(word *dest, word src);
+bool fdivword(word *dest, word src);
+bool flotword(word *dest);
+bool fixword(word *dest);
+// Compare dest with src, treating them as equal if they are within eps
+// of each other, relative to the larger exponent (Algorithm 4.2.2C).
+int fcompareword(word dest, word src, word eps);
+
 unsigned char mixchr(byte b, unsigned char *extra);
 byte mixord(char c);
 void initmix(mix *mix);
+// Clear the registers, memory, counts and time, as when the machine is
+// switched on, but keep the devices and their files.  The IO must have
+// finished (see syncio()).
+void resetmix(mix *mix);
 void onestep(mix *mix);
+// Step until the machine stops, or comes to a cell whose bit is set in
+// breaks, a bitmap of the 4000 cells (bit c%32 of breaks[c/32]).  At
+// least one step is taken, so a run can go on from a breakpoint.
+// Return whether it came to a breakpoint.
+bool run(mix *mix, uint32_t *breaks);
+#define ISBREAK(breaks, c) (((breaks)[(c)/32] >> ((c)%32)) & 1)
+// The time onestep() takes to execute instr, leaving out the time IN,
+// OUT and IOC wait for a busy unit.
+int fixedtime(word instr);
 #endif
\ No newline at end of file
@@ -0,0 +1,975 @@
+#include <threads.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "io.h"
+#include "charset.h"
+
+// A host transfer waiting to be carried out by the worker thread.
+// The unit and operation are copied out of the IOthread, because the
+// emulator is free to reuse the IOthread for the next operation once
+// the transfer has been issued.
+typedef struct {
+  IOthread *iothread;
+  mix *mix;
+  word M, F, C;
+  // If record is set, the job is to append entry and block to the
+  // journal instead, once the jobs before it are done.
+  bool record;
+  journalentry entry;
+  word block[100];
+} iojob;
+
+// Each IOthread has at most one transfer and one record in flight, so
+// the queue only needs to be big enough for a few machines' worth of
+// devices.
+#define QUEUELEN 64
+static iojob queue[QUEUELEN];
+static int qhead = 0, qtail = 0;  // Queued jobs are queue[qhead..qtail-1]
+static mtx_t lock;
+static cnd_t queued, finished;
+static thrd_t worker;
+static once_flag workerflag = ONCE_FLAG_INIT;
+
+// Number of words transferred in one IO operation on the given unit.
+static int blocksize(word F) {
+  if (F == 16) return 16;  // Card reader
+  if (F == 17) return 16;  // Card punch
+  if (F == 18) return 24;  // Line printer
+  if (F == 19) return 14;  // Typewriter
+  if (F == 20) return 14;  // Paper tape
+  return 100;              // Tapes and disks
+}
+
+// The file backing the given unit, or NULL if it isn't a block device.
+static blockdevice *device(word F, mix *mix) {
+  if (F == 16) return &mix->cardfile;
+  if (ISTAPE(F)) return &mix->tapefiles[F];
+  if (ISDISK(F)) return &mix->diskfiles[F-8];
+  return NULL;
+}
+
+// Read n characters into chars, skipping newlines.  Return how many
+// were read before the end of the file.
+static int readnonewlines(FILE *fp, char *chars, int n) {
+  int len = 0;
+  while (len < n) {
+    int got = fread(chars+len, 1, n-len, fp);
+    if (got == 0)
+      break;
+    char *nl = memchr(chars+len, '\n', got);
+    if (nl == NULL) {
+      len += got;
+      continue;
+    }
+    int j = nl - chars;
+    for (int i = j; i < len+got; i++)
+      if (chars[i] != '\n')
+	chars[j++] = chars[i];
+    len = j;
+  }
+  return len;
+}
+
+// Read n words of characters, ignoring newlines.  Past the end of the
+// file, the words are filled in with spaces.
+static void readchars(FILE *fp, word *buf, int n) {
+  char chars[5*100];
+  int len = readnonewlines(fp, chars, 5*n);
+  memset(chars+len, ' ', 5*n-len);
+  asciitowords(chars, buf, n);
+}
+
+// Read a line, keeping its first 5n characters and padding it with
+// spaces if it is shorter than that.
+static void readline(FILE *fp, word *buf, int n) {
+  char chars[5*100];
+  int len = 0, c;
+  while ((c = fgetc(fp)) != EOF && c != '\n') {
+    if (len < 5*n)
+      chars[len++] = c;
+  }
+  memset(chars+len, ' ', 5*n-len);
+  asciitowords(chars, buf, n);
+}
+
+// Write the characters of n words, without signs.
+static void writechars(FILE *fp, word *buf, int n) {
+  char chars[5*100];
+  wordstoascii(buf, chars, n);
+  fwrite(chars, 1, 5*n, fp);
+}
+
+// Format the characters of n words as a line for humans to read, and
+// return its length.  Unlike writechars(), Delta/Sigma/Pi are written
+// in unicode, so line needs room for 2 bytes per character, plus the
+// trailing \n.
+static int formatline(char *line, word *buf, int n) {
+  char chars[5*100];
+  wordstoascii(buf, chars, n);
+  int len = 0;
+  for (int i = 0; i < 5*n; i++) {
+    switch (chars[i]) {
+    case '!': line[len++] = 0xce; line[len++] = 0x94; break;
+    case '[': line[len++] = 0xce; line[len++] = 0xa3; break;
+    case ']': line[len++] = 0xce; line[len++] = 0xa0; break;
+    default: line[len++] = chars[i];
+    }
+  }
+  line[len++] = '\n';
+  return len;
+}
+
+static void printline(FILE *fp, word *buf, int n) {
+  char line[5*100*2+1];
+  fwrite(line, 1, formatline(line, buf, n), fp);
+}
+
+// Hand the contents of the printer's buffer over to its sink.
+static void emitprinter(mix *mix) {
+  printersink *p = &mix->printer;
+  if (p->len == 0 || p->keep)
+    return;
+  if (p->callback != NULL)
+    p->callback(p->buf, p->len, p->data);
+  else
+    fwrite(p->buf, 1, p->len, mix->streamfiles[1].out != NULL ? mix->streamfiles[1].out : stdout);
+  p->len = 0;
+}
+
+// Size of the printer's buffer, unless it keeps everything.
+#define PRINTBUFSIZE (1<<20)
+
+// Add len bytes of text to the printer's buffer.
+static void printtext(mix *mix, const char *text, int len) {
+  printersink *p = &mix->printer;
+  if (p->len + len > p->cap) {
+    if (!p->keep && p->cap >= PRINTBUFSIZE)
+      emitprinter(mix);
+    while (p->len + len > p->cap) {
+      p->cap = p->cap == 0 ? PRINTBUFSIZE : 2*p->cap;
+      p->buf = realloc(p->buf, p->cap);
+    }
+  }
+  memcpy(p->buf + p->len, text, len);
+  p->len += len;
+}
+
+char *readtextblock(FILE *fp, word *buf, bool card) {
+  if (card) {
+    readchars(fp, buf, 16);
+    return "";
+  }
+
+  // Each word is a sign followed by 5 characters.
+  char chars[600], bytes[500];
+  if (readnonewlines(fp, chars, 600) < 600)
+    return "unexpected EOF in middle of tape";
+  for (int i = 0; i < 100; i++) {
+    if (chars[6*i] != '#' && chars[6*i] != '~')
+      return "invalid sign in tape, should be # or ~";
+    memcpy(bytes + 5*i, chars + 6*i+1, 5);
+  }
+  asciitowords(bytes, buf, 100);
+  for (int i = 0; i < 100; i++) {
+    if (chars[6*i] == '#')
+      buf[i] = POS(buf[i]);
+  }
+  return "";
+}
+
+void writetextblock(FILE *fp, word *buf, bool card) {
+  if (card) {
+    writechars(fp, buf, 16);
+    fputc('\n', fp);
+    return;
+  }
+
+  char bytes[500], chars[601];
+  wordstoascii(buf, bytes, 100);
+  for (int i = 0; i < 100; i++) {
+    chars[6*i] = SIGN(buf[i]) ? '#' : '~';
+    memcpy(chars + 6*i+1, bytes + 5*i, 5);
+  }
+  chars[600] = '\n';
+  fwrite(chars, 1, 601, fp);
+}
+
+// Record that block dev->pos of a text file has been transferred, so
+// the next block starts at the current file position.
+static void nextblock(blockdevice *dev) {
+  dev->pos++;
+  if (dev->pos >= dev->indexcap) {
+    dev->indexcap *= 2;
+    dev->index = realloc(dev->index, dev->indexcap * sizeof(long));
+  }
+  dev->index[dev->pos] = ftell(dev->fp);
+  if (dev->pos >= dev->indexlen)
+    dev->indexlen = dev->pos+1;
+}
+
+// The block that IOC M(F) moves a tape to, before clamping to the end
+// of the tape.
+static int seektarget(blockdevice *dev, int M) {
+  if (M == 0)
+    return 0;
+  return dev->pos+M < 0 ? 0 : dev->pos+M;
+}
+
+// Move a tape to the given block, stopping at the end of the tape.
+static void seekblock(blockdevice *dev, int target) {
+  if (dev->map != NULL) {
+    dev->pos = target < dev->numblocks ? target : dev->numblocks;
+    return;
+  }
+  if (target < dev->indexlen) {
+    dev->pos = target;
+    return;
+  }
+  // Blocks we haven't seen yet have to be scanned (once) to find out
+  // where they start.
+  word scratch[100];
+  dev->pos = dev->indexlen-1;
+  while (dev->pos < target) {
+    fseek(dev->fp, dev->index[dev->pos], SEEK_SET);
+    if (readtextblock(dev->fp, scratch, false)[0] != '\0')
+      break;
+    nextblock(dev);
+  }
+}
+
+int seekdistance(IOthread *iothread, mix *mix) {
+  blockdevice *dev = device(iothread->F, mix);
+  if (ISDISK(iothread->F)) {
+    int X = INT(iothread->X);
+    // A negative block is an error, found when the operation is done.
+    if (X < 0)
+      return 0;
+    return X > dev->pos ? X - dev->pos : dev->pos - X;
+  }
+  int M = INT(iothread->M);
+  if (M == 0)
+    return dev->pos;
+  if (M < 0)
+    return -M < dev->pos ? -M : dev->pos;
+  return M;
+}
+
+// Carry out the host side of a job, i.e. read a block from the device
+// file into iothread->buf, or write iothread->buf to the device file.
+// Return the error message, or "" if there was none.
+// This is the only place where text device files are touched while
+// the machine is running.  (Binary files are handled by execute_io().)
+static char *hostio(iojob *job) {
+  word *buf = job->iothread->buf;
+  word F = job->F;
+  word C = job->C;
+  mix *mix = job->mix;
+
+  if (F == 16) {       // Card reader
+    if (mix->cardfile.fp == NULL)
+      return "unspecified card file";
+    return readtextblock(mix->cardfile.fp, buf, true);
+  }
+
+  else if (F == 17) {  // Card punch
+    if (mix->streamfiles[0].out == NULL)
+      return "unspecified card punch file";
+    writetextblock(mix->streamfiles[0].out, buf, true);
+  }
+
+  else if (F == 18) {  // Line printer
+    // IOC 0(18) skips to the top of the next page.
+    if (C == 35 && INT(job->M) == 0)
+      printtext(mix, "\f", 1);
+    else if (C == 37) {
+      char line[5*24*2+1];
+      printtext(mix, line, formatline(line, buf, 24));
+    }
+  }
+
+  else if (F == 19) {  // Typewriter
+    streamdevice *dev = &mix->streamfiles[2];
+    if (C == 36)
+      readline(dev->in != NULL ? dev->in : stdin, buf, 14);
+    else if (C == 37)
+      printline(dev->out != NULL ? dev->out : stdout, buf, 14);
+  }
+
+  else if (F == 20) {  // Paper tape
+    streamdevice *dev = &mix->streamfiles[3];
+    if (C == 35) {
+      // Rewind whichever streams can be rewound
+      if (dev->in != NULL && !dev->inpipe)
+	rewind(dev->in);
+      if (dev->out != NULL && !dev->outpipe)
+	rewind(dev->out);
+    }
+    else if (C == 36) {
+      if (dev->in == NULL)
+	return "unspecified paper tape input file";
+      readchars(dev->in, buf, 14);
+    }
+    else if (C == 37) {
+      if (dev->out == NULL)
+	return "unspecified paper tape output file";
+      writechars(dev->out, buf, 14);
+      fputc('\n', dev->out);
+    }
+  }
+
+  else if (ISTAPE(F)) {  // Tapes
+    blockdevice *dev = &mix->tapefiles[F];
+    if (dev->fp == NULL)
+      return "unspecified tape file";
+    if (C == 35) {
+      seekblock(dev, seektarget(dev, INT(job->M)));
+      return "";
+    }
+    fseek(dev->fp, dev->index[dev->pos], SEEK_SET);
+    if (C == 36) {
+      char *err = readtextblock(dev->fp, buf, false);
+      if (err[0] != '\0')
+	return err;
+      nextblock(dev);
+    }
+    else if (C == 37) {
+      writetextblock(dev->fp, buf, false);
+      // Whatever used to follow the block is now out of date.
+      dev->indexlen = dev->pos+1;
+      nextblock(dev);
+    }
+  }
+
+  return "";
+}
+
+// Append the entry and block of a record job to the journal.
+static void writerecord(iojob *job) {
+  // Text tapes are only repositioned by the worker, so their position
+  // is only known now.
+  blockdevice *dev = device(job->F, job->mix);
+  if (ISTAPE(job->F) && dev->map == NULL)
+    job->entry.pos = dev->pos;
+  fwrite(&job->entry, sizeof(job->entry), 1, job->mix->journal);
+  fwrite(job->block, sizeof(word), job->entry.n, job->mix->journal);
+}
+
+static int ioworker(void *arg) {
+  mtx_lock(&lock);
+  while (true) {
+    while (qhead == qtail)
+      cnd_wait(&queued, &lock);
+    iojob *job = &queue[qhead % QUEUELEN];
+    mtx_unlock(&lock);
+    char *err = job->record ? "" : hostio(job);
+    if (job->record)
+      writerecord(job);
+    mtx_lock(&lock);
+    if (!job->record) {
+      if (err[0] != '\0')
+	job->iothread->err = err;
+      job->iothread->pending = false;
+    }
+    qhead++;
+    cnd_broadcast(&finished);
+  }
+  return 0;
+}
+
+static void initworker(void) {
+  mtx_init(&lock, mtx_plain);
+  cnd_init(&queued);
+  cnd_init(&finished);
+  thrd_create(&worker, ioworker, NULL);
+}
+
+// Put a job at the end of the worker thread's queue.
+static void enqueue(iojob *job) {
+  call_once(&workerflag, initworker);
+  mtx_lock(&lock);
+  while (qtail - qhead == QUEUELEN)
+    cnd_wait(&finished, &lock);
+  if (!job->record)
+    job->iothread->pending = true;
+  queue[qtail++ % QUEUELEN] = *job;
+  cnd_signal(&queued);
+  mtx_unlock(&lock);
+}
+
+// Hand the host side of the current operation over to the worker
+// thread, or carry it out right away if async IO is disabled.
+static void submit(IOthread *iothread, mix *mix) {
+  iojob job = { iothread, mix, iothread->M, iothread->F, iothread->C, false };
+  if (!mix->asyncio) {
+    char *err = hostio(&job);
+    if (err[0] != '\0')
+      iothread->err = err;
+    return;
+  }
+  enqueue(&job);
+}
+
+// Wait for the host transfer of the given device to finish.
+static void join(IOthread *iothread, mix *mix) {
+  if (!mix->asyncio)
+    return;
+  call_once(&workerflag, initworker);
+  mtx_lock(&lock);
+  while (iothread->pending)
+    cnd_wait(&finished, &lock);
+  mtx_unlock(&lock);
+}
+
+// Wait for the worker thread to finish every job, including records.
+static void drain(mix *mix) {
+  if (!mix->asyncio)
+    return;
+  call_once(&workerflag, initworker);
+  mtx_lock(&lock);
+  while (qhead != qtail)
+    cnd_wait(&finished, &lock);
+  mtx_unlock(&lock);
+}
+
+bool startio(IOthread *iothread, mix *mix) {
+  // The previous operation on this device may still be writing.
+  join(iothread, mix);
+  if (iothread->err[0] != '\0')
+    return false;
+  if (mix->journal != NULL && mix->replaying)
+    return true;
+  // Disks and binary files are accessed directly by execute_io().
+  // The typewriter is usually the terminal, so it isn't read until
+  // the program needs the line.
+  word F = iothread->F;
+  blockdevice *dev = device(F, mix);
+  if (iothread->C == 36 && !ISDISK(F) && F != 19 && (dev == NULL || dev->map == NULL))
+    submit(iothread, mix);
+  return true;
+}
+
+// Make room for at least n blocks in a binary file opened for writing.
+static bool growblocks(blockdevice *dev, int n) {
+  if (n <= dev->capacity)
+    return true;
+  int capacity = dev->capacity*2 > n ? dev->capacity*2 : n;
+  size_t maplen = sizeof(binheader) + (size_t)capacity * dev->blocksize * sizeof(word);
+  if (ftruncate(dev->fd, maplen) != 0)
+    return false;
+  void *map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, dev->fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+  munmap(dev->map, dev->maplen);
+  dev->map = map;
+  dev->maplen = maplen;
+  dev->blocks = (word *)((binheader *)map + 1);
+  dev->capacity = capacity;
+  return true;
+}
+
+// Transfer a block directly between memory and a memory-mapped file.
+static bool mappedio(IOthread *iothread, blockdevice *dev, mix *mix) {
+  int M = INT(iothread->M);
+  int n = dev->blocksize;
+  if (M < 0 || M+n > 4000) {
+    iothread->err = "illegal address during IO operation";
+    return false;
+  }
+  // Disks transfer the block specified by rX.
+  if (ISDISK(iothread->F)) {
+    if ((int)INT(iothread->X) < 0) {
+      iothread->err = "negative block number for disk";
+      return false;
+    }
+    dev->pos = INT(iothread->X);
+  }
+  word *block = dev->blocks + (size_t)dev->pos * n;
+
+  if (iothread->C == 36 && iothread->F == 16) {  // Card reader
+    // Past the end of the deck, the reader sees blank cards.  It only
+    // fills in the bytes, leaving the sign intact.
+    for (int i = 0; i < n; i++)
+      mix->mem[M+i] = (mix->mem[M+i] & (1<<30)) |
+	(dev->pos < dev->numblocks ? MAG(block[i]) : 0);
+  }
+  else if (iothread->C == 36) {
+    if (dev->pos >= dev->numblocks) {
+      iothread->err = ISDISK(iothread->F) ? "read past the end of disk"
+	                                  : "unexpected EOF in middle of tape";
+      return false;
+    }
+    memcpy(&mix->mem[M], block, n * sizeof(word));
+  }
+  else if (iothread->C == 37) {
+    if (!growblocks(dev, dev->pos+1)) {
+      iothread->err = "could not extend binary file";
+      return false;
+    }
+    // A disk may be written past its end, leaving blocks of +0s.
+    for (size_t i = (size_t)dev->numblocks * n; i < (size_t)dev->pos * n; i++)
+      dev->blocks[i] = POS(0);
+    block = dev->blocks + (size_t)dev->pos * n;
+    memcpy(block, &mix->mem[M], n * sizeof(word));
+    if (dev->pos >= dev->numblocks) {
+      dev->numblocks = dev->pos+1;
+      ((binheader *)dev->map)->numblocks = dev->numblocks;
+    }
+  }
+  dev->pos++;
+  return true;
+}
+
+// Carry out the transfer of execute_io() with the device itself.
+static bool transfer(IOthread *iothread, mix *mix) {
+  word M = iothread->M;
+  word F = iothread->F;
+  word C = iothread->C;
+  int n = blocksize(F);
+
+  // For each IO operation, the below code runs only *once*, when half
+  // the specified time for the operation has elapsed.
+
+#define CHECKADDR(i)                                        \
+  if ((int)(i)<0 || (int)(i)>=4000) {                       \
+    iothread->err = "illegal address during IO operation";  \
+    return false;                                           \
+  }
+
+  join(iothread, mix);
+  if (iothread->err[0] != '\0')
+    return false;
+
+  blockdevice *dev = device(F, mix);
+  if (ISDISK(F) && dev->map == NULL) {
+    iothread->err = "unspecified disk file";
+    return false;
+  }
+  if (C == 35) {
+    // Only tapes and disks need to be repositioned.  Disks move to the
+    // block specified by rX.  The printer and paper tape are handled by
+    // hostio().
+    if (F == 18 || F == 20)
+      submit(iothread, mix);
+    if (dev == NULL)
+      return true;
+    if (ISDISK(F)) {
+      if ((int)INT(iothread->X) < 0) {
+	iothread->err = "negative block number for disk";
+	return false;
+      }
+      dev->pos = INT(iothread->X);
+    }
+    else if (dev->map != NULL)
+      seekblock(dev, seektarget(dev, INT(M)));
+    else
+      submit(iothread, mix);
+    return true;
+  }
+  if (dev != NULL && dev->map != NULL)
+    return mappedio(iothread, dev, mix);
+
+  if (C == 36) {
+    if (F == 19) {
+      iojob job = { iothread, mix, M, F, C };
+      hostio(&job);
+    }
+    for (int i = 0; i < n; i++) {
+      CHECKADDR(INT(M)+i)
+      // Character devices only fill in the bytes, leaving the sign intact.
+      if (F >= 16)
+	mix->mem[INT(M)+i] = (mix->mem[INT(M)+i] & (1<<30)) | iothread->buf[i];
+      else
+	mix->mem[INT(M)+i] = iothread->buf[i];
+    }
+  }
+  else if (C == 37) {
+    for (int i = 0; i < n; i++) {
+      CHECKADDR(INT(M)+i)
+      iothread->buf[i] = mix->mem[INT(M)+i];
+    }
+    submit(iothread, mix);
+  }
+  return true;
+}
+
+// Append the transfer just carried out to the journal.  With async IO,
+// the worker thread does it after the transfers queued before it, so
+// the entries stay in order without waiting for the device.
+static void recordio(IOthread *iothread, mix *mix) {
+  word F = iothread->F;
+  word C = iothread->C;
+  int M = INT(iothread->M);
+  blockdevice *dev = device(F, mix);
+  iojob job = { iothread, mix, iothread->M, F, C, true };
+  // The padding of the entry is written too, and has to be the same
+  // each time.
+  memset(&job.entry, 0, sizeof(job.entry));
+  job.entry.F = F;
+  job.entry.C = C;
+  job.entry.n = C == 35 ? 0 : blocksize(F);
+  job.entry.M = M;
+  job.entry.pos = dev != NULL ? dev->pos : 0;
+  job.entry.time = mix->time;
+  for (int i = 0; i < job.entry.n; i++)
+    job.block[i] = F >= 16 ? MAG(mix->mem[M+i]) : mix->mem[M+i];
+  if (mix->asyncio)
+    enqueue(&job);
+  else
+    writerecord(&job);
+}
+
+// Carry out a transfer by taking the next one from the journal.
+static bool replayio(IOthread *iothread, mix *mix) {
+  word F = iothread->F;
+  word C = iothread->C;
+  int M = INT(iothread->M);
+  int n = C == 35 ? 0 : blocksize(F);
+  journalentry entry;
+  word block[100];
+  if (fread(&entry, sizeof(entry), 1, mix->journal) != 1) {
+    iothread->err = "no more transfers in the journal";
+    return false;
+  }
+  if (entry.F != F || entry.C != C || entry.M != M || entry.n != n ||
+      fread(block, sizeof(word), n, mix->journal) != n) {
+    iothread->err = "transfer does not match the journal";
+    return false;
+  }
+  if (n > 0 && (M < 0 || M+n > 4000)) {
+    iothread->err = "illegal address during IO operation";
+    return false;
+  }
+  // The time taken by the next seek depends on where the device is.
+  blockdevice *dev = device(F, mix);
+  if (dev != NULL)
+    dev->pos = entry.pos;
+  for (int i = 0; i < n; i++) {
+    word *w = &mix->mem[M+i];
+    if (C == 36)
+      *w = F >= 16 ? (*w & (1<<30)) | block[i] : block[i];
+    else if ((F >= 16 ? MAG(*w) : *w) != block[i]) {
+      iothread->err = "output does not match the journal";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool execute_io(IOthread *iothread, mix *mix) {
+  if (mix->journal != NULL && mix->replaying)
+    return replayio(iothread, mix);
+  if (!transfer(iothread, mix))
+    return false;
+  if (mix->journal != NULL)
+    recordio(iothread, mix);
+  return true;
+}
+
+bool syncio(mix *mix) {
+  drain(mix);
+  bool ok = true;
+  for (int i = 0; i < 21; i++) {
+    IOthread *iothread = &mix->iothreads[i];
+    join(iothread, mix);
+    if (ok && iothread->err[0] != '\0') {
+      if (mix->err[0] == '\0')
+	mix->err = iothread->err;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool openblockdevice(blockdevice *dev, char *filename, int blocksize, bool writable) {
+  dev->fp = NULL;
+  dev->map = NULL;
+  dev->index = NULL;
+  dev->blocksize = blocksize;
+  dev->pos = 0;
+
+  FILE *fp;
+  if ((fp = fopen(filename, writable ? "r+" : "r")) == NULL)
+    return false;
+  binheader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, BINMAGIC, sizeof(header.magic)) != 0) {
+    // Plain text file
+    rewind(fp);
+    dev->fp = fp;
+    dev->indexcap = 64;
+    dev->index = malloc(dev->indexcap * sizeof(long));
+    dev->index[0] = 0;
+    dev->indexlen = 1;
+    return true;
+  }
+  fclose(fp);
+
+  // A byte-swapped file will also fail this check.
+  if (header.blocksize != blocksize)
+    return false;
+  int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+  struct stat st;
+  if (fd < 0)
+    return false;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < sizeof(binheader) + (size_t)header.numblocks * blocksize * sizeof(word)) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  dev->fd = fd;
+  dev->map = map;
+  dev->maplen = st.st_size;
+  dev->blocks = (word *)((binheader *)map + 1);
+  dev->numblocks = header.numblocks;
+  dev->capacity = (st.st_size - sizeof(binheader)) / (blocksize * sizeof(word));
+  return true;
+}
+
+void closeblockdevice(blockdevice *dev) {
+  if (dev->fp != NULL)
+    fclose(dev->fp);
+  if (dev->map != NULL) {
+    munmap(dev->map, dev->maplen);
+    // Drop the room reserved by growblocks().
+    if (dev->capacity > dev->numblocks)
+      ftruncate(dev->fd, sizeof(binheader) + (size_t)dev->numblocks * dev->blocksize * sizeof(word));
+    close(dev->fd);
+  }
+  free(dev->index);
+  dev->fp = NULL;
+  dev->map = NULL;
+  dev->index = NULL;
+}
+
+bool openstream(streamdevice *dev, char *filename, bool output) {
+  FILE **fp = output ? &dev->out : &dev->in;
+  bool *ispipe = output ? &dev->outpipe : &dev->inpipe;
+  FILE *new;
+  if (filename[0] == '|')
+    new = popen(filename+1, output ? "w" : "r");
+  else
+    new = fopen(filename, output ? "w" : "r");
+  if (new == NULL)
+    return false;
+  closestream(dev, output);
+  // Output is only written out in large chunks, or when the machine
+  // halts.
+  setvbuf(new, NULL, _IOFBF, 1<<20);
+  *fp = new;
+  *ispipe = filename[0] == '|';
+  return true;
+}
+
+void closestream(streamdevice *dev, bool output) {
+  FILE **fp = output ? &dev->out : &dev->in;
+  bool ispipe = output ? dev->outpipe : dev->inpipe;
+  if (*fp == NULL)
+    return;
+  if (ispipe)
+    pclose(*fp);
+  else
+    fclose(*fp);
+  *fp = NULL;
+}
+
+// Read the next card of the card reader into buf.
+// Return false if there are no cards left.
+static bool nextcard(blockdevice *dev, word *buf) {
+  if (dev->map != NULL) {
+    if (dev->pos >= dev->numblocks)
+      return false;
+    memcpy(buf, dev->blocks + (size_t)dev->pos++ * 16, 16 * sizeof(word));
+    return true;
+  }
+  int c;
+  while ((c = fgetc(dev->fp)) == '\n');
+  if (c == EOF)
+    return false;
+  ungetc(c, dev->fp);
+  readtextblock(dev->fp, buf, true);
+  return true;
+}
+
+// Parse a card of the loading routine's format into the location of
+// its first word, its number of words (0 for the transfer card) and
+// the words themselves.
+// Return false if the card isn't in that format.
+static bool parseloadcard(word *card, int *loc, int *n, word *words) {
+  byte c[80];
+  wordstocodes(card, c, 16);
+  if (c[5] < 30 || c[5] > 37)
+    return false;
+  *n = c[5]-30;
+  *loc = 0;
+  for (int i = 6; i < 10; i++) {
+    if (c[i] < 30 || c[i] > 39)
+      return false;
+    *loc = 10 * *loc + c[i]-30;
+  }
+  for (int w = 0; w < *n; w++) {
+    byte *digits = c + 10 + 10*w;
+    long value = 0;
+    bool negative = false;
+    for (int i = 0; i < 10; i++) {
+      if (30 <= digits[i] && digits[i] <= 39)
+	value = 10*value + digits[i]-30;
+      // A negative word has its last digit overpunched, giving one of
+      // the characters Delta,J-R.
+      else if (i == 9 && 10 <= digits[i] && digits[i] <= 19) {
+	value = 10*value + digits[i]-10;
+	negative = true;
+      }
+      else
+	return false;
+    }
+    if (value > ONES(30))
+      return false;
+    words[w] = WITHSIGN(value, !negative);
+  }
+  return true;
+}
+
+// Whether a card is the "....." card that ends the decks written by
+// mmm's C command.
+static bool isendcard(word *card) {
+  byte c[80];
+  wordstocodes(card, c, 16);
+  for (int i = 0; i < 5; i++)
+    if (c[i] != 40)
+      return false;
+  return true;
+}
+
+bool loaddeck(mix *mix, bool chargetime) {
+  if (!syncio(mix))
+    return false;
+  blockdevice *dev = &mix->cardfile;
+  if (dev->fp == NULL && dev->map == NULL) {
+    mix->err = "unspecified card file";
+    return false;
+  }
+  // The deck is read from its first card.
+  dev->pos = 0;
+  if (dev->fp != NULL)
+    fseek(dev->fp, 0, SEEK_SET);
+  // The cards before the first one in the loading routine's format,
+  // which are either the loading routine or, if the deck ends with a
+  // "....." card, the program itself.
+  static word raw[4000];
+  word card[16], words[7];
+  int loc, n, cards = 0, rawwords = 0;
+  bool loading = false;
+  while (true) {
+    if (!nextcard(dev, card)) {
+      mix->err = "no transfer card in the deck";
+      return false;
+    }
+    cards++;
+    if (!loading && isendcard(card)) {
+      // The reader leaves the signs of the cleared memory, +.
+      for (int i = 0; i < rawwords; i++)
+	mix->mem[i] = POS(MAG(raw[i]));
+      loc = 0;
+      break;
+    }
+    if (!parseloadcard(card, &loc, &n, words)) {
+      if (!loading && rawwords < 4000) {
+	memcpy(raw+rawwords, card, 16 * sizeof(word));
+	rawwords += 16;
+	continue;
+      }
+      mix->err = "card is not in the loading routine's format";
+      return false;
+    }
+    // The loading routine itself takes two cards.
+    if (!loading && cards > 3) {
+      mix->err = "card is not in the loading routine's format";
+      return false;
+    }
+    loading = true;
+    if (n == 0)
+      break;
+    if (loc+n > 4000) {
+      mix->err = "card loads past the end of memory";
+      return false;
+    }
+    memcpy(&mix->mem[loc], words, n * sizeof(word));
+  }
+  if (loc >= 4000) {
+    mix->err = "invalid address on the transfer card";
+    return false;
+  }
+  mix->PC = loc;
+  if (chargetime)
+    mix->time += (long)cards * mix->INtimes[16];
+  return true;
+}
+
+void writedeck(FILE *fp, word *mem, int n) {
+  char card[80];
+  for (int i = 0; i < n; i += 16) {
+    wordstoascii(mem + i, card, 16);
+    fwrite(card, 1, 80, fp);
+    fputc('\n', fp);
+  }
+
+  // End-of-program card
+  fputs(".....", fp);
+  for (int i = 0; i < 75; i++)
+    fputc(' ', fp);
+}
+
+bool openjournal(mix *mix, char *filename, bool replay) {
+  closejournal(mix);
+  FILE *fp;
+  if ((fp = fopen(filename, replay ? "r" : "w")) == NULL)
+    return false;
+  setvbuf(fp, NULL, _IOFBF, 1<<20);
+  char magic[8];
+  if (replay ? fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, JOURNALMAGIC, sizeof(magic)) != 0
+             : fwrite(JOURNALMAGIC, sizeof(magic), 1, fp) != 1) {
+    fclose(fp);
+    return false;
+  }
+  mix->journal = fp;
+  mix->replaying = replay;
+  return true;
+}
+
+void closejournal(mix *mix) {
+  drain(mix);
+  if (mix->journal != NULL)
+    fclose(mix->journal);
+  mix->journal = NULL;
+  mix->replaying = false;
+}
+
+void flushprinter(mix *mix) {
+  join(&mix->iothreads[18], mix);
+  emitprinter(mix);
+}
+
+void closedevices(mix *mix) {
+  flushprinter(mix);
+  free(mix->printer.buf);
+  mix->printer.buf = NULL;
+  mix->printer.len = mix->printer.cap = 0;
+  closejournal(mix);
+  closeblockdevice(&mix->cardfile);
+  for (int i = 0; i < 8; i++) {
+    closeblockdevice(&mix->tapefiles[i]);
+    closeblockdevice(&mix->diskfiles[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    closestream(&mix->streamfiles[i], false);
+    closestream(&mix->streamfiles[i], true);
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef _IO_H
+#define _IO_H
+#include "emulator.h"
+
+// The host side of the IO devices.
+//
+// A MIX IO operation is split into two halves:
+// 1. startio() is called when IN/OUT is issued.  For input devices,
+//    this queues a read of the next block from the host file.
+// 2. execute_io() is called when half the operation's time has
+//    elapsed, which is when the emulator moves data into or out of
+//    memory.  For input devices, it waits for the read to finish and
+//    copies the block into memory; for output devices, it copies the
+//    block out of memory and queues the write.
+// The host reads/writes are carried out by a worker thread, so that
+// the emulator doesn't stall on disk latency in the meantime.
+
+// Queue the host side of a freshly issued IO operation.
+// Return false if the previous operation on the device failed.
+bool startio(IOthread *iothread, mix *mix);
+// Transfer data between memory and the device.
+// Return false if there was an error carrying out the IO operation.
+bool execute_io(IOthread *iothread, mix *mix);
+// Number of blocks a tape moves over to carry out the IOC operation in
+// iothread.  For M=0 the tape is rewound, otherwise it skips forward
+// (M>0) or backward (M<0) over |M| blocks, stopping at the start.
+int seekdistance(IOthread *iothread, mix *mix);
+// Wait for all outstanding host transfers of the machine to finish.
+// This must be called before touching any of the device files.
+// Return false if any of them failed, reporting the failure in
+// mix->err unless it already holds an error.
+bool syncio(mix *mix);
+
+// Packed binary format for card decks, tapes and disks.
+// The file starts with the header below, followed by numblocks blocks
+// of blocksize words each (16 for cards, 100 for tapes and disks).  Each MIX
+// word is stored as a 32-bit integer in host byte order.
+#define BINMAGIC "MIXBLKS1"
+typedef struct {
+  char magic[8];
+  uint32_t blocksize;
+  uint32_t numblocks;
+} binheader;
+
+// Open the file backing a card reader (blocksize 16) or tape/disk unit
+// (blocksize 100), detecting whether it is a text or binary file.
+// Binary files are memory-mapped.  (Disks only support binary files.)
+// Return false if the file could not be opened.
+bool openblockdevice(blockdevice *dev, char *filename, int blocksize, bool writable);
+void closeblockdevice(blockdevice *dev);
+// Open the input or output stream of unit 17-20.  If filename
+// starts with |, the rest of it is run as a command with the stream
+// piped to/from it.
+// Return false if the file could not be opened.
+bool openstream(streamdevice *dev, char *filename, bool output);
+void closestream(streamdevice *dev, bool output);
+// Hand the lines printed so far over to the printer's sink (see
+// printersink), unless it keeps them.
+void flushprinter(mix *mix);
+// Close the files backing all the units of the machine, flushing the
+// printer and freeing its buffer.
+void closedevices(mix *mix);
+
+// Press the GO button: load the program on the card deck into memory,
+// as the standard loading routine (TAOCP exercise 1.3.1-26) would, and
+// set PC to the address on its transfer card.  The deck is read from
+// its first card.  The loading routine's own cards at the start of the
+// deck are skipped, and the card reader is left at the card after the
+// transfer card.  A deck written by mmm's C command, whose cards hold
+// 16 words each from location 0 up to a "....." card, is loaded as it
+// is, starting at 0.  If chargetime is set, the time of reading the
+// cards is added to mix->time.
+// Return false if the deck couldn't be loaded, reporting the error in
+// mix->err.
+bool loaddeck(mix *mix, bool chargetime);
+
+// Punch the first n words of mem (a multiple of 16) onto cards, 16
+// words to a card, followed by a "....." card, as mmm's C command does
+// for mixsim.mixal.  The words must not be negative.
+void writedeck(FILE *fp, word *mem, int n);
+
+// Journal of device transfers, for running a program again on exactly
+// the same input.  The file starts with JOURNALMAGIC, followed by an
+// entry for each transfer in the order they happened.  Each entry is
+// a journalentry followed by n words: the block read (IN) or written
+// (OUT), without signs for units 16-20.  IOC has no block.
+// When replaying, blocks for IN are taken from the journal and blocks
+// for OUT are checked against it, without touching the device files.
+#define JOURNALMAGIC "MIXJRNL1"
+typedef struct {
+  uint8_t F, C;
+  uint16_t n;
+  int32_t M;    // Address of the block, or the IOC operand
+  int32_t pos;  // Position of the tape or disk after the transfer
+  int64_t time;
+} journalentry;
+
+// Start recording the transfers of the machine into filename, or
+// replaying them from it.
+// Return false if the file could not be opened or is not a journal.
+bool openjournal(mix *mix, char *filename, bool replay);
+void closejournal(mix *mix);
+
+// Read/write a single block of the text format described in README.
+// readtextblock() returns the error message, or "" if there was none.
+char *readtextblock(FILE *fp, word *buf, bool card);
+void writetextblock(FILE *fp, word *buf, bool card);
+#endif
@@ -0,0 +1,95 @@
+// Convert card decks and tapes between the text format (see README)
+// and the packed binary format (see io.h).
+//
+// Usage: mixconv [-c] <from> <to>
+// The direction of the conversion is detected from <from>.  Pass -c
+// for card decks; otherwise the files are taken to be tapes.
+
+#include "emulator.h"
+#include "io.h"
+
+// Return true if there is nothing but newlines left in fp.
+static bool attextend(FILE *fp) {
+  int c;
+  while ((c = fgetc(fp)) == '\n');
+  if (c == EOF)
+    return true;
+  ungetc(c, fp);
+  return false;
+}
+
+static bool texttobinary(FILE *in, FILE *out, bool card) {
+  int blocksize = card ? 16 : 100;
+  binheader header;
+  memcpy(header.magic, BINMAGIC, sizeof(header.magic));
+  header.blocksize = blocksize;
+  header.numblocks = 0;
+  fwrite(&header, sizeof(header), 1, out);
+
+  word buf[100];
+  while (!attextend(in)) {
+    char *err = readtextblock(in, buf, card);
+    if (err[0] != '\0') {
+      fprintf(stderr, "Block %d: %s\n", header.numblocks, err);
+      return false;
+    }
+    fwrite(buf, sizeof(word), blocksize, out);
+    header.numblocks++;
+  }
+
+  rewind(out);
+  fwrite(&header, sizeof(header), 1, out);
+  printf("Converted %d blocks to binary\n", header.numblocks);
+  return true;
+}
+
+static bool binarytotext(FILE *in, FILE *out, binheader *header, bool card) {
+  int blocksize = card ? 16 : 100;
+  if (header->blocksize != blocksize) {
+    fprintf(stderr, "Expected blocks of %d words, but the file has %d\n",
+	    blocksize, header->blocksize);
+    return false;
+  }
+  word buf[100];
+  for (int i = 0; i < header->numblocks; i++) {
+    if (fread(buf, sizeof(word), blocksize, in) != blocksize) {
+      fprintf(stderr, "Block %d: unexpected end of file\n", i);
+      return false;
+    }
+    writetextblock(out, buf, card);
+  }
+  printf("Converted %d blocks to text\n", header->numblocks);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool card = argc >= 2 && !strcmp(argv[1], "-c");
+  if (argc != 3 + card) {
+    fprintf(stderr, "Usage: %s [-c] <from> <to>\n", argv[0]);
+    return 1;
+  }
+  char *from = argv[1+card], *to = argv[2+card];
+
+  FILE *in, *out;
+  if ((in = fopen(from, "r")) == NULL) {
+    fprintf(stderr, "Could not open %s\n", from);
+    return 1;
+  }
+  if ((out = fopen(to, "w")) == NULL) {
+    fprintf(stderr, "Could not create %s\n", to);
+    return 1;
+  }
+
+  binheader header;
+  bool ok;
+  if (fread(&header, sizeof(header), 1, in) == 1 &&
+      memcmp(header.magic, BINMAGIC, sizeof(header.magic)) == 0)
+    ok = binarytotext(in, out, &header, card);
+  else {
+    rewind(in);
+    ok = texttobinary(in, out, card);
+  }
+  fclose(in);
+  fclose(out);
+  return ok ? 0 : 1;
+}
@@ -2,8 +2,18 @@
 
 #include <ctype.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include "emulator.h"
 #include "assembler.h"
+#include "io.h"
+#include "charset.h"
+#include "object.h"
+#include "cfg.h"
+#include "profile.h"
+#include "advisor.h"
 
 typedef struct {
   mix mix;
@@ -11,8 +21,28 @@ typedef struct {
   char prevline[LINELEN];
   char globalcardfile[LINELEN];
   char globaltapefiles[8][LINELEN];
-  char debuglines[4000][LINELEN];
+  char globaldiskfiles[8][LINELEN];
+  char globalstreamfiles[4][2][LINELEN];  // Units 17-20, input/output
+  char globaljournal[LINELEN];
+  bool globalreplaying;
+  bool globalinterrupts;
+  sourcefile source;     // The MIXAL source, kept for displaying instructions
+  sourceinfo sourceinfo;
+  // The memory as assembled, before the program changed it, for
+  // reassembling only what changed on reload.
+  word image[4000], controlimage[4000];
+  int start;
+  bool fromdeck;             // Whether image was loaded by G instead
+  int watchfd;               // inotify descriptor watching the source, or -1
+  char objectfile[LINELEN];  // Where to save the assembled program, if anywhere
+  bool usecache;             // Whether to use the object cache
+  char links[8][LINELEN];    // The modules to link the program with
+  int numlinks;
   bool shouldtrace;
+  edgeprofile *profile;      // Counting only some edges (see profile.h), or NULL
+  uint32_t breakpoints[125]; // The cells with breakpoints, one bit each (see run())
+  int breakhits[4000];       // How often the program came to each breakpoint
+  int breakignores[4000];    // How many times to go past each before stopping
 } mmmstate;
 
 #define RED(s)    "\033[31m" s "\033[37m"
@@ -85,14 +115,17 @@ int displayinstr_canonical(word w) {
 #define UNKNOWN()      { printf("???"); return 3; }
 
   if (C == 0) PP("NOP", 0)
-  else if (C == 1) PP("ADD", 5)
-  else if (C == 2) PP("SUB", 5)
-  else if (C == 3) PP("MUL", 5)
-  else if (C == 4) PP("DIV", 5)
+  else if (C == 1) { if (F == 6) PP("FADD", 6) else PP("ADD", 5) }
+  else if (C == 2) { if (F == 6) PP("FSUB", 6) else PP("SUB", 5) }
+  else if (C == 3) { if (F == 6) PP("FMUL", 6) else PP("MUL", 5) }
+  else if (C == 4) { if (F == 6) PP("FDIV", 6) else PP("DIV", 5) }
   else if (C == 5) {
-    if (F == 0) PP("MUL", 0)
+    if (F == 0) PP("NUM", 0)
     else if (F == 1) PP("CHAR", 1)
     else if (F == 2) PP("HLT", 2)
+    else if (F == 6) PP("FLOT", 6)
+    else if (F == 7) PP("FIX", 7)
+    else if (F == 9) PP("INT", 9)
     else UNKNOWN()
   }
   else if (C == 6) {
@@ -102,6 +135,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("SRAX", 3)
     else if (F == 4) PP("SLC", 4)
     else if (F == 5) PP("SRC", 5)
+    else if (F == 6) PP("SLB", 6)
+    else if (F == 7) PP("SRB", 7)
     else UNKNOWN()
   }
   else if (C == 7) PP("MOVE", 1)
@@ -156,6 +191,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("JANN", 3)
     else if (F == 4) PP("JANZ", 4)
     else if (F == 5) PP("JANP", 5)
+    else if (F == 6) PP("JAE", 6)
+    else if (F == 7) PP("JAO", 7)
     else UNKNOWN()
   }
   else if (C == 41) {
@@ -165,6 +202,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J1NN", 3)
     else if (F == 4) PP("J1NZ", 4)
     else if (F == 5) PP("J1NP", 5)
+    else if (F == 6) PP("J1E", 6)
+    else if (F == 7) PP("J1O", 7)
     else UNKNOWN()
   }
   else if (C == 42) {
@@ -174,6 +213,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J2NN", 3)
     else if (F == 4) PP("J2NZ", 4)
     else if (F == 5) PP("J2NP", 5)
+    else if (F == 6) PP("J2E", 6)
+    else if (F == 7) PP("J2O", 7)
     else UNKNOWN()
   }
   else if (C == 43) {
@@ -183,6 +224,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J3NN", 3)
     else if (F == 4) PP("J3NZ", 4)
     else if (F == 5) PP("J3NP", 5)
+    else if (F == 6) PP("J3E", 6)
+    else if (F == 7) PP("J3O", 7)
     else UNKNOWN()
   }
   else if (C == 44) {
@@ -192,6 +235,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J4NN", 3)
     else if (F == 4) PP("J4NZ", 4)
     else if (F == 5) PP("J4NP", 5)
+    else if (F == 6) PP("J4E", 6)
+    else if (F == 7) PP("J4O", 7)
     else UNKNOWN()
   }
   else if (C == 45) {
@@ -201,6 +246,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J5NN", 3)
     else if (F == 4) PP("J5NZ", 4)
     else if (F == 5) PP("J5NP", 5)
+    else if (F == 6) PP("J5E", 6)
+    else if (F == 7) PP("J5O", 7)
     else UNKNOWN()
   }
   else if (C == 46) {
@@ -210,6 +257,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("J6NN", 3)
     else if (F == 4) PP("J6NZ", 4)
     else if (F == 5) PP("J6NP", 5)
+    else if (F == 6) PP("J6E", 6)
+    else if (F == 7) PP("J6O", 7)
     else UNKNOWN()
   }
   else if (C == 47) {
@@ -219,6 +268,8 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("JXNN", 3)
     else if (F == 4) PP("JXNZ", 4)
     else if (F == 5) PP("JXNP", 5)
+    else if (F == 6) PP("JXE", 6)
+    else if (F == 7) PP("JXO", 7)
     else UNKNOWN()
   }
   else if (C == 48) {
@@ -277,7 +328,7 @@ int displayinstr_canonical(word w) {
     else if (F == 3) PP("ENNX", 3)
     else UNKNOWN()
   }
-  else if (C == 56) PP("CMPA", 5)
+  else if (C == 56) { if (F == 6) PP("FCMP", 6) else PP("CMPA", 5) }
   else if (C == 57) PP("CMP1", 5)
   else if (C == 58) PP("CMP2", 5)
   else if (C == 59) PP("CMP3", 5)
@@ -293,26 +344,32 @@ int displayinstr_canonical(word w) {
 // user-defined constants.
 // If MIXAL source is not available, fall back to the canonical representation.
 void displayinstr_mixal(int i, mmmstate *mmm) {
-  if (i < 0 || i >= 4000) {
+  if (i <= -4000 || i >= 4000) {
     printf(RED("Invalid memory address %04d\n"), i);
     return;
   }
-  if (mmm->debuglines[i][0] == '\0') {
+  // There is no MIXAL source for the control state locations.
+  if (i < 0 || mmm->sourceinfo.srcoffsets[i] < 0) {
     putchar('\t');
-    displayinstr_canonical(mmm->mix.mem[i]);
+    displayinstr_canonical(MEMORY(&mmm->mix, i));
+  }
+  else {
+    char *line = mmm->source.buf + mmm->sourceinfo.srcoffsets[i];
+    char *end = memchr(line, '\n', mmm->source.buf + mmm->source.len - line);
+    if (end > line && end[-1] == '\r')
+      end--;
+    fwrite(line, 1, end-line, stdout);
   }
-  else
-    printf(mmm->debuglines[i]);
 }
 
 // Display the instruction as a complete line, for debugging purposes.
 // The following format is used:
 // LINENUM:EXECCOUNT +- AAAA I F C            MIXAL or canonical
 void displayinstr_debug(int i, mmmstate *mmm) {
-  int execcount = mmm->mix.execcounts[i];
+  int execcount = i >= 0 ? mmm->mix.execcounts[i] : 0;
   printf(BLUE("%04d:%d "), i, execcount+1);
   printf("\033[33m");
-  displayinstr_raw(mmm->mix.mem[i]);
+  displayinstr_raw(MEMORY(&mmm->mix, i));
   printf("\033[37m\t");
   displayinstr_mixal(i, mmm);
   putchar('\n');
@@ -437,6 +494,8 @@ int numdigits(int x) {
 }
 
 void printtime(mmmstate *mmm) {
+  if (mmm->profile != NULL)
+    profilecounts(mmm->profile, &mmm->mix);
   int totaltime = 0;
   int maxdigits = 0;
   for (int i = 0; i < 4000; i++) {
@@ -472,8 +531,107 @@ void printtime(mmmstate *mmm) {
   }
 }
 
+// Print the blocks, loops and time of each routine of the program as
+// it was loaded.  The time of a routine is the sum of the times of its
+// blocks, each multiplied by the number of times the block is
+// executed, written Nxxxx for the block at location xxxx.  Once the
+// program has run, blocks executed the same number of times are
+// combined into one term, and the time is worked out too.
+void printcfg(mmmstate *mmm) {
+  static cfg g;
+  if (mmm->profile != NULL)
+    profilecounts(mmm->profile, &mmm->mix);
+  bool ran = false;
+  for (int i = 0; i < 4000; i++)
+    ran |= mmm->mix.execcounts[i] > 0;
+  int *counts = ran ? mmm->mix.execcounts : NULL;
+  buildcfg(mmm->image, mmm->start, counts, &mmm->ps, &g);
+
+  for (int r = 0; r < g.numroutines; r++) {
+    routine *rt = &g.routines[r];
+    printf(CYAN("%s %s") " at %04d\n", r == 0 ? "PROGRAM" : "SUBROUTINE",
+	   rt->name, g.blocks[rt->entry].first);
+    // The terms of the time formula: the time of the blocks with each
+    // count, named after the first of them.
+    int terms[4000], numterms = 0;
+    static int coefs[4000];
+    for (int b = 0; b < g.numblocks; b++) {
+      block *bl = &g.blocks[b];
+      if (bl->routine != r)
+	continue;
+      printf(BLUE("  %04d-%04d ") YELLOW("%4du") "  ", bl->first, bl->last, bl->time);
+      if (bl->depth > 0)
+	printf("loop %04d, depth %d  ", g.blocks[bl->header].first, bl->depth);
+      for (int e = bl->firstedge; e < bl->firstedge + bl->numedges; e++) {
+	edge *ed = &g.edges[e];
+	int to = g.blocks[ed->to].first;
+	if (ed->kind == EDGE_JUMP)
+	  printf("-> %04d  ", to);
+	else if (ed->kind == EDGE_CALL) {
+	  for (int i = 0; i < g.numroutines; i++) {
+	    if (g.routines[i].entry != ed->to)
+	      continue;
+	    if (g.routines[i].name[0] != '\0')
+	      printf("call %s  ", g.routines[i].name);
+	    else
+	      printf("call %04d  ", to);
+	  }
+	}
+	else if (ed->kind == EDGE_RETURN)
+	  printf("return %04d  ", to);
+      }
+      if (bl->unknownexit)
+	printf("-> ?");
+      putchar('\n');
+
+      int t = 0;
+      while (t < numterms && (counts == NULL ||
+			      counts[bl->first] != counts[g.blocks[terms[t]].first]))
+	t++;
+      if (t == numterms || counts == NULL) {
+	t = numterms++;
+	terms[t] = b;
+	coefs[t] = 0;
+      }
+      coefs[t] += bl->time;
+    }
+    printf("  time =");
+    long total = 0;
+    for (int t = 0; t < numterms; t++) {
+      printf("%s %d N%04d", t == 0 ? "" : " +", coefs[t], g.blocks[terms[t]].first);
+      if (counts != NULL)
+	total += (long)coefs[t] * counts[g.blocks[terms[t]].first];
+    }
+    if (counts != NULL)
+      printf(" = " GREEN("%ldu") " in the last run", total);
+    printf("\n\n");
+  }
+}
+
+// Print the rewrites of the program that would have saved the most
+// time in the last run.
+void printadvice(mmmstate *mmm) {
+  static cfg g;
+  advice list[20];
+  if (mmm->profile != NULL)
+    profilecounts(mmm->profile, &mmm->mix);
+  bool ran = false;
+  for (int i = 0; i < 4000; i++)
+    ran |= mmm->mix.execcounts[i] > 0;
+  if (!ran) {
+    printf(RED("Run the program first, so that the time of each rewrite can be estimated\n"));
+    return;
+  }
+  buildcfg(mmm->image, mmm->start, mmm->mix.execcounts, &mmm->ps, &g);
+  int n = advise(mmm->image, &g, mmm->mix.execcounts, &mmm->ps, list, 20);
+  if (n == 0)
+    printf(GREEN("Nothing to suggest\n"));
+  for (int i = 0; i < n; i++)
+    printf(YELLOW("%8ldu ") BLUE("%04d ") " %s\n", list[i].saved, list[i].cell, list[i].text);
+}
+
 bool onestepwrapper(int tracecount, mmmstate *mmm) {
-  int execcount = mmm->mix.execcounts[mmm->mix.PC];
+  int execcount = mmm->mix.PC >= 0 ? mmm->mix.execcounts[mmm->mix.PC] : 0;
   if (execcount < tracecount) {
     if (!mmm->shouldtrace) {
       printf("----------------------------------------------------------------------------------------------\n");
@@ -492,17 +650,6 @@ bool onestepwrapper(int tracecount, mmmstate *mmm) {
   return true;
 }
 
-bool getsymvalue(char *s, mmmstate *mmm, word *w) {
-  // Find the symbol in parse state
-  for (int i = 0; i < MAXSYMS; i++) {
-    if (strncmp(s, mmm->ps.syms[i], 11) == 0) {
-      *w = mmm->ps.symvals[i];
-      return true;
-    }
-  }
-  return false;
-}
-
 void viewcommand(char *arg, mmmstate *mmm) {
   // Print all nonzero memory addresses
   if (arg[0] == '\0') {
@@ -537,36 +684,124 @@ void viewcommand(char *arg, mmmstate *mmm) {
   // Print address corresponding to the given symbol
   else if (arg[0] == '.') {
     word w;
-    if (getsymvalue(arg+1, mmm, &w))
+    if (lookupsym(arg+1, &w, &mmm->ps))
       displayaddr_verbose(INT(w), mmm);
     else
       printf(BLUE("I'm not aware of the symbol %s\n"), arg);
   }
 }
 
+// Read a breakpoint given as a cell or .SYMBOL from *arg, and move
+// *arg past it.
+bool readbreakpoint(char **arg, int *bp, mmmstate *mmm) {
+  char *end = *arg;
+  while (*end != '\0' && !isspace(*end))
+    end++;
+  char after = *end;
+  *end = '\0';
+  bool ok = true;
+  if (isdigit((*arg)[0]))
+    *bp = atoi(*arg);
+  else if ((*arg)[0] == '.') {
+    word w;
+    if (lookupsym(*arg+1, &w, &mmm->ps))
+      *bp = INT(w);
+    else {
+      printf(BLUE("I'm not aware of the symbol %s\n"), *arg);
+      ok = false;
+    }
+  }
+  else {
+    printf(BLUE("Give the breakpoint as a line or .SYMBOL\n"));
+    ok = false;
+  }
+  *end = after;
+  *arg = end;
+  if (ok && (*bp < 0 || *bp >= 4000)) {
+    printf(RED("Breakpoint must be between 0-4000\n"));
+    ok = false;
+  }
+  return ok;
+}
+
+// Count that the program came to the breakpoint at the PC, and return
+// whether it should stop there.
+bool hitbreakpoint(mmmstate *mmm) {
+  int PC = mmm->mix.PC;
+  if (++mmm->breakhits[PC] <= mmm->breakignores[PC])
+    return false;
+  printf(CYAN("Breakpoint at %04d, reached %d times\n"), PC, mmm->breakhits[PC]);
+  return true;
+}
+
+// Run until the program stops, comes to target (unless it is -1), or
+// stops at one of the breakpoints.  The emulator checks the bitmap
+// itself, so this is about as fast as running without breakpoints.
+// Return whether the program is at a breakpoint or target.
+bool runtobreak(int target, mmmstate *mmm) {
+  uint32_t *breaks = mmm->breakpoints;
+  bool temporary = target >= 0 && !ISBREAK(breaks, target);
+  if (temporary)
+    breaks[target/32] |= 1u << (target%32);
+  bool stop = false;
+  while (!stop && run(&mmm->mix, breaks)) {
+    if (temporary && mmm->mix.PC == target)
+      stop = true;
+    else
+      stop = hitbreakpoint(mmm) || mmm->mix.PC == target;
+  }
+  if (temporary)
+    breaks[target/32] &= ~(1u << (target%32));
+  if (mmm->mix.err[0] != '\0')
+    printf(RED("Emulator stopped at %d: %s\n"), mmm->mix.PC, mmm->mix.err);
+  return stop;
+}
+
 void breakpointcommand(char *arg, mmmstate *mmm) {
   int bp;
-  if (isdigit(arg[0])) {
-    bp = atoi(arg);
+  if (!readbreakpoint(&arg, &bp, mmm))
+    return;
+  if (runtobreak(bp, mmm))
+    displayinstr_debug(mmm->mix.PC, mmm);
+  else
+    printf(GREEN("Program has finished running; type l to reset\n"));
+}
+
+// Set, delete or list the breakpoints the program stops at.
+void breakpointscommand(char *arg, mmmstate *mmm) {
+  int bp;
+  // List the breakpoints
+  if (arg[0] == '\0') {
+    for (bp = 0; bp < 4000; bp++) {
+      if (!ISBREAK(mmm->breakpoints, bp))
+	continue;
+      printf(BLUE("%04d ") " reached %d times", bp, mmm->breakhits[bp]);
+      if (mmm->breakignores[bp] > 0)
+	printf(", stopping after %d", mmm->breakignores[bp]);
+      printf("\n");
+    }
   }
-  else if (arg[0] == '.') {
-    word w;
-    if (!getsymvalue(arg+1, mmm, &w)) {
-      printf(BLUE("I'm not aware of the symbol %s\n"), arg);
+  // Delete all breakpoints, or the given one
+  else if (arg[0] == '-') {
+    arg++;
+    if (arg[0] == '\0') {
+      memset(mmm->breakpoints, 0, sizeof(mmm->breakpoints));
       return;
     }
-    bp = INT(w);
+    if (!readbreakpoint(&arg, &bp, mmm))
+      return;
+    if (!ISBREAK(mmm->breakpoints, bp))
+      printf(BLUE("There is no breakpoint at %04d\n"), bp);
+    mmm->breakpoints[bp/32] &= ~(1u << (bp%32));
   }
-
-  if (bp < 0 || bp >= 4000) {
-    printf(RED("Breakpoint must be between 0-4000\n"));
-    return;
+  // Set a breakpoint, going past it the given number of times
+  else {
+    if (!readbreakpoint(&arg, &bp, mmm))
+      return;
+    mmm->breakpoints[bp/32] |= 1u << (bp%32);
+    mmm->breakhits[bp] = 0;
+    mmm->breakignores[bp] = atoi(arg);
   }
-  do {
-    if (!onestepwrapper(0, mmm))
-      break;
-  } while (mmm->mix.PC != bp);
-  displayinstr_debug(bp, mmm);
 }
 
 void gocommand(char *arg, mmmstate *mmm) {
@@ -577,24 +812,43 @@ void gocommand(char *arg, mmmstate *mmm) {
     tracecount = 2147483647;
   else
     tracecount = 0;
-  mmm->shouldtrace = true;
-  while (!mmm->mix.done)
-    onestepwrapper(tracecount, mmm);
+  // Tracing the first executions of each line needs the counts as the
+  // program runs.
+  if (0 < tracecount && tracecount < 10 && mmm->profile != NULL) {
+    printf(RED("Turn off edge profiling with p to trace the first executions\n"));
+    return;
+  }
+  if (tracecount == 0) {
+    if (runtobreak(-1, mmm)) {
+      displayinstr_debug(mmm->mix.PC, mmm);
+      return;
+    }
+  }
+  else {
+    mmm->shouldtrace = true;
+    while (!mmm->mix.done) {
+      onestepwrapper(tracecount, mmm);
+      int PC = mmm->mix.PC;
+      if (!mmm->mix.done && 0 <= PC && PC < 4000 && ISBREAK(mmm->breakpoints, PC) &&
+	  hitbreakpoint(mmm)) {
+	displayinstr_debug(PC, mmm);
+	return;
+      }
+    }
+  }
   printf(GREEN("Program has finished running; type l to reset\n"));
 }
 
 bool loadcardfile(char *filename, mmmstate *mmm) {
   if (filename[0] == '\0')
     return true;
-  FILE *fp;
-  if ((fp = fopen(filename, "r")) == NULL) {
+  syncio(&mmm->mix);
+  closeblockdevice(&mmm->mix.cardfile);
+  if (!openblockdevice(&mmm->mix.cardfile, filename, 16, false)) {
     printf(RED("Could not open card file %s\n"), filename);
     return false;
   }
   printf(GREEN("Loaded card file %s\n"), filename);
-  if (mmm->mix.cardfile)
-    fclose(mmm->mix.cardfile);
-  mmm->mix.cardfile = fp;
   return true;
 }
 
@@ -605,57 +859,260 @@ bool loadtapefile(char *filename, int n, mmmstate *mmm) {
     printf(RED("Invalid tape number %d\n"), n);
     return false;
   }
-  FILE *fp;
-  if ((fp = fopen(filename, "r+")) == NULL) {
+  syncio(&mmm->mix);
+  closeblockdevice(&mmm->mix.tapefiles[n]);
+  if (!openblockdevice(&mmm->mix.tapefiles[n], filename, 100, true)) {
     printf(RED("Could not open tape file %s\n"), filename);
     return false;
   }
   printf(GREEN("Loaded tape file %s\n"), filename);
-  if (mmm->mix.tapefiles[n])
-    fclose(mmm->mix.tapefiles[n]);
-  mmm->mix.tapefiles[n] = fp;
   return true;
 }
 
-bool loadmixalfile(char *filename, mmmstate *mmm) {
+bool loaddiskfile(char *filename, int n, mmmstate *mmm) {
+  if (filename[0] == '\0')
+    return true;
+  if (!ISDISK(n)) {
+    printf(RED("Invalid disk number %d\n"), n);
+    return false;
+  }
+  syncio(&mmm->mix);
+  blockdevice *dev = &mmm->mix.diskfiles[n-8];
+  closeblockdevice(dev);
+  if (!openblockdevice(dev, filename, 100, true)) {
+    printf(RED("Could not open disk file %s\n"), filename);
+    return false;
+  }
+  if (dev->map == NULL) {
+    printf(RED("Disk file %s is not in binary format; convert it with mixconv\n"), filename);
+    closeblockdevice(dev);
+    return false;
+  }
+  printf(GREEN("Loaded disk file %s\n"), filename);
+  return true;
+}
+
+bool loadstreamfile(char *filename, int n, bool output, mmmstate *mmm) {
+  if (filename[0] == '\0')
+    return true;
+  if (output ? !(ISSTREAM(n) && ISOUTPUT(n)) : !(ISSTREAM(n) && ISINPUT(n))) {
+    printf(RED("Unit %d can't be used for streaming %s\n"), n, output ? "output" : "input");
+    return false;
+  }
+  syncio(&mmm->mix);
+  if (n == 18)
+    flushprinter(&mmm->mix);
+  if (!openstream(&mmm->mix.streamfiles[n-17], filename, output)) {
+    printf(RED("Could not open %s\n"), filename);
+    return false;
+  }
+  printf(GREEN("Unit %d %s %s\n"), n, output ? "writes to" : "reads from", filename);
+  return true;
+}
+
+bool loadjournal(char *filename, bool replay, mmmstate *mmm) {
+  if (filename[0] == '\0')
+    return true;
+  syncio(&mmm->mix);
+  if (!openjournal(&mmm->mix, filename, replay)) {
+    printf(RED("Could not open journal %s\n"), filename);
+    return false;
+  }
+  printf(GREEN("%s device transfers %s %s\n"), replay ? "Replaying" : "Recording",
+	 replay ? "from" : "into", filename);
+  return true;
+}
+
+// Set the timings of an IO unit, given arg = "<unit> <in> <out> <ioc> <seek>",
+// or print them if only the unit is given.
+void unitcommand(char *arg, mmmstate *mmm) {
+  int n, in, out, ioc, seek;
+  int numargs = sscanf(arg, "%d %d %d %d %d", &n, &in, &out, &ioc, &seek);
+  if (numargs < 1 || !ISUNIT(n)) {
+    printf(RED("Invalid unit number\n"));
+    return;
+  }
+  if (numargs == 5) {
+    mmm->mix.INtimes[n] = in;
+    mmm->mix.OUTtimes[n] = out;
+    mmm->mix.IOCtimes[n] = ioc;
+    mmm->mix.seektimes[n] = seek;
+  }
+  else if (numargs != 1) {
+    printf(RED("Expected u<unit> <in> <out> <ioc> <seek>\n"));
+    return;
+  }
+  printf(GREEN("%d") "  IN %du, OUT %du, IOC %du, %du per block moved\n", n,
+	 mmm->mix.INtimes[n], mmm->mix.OUTtimes[n], mmm->mix.IOCtimes[n], mmm->mix.seektimes[n]);
+}
+
+void showassemblererror(sourcefile *source, int errline) {
+  char *line = source->buf;
+  for (int i = 1; i < errline; i++)
+    line = memchr(line, '\n', source->buf + source->len - line) + 1;
+  char *end = memchr(line, '\n', source->buf + source->len - line);
+  printf(RED("Assembler error at line %d: %.*s\n"), errline, (int)(end-line), line);
+}
+
+// Assemble the MIXAL source into a module, or take the module from the
+// cache.
+bool assemblemodule(sourcefile *source, char *filename, module *m, mmmstate *mmm) {
+  uint64_t hash = hashsource(source->buf, source->len);
+  char cachefile[2*LINELEN];
+  bool cached = mmm->usecache && objectcachepath(hash, "mixm", cachefile, sizeof(cachefile));
+  if (cached && loadmodule(cachefile, hash, m))
+    return true;
+
+  parsestate ps;
+  initparsestate(&ps);
   initmix(&mmm->mix);
+  bool ok = assemble(source->buf, source->len, &ps, &mmm->mix, &mmm->sourceinfo);
+  if (!ok)
+    showassemblererror(source, mmm->sourceinfo.errline);
+  else {
+    char *err = makemodule(&mmm->mix, &ps, &mmm->sourceinfo, hash, m);
+    if (err[0] != '\0') {
+      printf(RED("Could not make a module of %s: %s\n"), filename, err);
+      ok = false;
+    }
+    else if (cached)
+      savemodule(cachefile, m);
+  }
+  freeparsestate(&ps);
+  return ok;
+}
+
+// Link the MIXAL file, whose source is already open, with the modules
+// given with --link.
+bool linkfiles(char *filename, mmmstate *mmm) {
+  int n = mmm->numlinks + 1;
+  module mods[n];
+  bool ok = assemblemodule(&mmm->source, filename, &mods[0], mmm);
+  int numloaded = ok;
+  while (ok && numloaded < n) {
+    sourcefile source;
+    char *linkname = mmm->links[numloaded-1];
+    if (!opensource(&source, linkname)) {
+      printf(RED("Could not open MIXAL file %s\n"), linkname);
+      ok = false;
+    }
+    else {
+      ok = assemblemodule(&source, linkname, &mods[numloaded], mmm);
+      closesource(&source);
+      numloaded += ok;
+    }
+  }
+
+  freeparsestate(&mmm->ps);
   initparsestate(&mmm->ps);
+  initmix(&mmm->mix);
+  mmm->mix.interrupts = mmm->globalinterrupts;
+  if (ok) {
+    char *err = linkmodules(mods, n, &mmm->mix, &mmm->ps, &mmm->sourceinfo);
+    if (err[0] != '\0') {
+      printf(RED("Could not link %s: %s\n"), filename, err);
+      initmix(&mmm->mix);
+      ok = false;
+    }
+    else
+      printf(GREEN("Loaded MIXAL file %s, linked with %d module%s\n"), filename,
+	     n-1, n == 2 ? "" : "s");
+  }
+  for (int i = 0; i < numloaded; i++)
+    freemodule(&mods[i]);
+  return ok;
+}
 
-  FILE *fp;
-  if ((fp = fopen(filename, "r")) == NULL) {
+bool loadmixalfile(char *filename, mmmstate *mmm) {
+  // The worker thread may still be using the old machine's devices.
+  syncio(&mmm->mix);
+  closedevices(&mmm->mix);
+  initmix(&mmm->mix);
+  mmm->mix.interrupts = mmm->globalinterrupts;
+
+  closesource(&mmm->source);
+  if (!opensource(&mmm->source, filename)) {
     printf(RED("Could not open MIXAL file %s\n"), filename);
     return false;
   }
-  int linenum = 0;
-  char line[LINELEN];
-  extraparseinfo extraparseinfo;
-  while (++linenum && fgets(line, LINELEN, fp) != NULL) {
-    if (!parseline(line, &mmm->ps, &mmm->mix, &extraparseinfo)) {
-      printf(RED("Assembler error at line %d: %s"), linenum, line);
+
+  // An assembled object file instead of MIXAL; its source map is of no
+  // use without the source.
+  if (mmm->source.len >= 8 && !memcmp(mmm->source.buf, OBJMAGIC, 8)) {
+    closesource(&mmm->source);
+    freeparsestate(&mmm->ps);
+    initparsestate(&mmm->ps);
+    if (!loadobject(filename, 0, &mmm->mix, &mmm->ps, &mmm->sourceinfo)) {
+      printf(RED("Could not load object file %s\n"), filename);
       initmix(&mmm->mix);
       return false;
     }
-    if (extraparseinfo.setdebugline) {
-      strncpy(mmm->debuglines[mmm->ps.star-1], line, LINELEN);
-      int len = strlen(line);
-      mmm->debuglines[mmm->ps.star-1][len-1] = '\0';
+    for (int i = 0; i < 4000; i++)
+      mmm->sourceinfo.srcoffsets[i] = -1;
+    printf(GREEN("Loaded object file %s\n"), filename);
+    if (mmm->profile != NULL)
+      startprofile(mmm->profile, &mmm->mix, &mmm->ps);
+    return true;
+  }
+
+  uint64_t hash = hashsource(mmm->source.buf, mmm->source.len);
+  if (mmm->numlinks > 0) {
+    if (!linkfiles(filename, mmm))
+      return false;
+    goto assembled;
+  }
+  char cachefile[2*LINELEN];
+  bool cached = mmm->usecache && objectcachepath(hash, "mixo", cachefile, sizeof(cachefile));
+
+  // If the source was assembled before, only parse what changed.  (The
+  // objects in the cache don't say what each line did, so this only
+  // works after the source has been assembled once in this session.)
+  if (mmm->ps.numlines > 0 && !mmm->fromdeck) {
+    memcpy(mmm->mix.mem, mmm->image, sizeof(mmm->image));
+    memcpy(mmm->mix.controlmem, mmm->controlimage, sizeof(mmm->controlimage));
+    mmm->mix.PC = mmm->start;
+    if (reassemble(mmm->source.buf, mmm->source.len, &mmm->ps, &mmm->mix, &mmm->sourceinfo)) {
+      printf(GREEN("Reloaded MIXAL file %s\n"), filename);
+      if (cached)
+	saveobject(cachefile, hash, &mmm->mix, &mmm->ps, &mmm->sourceinfo);
+      goto assembled;
+    }
+    initmix(&mmm->mix);
+    mmm->mix.interrupts = mmm->globalinterrupts;
+  }
+  freeparsestate(&mmm->ps);
+  initparsestate(&mmm->ps);
+
+  if (cached && loadobject(cachefile, hash, &mmm->mix, &mmm->ps, &mmm->sourceinfo))
+    printf(GREEN("Loaded MIXAL file %s (assembled earlier)\n"), filename);
+  else {
+    if (!assemble(mmm->source.buf, mmm->source.len, &mmm->ps, &mmm->mix, &mmm->sourceinfo)) {
+      showassemblererror(&mmm->source, mmm->sourceinfo.errline);
+      initmix(&mmm->mix);
+      return false;
     }
-    if (extraparseinfo.isend)
-      break;
+    if (cached)
+      saveobject(cachefile, hash, &mmm->mix, &mmm->ps, &mmm->sourceinfo);
+    printf(GREEN("Loaded MIXAL file %s\n"), filename);
+    if (mmm->ps.pooled > 0)
+      printf("Sharing cells of literals and undefined symbols saved %d word%s\n", mmm->ps.pooled,
+	     mmm->ps.pooled == 1 ? "" : "s");
   }
-  printf(GREEN("Loaded MIXAL file %s\n"), filename);
-  return true;
-}
 
-static unsigned char mixchr_ascii(byte b) {
-  char extra;
-  char c = mixchr(b, &extra);
-  if (extra == 0x94)
-    return '!';
-  else if (extra == 0xa3)
-    return '[';
-  else if (extra == 0xa4)
-    return ']';
+assembled:
+  memcpy(mmm->image, mmm->mix.mem, sizeof(mmm->image));
+  memcpy(mmm->controlimage, mmm->mix.controlmem, sizeof(mmm->controlimage));
+  mmm->start = mmm->mix.PC;
+  mmm->fromdeck = false;
+  if (mmm->objectfile[0] != '\0') {
+    if (saveobject(mmm->objectfile, hash, &mmm->mix, &mmm->ps, &mmm->sourceinfo))
+      printf(GREEN("Saved object file %s\n"), mmm->objectfile);
+    else
+      printf(RED("Could not save object file %s\n"), mmm->objectfile);
+  }
+  if (mmm->profile != NULL)
+    startprofile(mmm->profile, &mmm->mix, &mmm->ps);
+  return true;
 }
 
 void exportcards(mmmstate *mmm) {
@@ -677,35 +1134,21 @@ void exportcards(mmmstate *mmm) {
     return;
   }
 
-  FILE *fp;
-  if ((fp = fopen("program.cards", "w")) == NULL)
-    printf(RED("Could not create file program.cards\n"));
-
   for (int i = 0; i <= programend; i++) {
-    word w = mmm->mix.mem[i];
-    if (!SIGN(w)) {
+    if (!SIGN(mmm->mix.mem[i])) {
       printf(RED("Negative words cannot be loaded into cards\n"));
       return;
     }
-    byte b5 =  w      & ONES(6);
-    byte b4 = (w>>6)  & ONES(6);
-    byte b3 = (w>>12) & ONES(6);
-    byte b2 = (w>>18) & ONES(6);
-    byte b1 = (w>>24) & ONES(6);
-    printf("%d/%d: %d %d %d %d %d\n", i,programend, b1,b2,b3,b4,b5);
-    fputc(mixchr_ascii(b1), fp);
-    fputc(mixchr_ascii(b2), fp);
-    fputc(mixchr_ascii(b3), fp);
-    fputc(mixchr_ascii(b4), fp);
-    fputc(mixchr_ascii(b5), fp);
-    if (i%16 == 15)  // End of card
-      fputc('\n', fp);
-  }
-
-  // End-of-program card
-  fputs(".....", fp);
-  for (int i = 0; i < 75; i++)
-    fputc(' ', fp);
+  }
+
+  FILE *fp;
+  if ((fp = fopen("program.cards", "w")) == NULL) {
+    printf(RED("Could not create file program.cards\n"));
+    return;
+  }
+
+  writedeck(fp, mmm->mix.mem, programend+1);
+  fclose(fp);
 
   printf(GREEN("Saved program into program.cards.\n"));
 }
@@ -715,12 +1158,29 @@ void printhelp() {
     CYAN("COMMANDS:\n")
     "<empty>\t\trepeat previous command\n"
     "l\t\treload MIXAL, card and tape files\n"
+    "w\t\treload whenever the MIXAL file is saved (on/off)\n"
     "@<file>\t\tuse card file\n"
     "#<n><file>\tuse tape file\n"
+    "d<n> <file>\tuse disk file for unit n (8-15)\n"
+    "i<n> <file>\tread unit n (19-20) from file, or from a command if file is |<cmd>\n"
+    "o<n> <file>\twrite unit n (17-20) to file, or to a command if file is |<cmd>\n"
+    "G\t\tload the program on the card deck (GO button)\n"
+    "Gt\t\tthe same, adding the time of reading the cards\n"
+    "j<file>\t\trecord device transfers into journal file\n"
+    "J<file>\t\treplay device transfers from journal file\n"
+    "j\t\tstop using the journal\n"
+    "I\t\tturn the interrupt facility on/off\n"
+    "p\t\tcount only a few edges instead of every instruction (on/off)\n"
+    "u<n>\t\tview timings of unit n\n"
+    "u<n> <in> <out> <ioc> <seek>\n\t\tset timings of unit n\n"
     "s\t\trun one step\n"
     "b<line>\t\trun till specified line\n"
     "b.<sym>\t\trun till specified line\n"
-    "g\t\trun whole program\n"
+    "B<line> <n>\tset a breakpoint, going past it n times (n is optional)\n"
+    "B.<sym> <n>\tset a breakpoint at a symbol\n"
+    "B-<line>\tdelete a breakpoint (B- deletes all)\n"
+    "B\t\tlist breakpoints and how often they were reached\n"
+    "g\t\trun whole program, or till a breakpoint\n"
     "g<n>\t\ttrace first n executions of each line (n is a digit)\n"
     "g+\t\ttrace everything\n"
     "v\t\tview nonempty memory cells\n"
@@ -729,6 +1189,8 @@ void printhelp() {
     "v<from>-<to>\tview a range of cells\n"
     "r\t\tview registers and flags\n"
     "t\t\tprint timing statistics\n"
+    "c\t\tprint the control-flow graph, loops and time formulas\n"
+    "a\t\tsuggest rewrites that would have saved time in the run\n"
     "C\t\texport program into cards\n"
     "h\t\tprint this help\n"
     "q\t\tquit\n"
@@ -736,14 +1198,37 @@ void printhelp() {
 }
 
 void initmmmstate(mmmstate *mmm) {
-  // mmm->mix will be initialized in loadmixalfile()
+  // mmm->mix and mmm->ps will be reinitialized in loadmixalfile()
+  initmix(&mmm->mix);
+  initparsestate(&mmm->ps);
   mmm->globalcardfile[0] = '\0';
-  for (int i = 0; i < 8; i++)
+  for (int i = 0; i < 8; i++) {
     mmm->globaltapefiles[i][0] = '\0';
+    mmm->globaldiskfiles[i][0] = '\0';
+  }
+  for (int i = 0; i < 4; i++) {
+    mmm->globalstreamfiles[i][0][0] = '\0';
+    mmm->globalstreamfiles[i][1][0] = '\0';
+  }
+  mmm->globaljournal[0] = '\0';
+  mmm->globalreplaying = false;
+  mmm->globalinterrupts = false;
   mmm->prevline[0] = '\0';
+  mmm->source.buf = NULL;
+  mmm->source.len = 0;
+  mmm->source.mapped = false;
   for (int i = 0; i < 4000; i++)
-    mmm->debuglines[i][0] = '\0';
+    mmm->sourceinfo.srcoffsets[i] = -1;
+  mmm->objectfile[0] = '\0';
+  mmm->usecache = true;
+  mmm->numlinks = 0;
+  mmm->watchfd = -1;
   mmm->shouldtrace = true;
+  mmm->profile = NULL;
+  mmm->fromdeck = false;
+  memset(mmm->breakpoints, 0, sizeof(mmm->breakpoints));
+  memset(mmm->breakhits, 0, sizeof(mmm->breakhits));
+  memset(mmm->breakignores, 0, sizeof(mmm->breakignores));
 
   // Default IO operation times
   mmm->mix.INtimes[16] = 10000;
@@ -754,6 +1239,93 @@ void initmmmstate(mmmstate *mmm) {
   for (int i = 0; i < 8; i++) {
     mmm->mix.INtimes[i] = 30000;
     mmm->mix.OUTtimes[i] = 30000;
+    mmm->mix.IOCtimes[i] = 1000;
+    mmm->mix.seektimes[i] = 1000;
+  }
+  mmm->mix.OUTtimes[17] = 10000;
+  mmm->mix.INtimes[19] = 5000;
+  mmm->mix.OUTtimes[19] = 5000;
+  mmm->mix.INtimes[20] = 2000;
+  mmm->mix.OUTtimes[20] = 2000;
+  mmm->mix.IOCtimes[20] = 5000;
+  // Disks transfer faster than tapes, but still have to seek to the
+  // block.  These are also arbitrary.
+  for (int i = 8; i < 16; i++) {
+    mmm->mix.INtimes[i] = 1000;
+    mmm->mix.OUTtimes[i] = 1000;
+    mmm->mix.IOCtimes[i] = 100;
+    mmm->mix.seektimes[i] = 10;
+  }
+}
+
+// Reload the MIXAL file and the files attached to the units, as if mmm
+// had just been started.
+bool reloadall(char *filename, mmmstate *mmm) {
+  if (!loadmixalfile(filename, mmm))
+    return false;
+  loadcardfile(mmm->globalcardfile, mmm);
+  for (int i = 0; i < 8; i++) {
+    loadtapefile(mmm->globaltapefiles[i], i, mmm);
+    loaddiskfile(mmm->globaldiskfiles[i], i+8, mmm);
+  }
+  for (int i = 0; i < 4; i++) {
+    loadstreamfile(mmm->globalstreamfiles[i][0], i+17, false, mmm);
+    loadstreamfile(mmm->globalstreamfiles[i][1], i+17, true, mmm);
+  }
+  loadjournal(mmm->globaljournal, mmm->globalreplaying, mmm);
+  // The breakpoints stay, but the program starts again.
+  memset(mmm->breakhits, 0, sizeof(mmm->breakhits));
+  return true;
+}
+
+// Start watching the MIXAL file for changes.  The directory is watched
+// rather than the file, because editors often save by replacing the
+// file.
+bool startwatch(char *filename, mmmstate *mmm) {
+  char dir[strlen(filename)+1];
+  strcpy(dir, filename);
+  mmm->watchfd = inotify_init1(IN_CLOEXEC);
+  if (mmm->watchfd < 0 ||
+      inotify_add_watch(mmm->watchfd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    if (mmm->watchfd >= 0)
+      close(mmm->watchfd);
+    mmm->watchfd = -1;
+    return false;
+  }
+  return true;
+}
+
+void stopwatch(mmmstate *mmm) {
+  close(mmm->watchfd);
+  mmm->watchfd = -1;
+}
+
+// Wait until there is a command to read, reloading the MIXAL file
+// whenever it is saved.
+void waitforcommand(char *filename, mmmstate *mmm) {
+  char base[strlen(filename)+1];
+  strcpy(base, filename);
+  char *name = basename(base);
+  struct pollfd fds[2] = {{0, POLLIN, 0}, {mmm->watchfd, POLLIN, 0}};
+  while (poll(fds, 2, -1) >= 0 && !fds[0].revents) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(mmm->watchfd, buf, sizeof(buf));
+    bool changed = false;
+    for (char *p = buf; p < buf + len; ) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      if (event->len > 0 && !strcmp(event->name, name))
+	changed = true;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    if (!changed)
+      continue;
+    putchar('\n');
+    if (!reloadall(filename, mmm)) {
+      mmm->mix.done = true;
+      printf(RED("Fix the MIXAL file; it will be reloaded when saved\n"));
+    }
+    printf(">> ");
+    fflush(stdout);
   }
 }
 
@@ -761,7 +1333,25 @@ int main(int argc, char **argv) {
   mmmstate mmm;
   initmmmstate(&mmm);
 
-  // Handle arguments
+  // Handle arguments: options first, then the MIXAL (or object) file
+  // and the card file.
+  int argi = 1;
+  for (; argi < argc && !strncmp(argv[argi], "--", 2); argi++) {
+    if (!strcmp(argv[argi], "--save-object") && argi+1 < argc)
+      strncpy(mmm.objectfile, argv[++argi], LINELEN-1);
+    else if (!strcmp(argv[argi], "--no-cache"))
+      mmm.usecache = false;
+    else if (!strcmp(argv[argi], "--watch"))
+      mmm.watchfd = 0;  // Started once the file is loaded
+    else if (!strcmp(argv[argi], "--link") && argi+1 < argc && mmm.numlinks < 8)
+      strncpy(mmm.links[mmm.numlinks++], argv[++argi], LINELEN-1);
+    else {
+      printf(RED("Unknown option %s\n"), argv[argi]);
+      return 0;
+    }
+  }
+  argv += argi-1;
+  argc -= argi-1;
   if (argc < 2) {
     printf(RED("Please specify a filename!\n"));
     return 0;
@@ -770,6 +1360,8 @@ int main(int argc, char **argv) {
     return 0;
   if (argc >= 3 && loadcardfile(argv[2], &mmm))
     strncpy(mmm.globalcardfile, argv[2], LINELEN);
+  if (mmm.watchfd == 0 && !startwatch(argv[1], &mmm))
+    printf(RED("Could not watch %s for changes\n"), argv[1]);
 
   printf(CYAN("MIX Management Module, by wyan\n"));
   printf("Type h for help\n");
@@ -777,11 +1369,14 @@ int main(int argc, char **argv) {
   char line[LINELEN+1];
   while (true) {
     printf(">> ");
+    fflush(stdout);
+    if (mmm.watchfd >= 0)
+      waitforcommand(argv[1], &mmm);
     fgets(line, LINELEN, stdin);
     // Strip the last newline
     line[strnlen(line, LINELEN)-1] = '\0';
     if (feof(stdin))
-      return 0;
+      break;
 
     if (line[0] == '\0') {      // Previous command
       strncpy(line, mmm.prevline, LINELEN);
@@ -789,12 +1384,18 @@ int main(int argc, char **argv) {
     strncpy(mmm.prevline, line, LINELEN);
 
     if (line[0] == 'l') {       // Reload MIXAL, card and tape files
-      if (!loadmixalfile(argv[1], &mmm))
+      if (!reloadall(argv[1], &mmm))
 	return 0;
-      loadcardfile(mmm.globalcardfile, &mmm);
-      for (int i = 0; i < 8; i++)
-	if (mmm.globaltapefiles[i] != '\0')
-	  loadtapefile(mmm.globaltapefiles[i], i, &mmm);
+    }
+    else if (line[0] == 'w') {  // Watch the MIXAL file
+      if (mmm.watchfd >= 0) {
+	stopwatch(&mmm);
+	printf(GREEN("Stopped watching %s\n"), argv[1]);
+      }
+      else if (startwatch(argv[1], &mmm))
+	printf(GREEN("Reloading %s whenever it is saved\n"), argv[1]);
+      else
+	printf(RED("Could not watch %s for changes\n"), argv[1]);
     }
     else if (line[0] == '@') {  // Load new card file
       if (loadcardfile(line+1, &mmm))
@@ -809,16 +1410,111 @@ int main(int argc, char **argv) {
 	  strncpy(mmm.globaltapefiles[n], line+2, LINELEN);
       }
     }
+    else if (line[0] == 'd') {  // Load new disk file
+      char *filename;
+      int n = strtol(line+1, &filename, 10);
+      if (filename == line+1) {
+	printf(RED("You have to provide a disk number!\n"));
+	continue;
+      }
+      while (isspace(*filename))
+	filename++;
+      // loaddiskfile() doesn't check n when there is no file.
+      if (!ISDISK(n))
+	printf(RED("Invalid disk number %d\n"), n);
+      else if (loaddiskfile(filename, n, &mmm))
+	strncpy(mmm.globaldiskfiles[n-8], filename, LINELEN);
+    }
+    else if (line[0] == 'i' || line[0] == 'o') {  // Attach input/output stream
+      bool output = line[0] == 'o';
+      char *filename;
+      int n = strtol(line+1, &filename, 10);
+      if (filename == line+1) {
+	printf(RED("You have to provide a unit number!\n"));
+	continue;
+      }
+      while (isspace(*filename))
+	filename++;
+      // loadstreamfile() doesn't check n when there is no file.
+      if (!ISSTREAM(n))
+	printf(RED("Unit %d can't be used for streaming %s\n"), n, output ? "output" : "input");
+      else if (loadstreamfile(filename, n, output, &mmm))
+	strncpy(mmm.globalstreamfiles[n-17][output], filename, LINELEN);
+    }
+    else if (line[0] == 'j' || line[0] == 'J') {  // Record/replay journal
+      bool replay = line[0] == 'J';
+      char *filename = line+1;
+      while (isspace(*filename))
+	filename++;
+      if (filename[0] == '\0') {
+	syncio(&mmm.mix);
+	closejournal(&mmm.mix);
+	mmm.globaljournal[0] = '\0';
+	printf(GREEN("Stopped using the journal\n"));
+      }
+      else if (loadjournal(filename, replay, &mmm)) {
+	strncpy(mmm.globaljournal, filename, LINELEN);
+	mmm.globalreplaying = replay;
+      }
+    }
+    else if (line[0] == 'G') {  // GO button
+      // The machine starts afresh, keeping its devices.
+      syncio(&mmm.mix);
+      resetmix(&mmm.mix);
+      if (loaddeck(&mmm.mix, line[1] == 't')) {
+	memcpy(mmm.image, mmm.mix.mem, sizeof(mmm.image));
+	memcpy(mmm.controlimage, mmm.mix.controlmem, sizeof(mmm.controlimage));
+	mmm.start = mmm.mix.PC;
+	mmm.fromdeck = true;
+	printf(GREEN("Loaded the program on the card deck, starting at %d\n"), mmm.mix.PC);
+	if (mmm.profile != NULL)
+	  startprofile(mmm.profile, &mmm.mix, &mmm.ps);
+      }
+      else {
+	printf(RED("Could not load the card deck: %s\n"), mmm.mix.err);
+	mmm.mix.err = "";
+      }
+    }
+    else if (line[0] == 'I') {  // Toggle interrupt facility
+      mmm.globalinterrupts = !mmm.globalinterrupts;
+      mmm.mix.interrupts = mmm.globalinterrupts;
+      printf(GREEN("Interrupts are %s\n"), mmm.globalinterrupts ? "on" : "off");
+    }
+    else if (line[0] == 'p') {  // Toggle edge profiling
+      if (mmm.profile != NULL) {
+	stopprofile(mmm.profile, &mmm.mix);
+	free(mmm.profile);
+	mmm.profile = NULL;
+	printf(GREEN("Counting every instruction\n"));
+      }
+      else {
+	mmm.profile = malloc(sizeof(edgeprofile));
+	startprofile(mmm.profile, &mmm.mix, &mmm.ps);
+	int counted = 0;
+	for (int e = 0; e < mmm.profile->g.numedges; e++)
+	  counted += !mmm.profile->intree[e];
+	printf(GREEN("Counting %d of the %d edges between the %d blocks\n"), counted,
+	       mmm.profile->g.numedges, mmm.profile->g.numblocks);
+      }
+    }
+    else if (line[0] == 'u')    // View/set unit timings
+      unitcommand(line+1, &mmm);
     else if (line[0] == 's') {  // Run one step
       if (mmm.mix.done) {
 	printf(GREEN("Program has finished running; type l to reset\n"));
 	continue;
       }
       onestepwrapper(0, &mmm);
+      // Show whatever was printed, rather than waiting for the halt.
+      flushprinter(&mmm.mix);
       displayinstr_debug(mmm.mix.PC, &mmm);
     }
-    else if (line[0] == 'b')    // Run till breakpoint
+    else if (line[0] == 'b') {  // Run till breakpoint
       breakpointcommand(line+1, &mmm);
+      flushprinter(&mmm.mix);
+    }
+    else if (line[0] == 'B')    // Set/delete/list breakpoints
+      breakpointscommand(line+1, &mmm);
     else if (line[0] == 'g') {  // Run whole program
       gocommand(line+1, &mmm);
     }
@@ -828,13 +1524,21 @@ int main(int argc, char **argv) {
       printregisters(&mmm);
     else if (line[0] == 't')    // View timing statistics
       printtime(&mmm);
+    else if (line[0] == 'c')    // View control-flow graph
+      printcfg(&mmm);
+    else if (line[0] == 'a')    // Suggest rewrites
+      printadvice(&mmm);
     else if (line[0] == 'C')    // Export program into cards
       exportcards(&mmm);
     else if (line[0] == 'h')    // Help
       printhelp();
     else if (line[0] == 'q')    // Quit
-      return 0;
+      break;
     else
       printf(BLUE("Hold up, I don't understand that command\n"));
   }
+
+  syncio(&mmm.mix);
+  closedevices(&mmm.mix);
+  return 0;
 }
\ No newline at end of file
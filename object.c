@@ -0,0 +1,389 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include "object.h"
+
+#define IMAGESIZE (2*4000*sizeof(word) + 4000*sizeof(int32_t))
+
+bool saveobject(char *filename, uint64_t hash, mix *mix, parsestate *ps, sourceinfo *info) {
+  char tmpname[strlen(filename) + 8];
+  sprintf(tmpname, "%s.XXXXXX", filename);
+  int fd = mkstemp(tmpname);
+  if (fd < 0)
+    return false;
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == NULL) {
+    close(fd);
+    remove(tmpname);
+    return false;
+  }
+
+  objheader header;
+  memcpy(header.magic, OBJMAGIC, sizeof(header.magic));
+  header.sourcehash = hash;
+  header.start = mix->PC;
+  header.numsyms = 0;
+  for (int i = 0; i < ps->numsyms; i++)
+    if (ps->syms[i].defined)
+      header.numsyms++;
+  int32_t srcoffsets[4000];
+  for (int i = 0; i < 4000; i++)
+    srcoffsets[i] = info->srcoffsets[i];
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(mix->mem, sizeof(word), 4000, fp) == 4000 &&
+    fwrite(mix->controlmem, sizeof(word), 4000, fp) == 4000 &&
+    fwrite(srcoffsets, sizeof(int32_t), 4000, fp) == 4000;
+  for (int i = 0; ok && i < ps->numsyms; i++) {
+    if (!ps->syms[i].defined)
+      continue;
+    objsymbol sym;
+    memset(sym.name, 0, sizeof(sym.name));
+    strcpy(sym.name, ps->syms[i].name);
+    sym.val = ps->syms[i].val;
+    ok = fwrite(&sym, sizeof(sym), 1, fp) == 1;
+  }
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok || rename(tmpname, filename) != 0) {
+    remove(tmpname);
+    return false;
+  }
+  return true;
+}
+
+bool loadobject(char *filename, uint64_t hash, mix *mix, parsestate *ps, sourceinfo *info) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  struct stat st;
+  if (fstat(fileno(fp), &st) < 0 || st.st_size < sizeof(objheader) + IMAGESIZE) {
+    fclose(fp);
+    return false;
+  }
+  char *buf = malloc(st.st_size);
+  bool ok = fread(buf, 1, st.st_size, fp) == st.st_size;
+  fclose(fp);
+
+  objheader *header = (objheader *)buf;
+  ok = ok && memcmp(header->magic, OBJMAGIC, sizeof(header->magic)) == 0 &&
+    (hash == 0 || header->sourcehash == hash) &&
+    st.st_size == sizeof(objheader) + IMAGESIZE + (size_t)header->numsyms * sizeof(objsymbol);
+  if (!ok) {
+    free(buf);
+    return false;
+  }
+
+  word *image = (word *)(header + 1);
+  memcpy(mix->mem, image, 4000*sizeof(word));
+  memcpy(mix->controlmem, image + 4000, 4000*sizeof(word));
+  int32_t *srcoffsets = (int32_t *)(image + 8000);
+  for (int i = 0; i < 4000; i++)
+    info->srcoffsets[i] = srcoffsets[i];
+  info->errline = 0;
+  objsymbol *syms = (objsymbol *)(srcoffsets + 4000);
+  for (int i = 0; i < header->numsyms; i++) {
+    syms[i].name[sizeof(syms[i].name)-1] = '\0';
+    addsym(syms[i].name, syms[i].val, ps);
+  }
+  mix->PC = header->start;
+  free(buf);
+  return true;
+}
+
+bool objectcachepath(uint64_t hash, char *ext, char *path, size_t size) {
+  char dir[size];
+  char *cache = getenv("MMM_CACHE");
+  if (cache != NULL)
+    snprintf(dir, size, "%s", cache);
+  else {
+    char *home = getenv("HOME");
+    if (home == NULL)
+      return false;
+    snprintf(dir, size, "%s/.cache", home);
+    mkdir(dir, 0755);
+    snprintf(dir, size, "%s/.cache/mmm", home);
+  }
+  mkdir(dir, 0755);
+  struct stat st;
+  if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+    return false;
+  return snprintf(path, size, "%s/%016llx.%s", dir, (unsigned long long)hash, ext) < size;
+}
+
+// The size of everything in a module after the header, which is kept
+// in one block, as in the file.
+static size_t modulesize(module *m, bool control) {
+  int n = m->hi - m->lo;
+  return n * (sizeof(word) + 2*sizeof(int32_t)) + (control ? 4000*sizeof(word) : 0) +
+    m->numsyms * sizeof(modsymbol);
+}
+
+static void allocmodule(module *m, bool control) {
+  int n = m->hi - m->lo;
+  m->cells = malloc(modulesize(m, control) + 1);
+  m->relocs = (int32_t *)(m->cells + n);
+  m->srcoffsets = m->relocs + n;
+  m->controlmem = control ? (word *)(m->srcoffsets + n) : NULL;
+  m->syms = (modsymbol *)(control ? m->controlmem + 4000 : (word *)(m->srcoffsets + n));
+}
+
+void freemodule(module *m) {
+  free(m->cells);
+  m->cells = NULL;
+}
+
+char *makemodule(mix *mix, parsestate *ps, sourceinfo *info, uint64_t hash, module *m) {
+  static char err[64];
+  if (ps->numlines == 0 || ps->lines[ps->numlines-1].kind != LINE_END)
+    return "the program was not assembled from its source";
+
+  // The cells filled by each line, and by END for the literals and
+  // undefined symbols.
+  int lo = 4000, hi = 0;
+  bool control = false;
+  for (int i = 0; i < ps->numlines; i++) {
+    lineinfo *li = &ps->lines[i];
+    int end = li->kind == LINE_CELL ? li->star+1 : li->kind == LINE_END ? ps->star : li->star;
+    if (end == li->star)
+      continue;
+    if (li->star < 0)
+      control = true;
+    else {
+      lo = li->star < lo ? li->star : lo;
+      hi = end > hi ? end : hi;
+    }
+  }
+  if (lo >= hi)
+    lo = hi = 0;
+
+  // Keep the defined and imported symbols, numbering them for the
+  // relocations.
+  int *index = malloc((ps->numsyms+1) * sizeof(int));
+  int numsyms = 0;
+  for (int i = 0; i < ps->numsyms; i++) {
+    symbol *s = &ps->syms[i];
+    index[i] = -1;
+    if (s->exported && (!s->defined || s->external || s->reloc == RELOC_BAD)) {
+      snprintf(err, sizeof(err), "exported symbol %s is not defined by the module", s->name);
+      free(index);
+      return err;
+    }
+    if (s->defined)
+      index[i] = numsyms++;
+  }
+
+  m->sourcehash = hash;
+  m->start = mix->PC;
+  m->lo = lo;
+  m->hi = hi;
+  m->numsyms = numsyms;
+  allocmodule(m, control);
+  for (int i = lo; i < hi; i++) {
+    int reloc = ps->relocs[i];
+    m->cells[i-lo] = mix->mem[i];
+    m->relocs[i-lo] = reloc >= RELOC_EXT ? RELOC_EXT + index[reloc-RELOC_EXT] : reloc;
+    m->srcoffsets[i-lo] = info->srcoffsets[i];
+  }
+  if (control)
+    memcpy(m->controlmem, mix->controlmem, 4000*sizeof(word));
+  for (int i = 0; i < ps->numsyms; i++) {
+    symbol *s = &ps->syms[i];
+    if (index[i] < 0)
+      continue;
+    modsymbol *sym = &m->syms[index[i]];
+    memset(sym->name, 0, sizeof(sym->name));
+    strcpy(sym->name, s->name);
+    sym->val = s->val;
+    sym->flags = (s->reloc == RELOC_REL ? MODSYM_REL : 0) |
+      (s->exported ? MODSYM_EXPORT : 0) | (s->external ? MODSYM_EXTERN : 0);
+  }
+  free(index);
+  return "";
+}
+
+bool savemodule(char *filename, module *m) {
+  char tmpname[strlen(filename) + 8];
+  sprintf(tmpname, "%s.XXXXXX", filename);
+  int fd = mkstemp(tmpname);
+  if (fd < 0)
+    return false;
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == NULL) {
+    close(fd);
+    remove(tmpname);
+    return false;
+  }
+
+  modheader header;
+  memcpy(header.magic, MODMAGIC, sizeof(header.magic));
+  header.sourcehash = m->sourcehash;
+  header.start = m->start;
+  header.lo = m->lo;
+  header.hi = m->hi;
+  header.numsyms = m->numsyms;
+  header.control = m->controlmem != NULL;
+  size_t size = modulesize(m, header.control);
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(m->cells, 1, size, fp) == size;
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok || rename(tmpname, filename) != 0) {
+    remove(tmpname);
+    return false;
+  }
+  return true;
+}
+
+bool loadmodule(char *filename, uint64_t hash, module *m) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  struct stat st;
+  modheader header;
+  module tmp;
+  bool ok = fstat(fileno(fp), &st) == 0 && fread(&header, sizeof(header), 1, fp) == 1 &&
+    memcmp(header.magic, MODMAGIC, sizeof(header.magic)) == 0 &&
+    (hash == 0 || header.sourcehash == hash) &&
+    0 <= header.lo && header.lo <= header.hi && header.hi <= 4000;
+  if (ok) {
+    tmp.lo = header.lo;
+    tmp.hi = header.hi;
+    tmp.numsyms = header.numsyms;
+    ok = st.st_size == sizeof(header) + modulesize(&tmp, header.control);
+  }
+  if (!ok) {
+    fclose(fp);
+    return false;
+  }
+
+  tmp.sourcehash = header.sourcehash;
+  tmp.start = header.start;
+  allocmodule(&tmp, header.control);
+  ok = fread(tmp.cells, 1, modulesize(&tmp, header.control), fp) == modulesize(&tmp, header.control);
+  fclose(fp);
+  for (int i = 0; ok && i < tmp.hi - tmp.lo; i++)
+    ok = tmp.relocs[i] >= 0 && tmp.relocs[i] < RELOC_EXT + tmp.numsyms;
+  for (int i = 0; ok && i < tmp.numsyms; i++)
+    tmp.syms[i].name[sizeof(tmp.syms[i].name)-1] = '\0';
+  if (!ok) {
+    freemodule(&tmp);
+    return false;
+  }
+  *m = tmp;
+  return true;
+}
+
+// Add delta to the A-field of the instruction.
+static bool relocate(word *instr, int delta) {
+  int A = getA(*instr);
+  int addr = ((A >> 12) & 1 ? A & ONES(12) : -(A & ONES(12))) + delta;
+  if (addr <= -4096 || addr >= 4096)
+    return false;
+  *instr = INSTR(ADDR(addr), getI(*instr), getF(*instr), getC(*instr));
+  return true;
+}
+
+char *linkmodules(module *mods, int n, mix *mix, parsestate *ps, sourceinfo *info) {
+  static char err[64];
+  char *msg = "";
+  int *base = malloc(n * sizeof(int));
+  bool used[4000] = {false};
+  // The exported symbols, with the addresses they are linked at.
+  parsestate exports;
+  initparsestate(&exports);
+
+  for (int k = 0; k < n; k++) {
+    module *m = &mods[k];
+    int size = m->hi - m->lo;
+    if (k == 0)
+      base[k] = 0;
+    else {
+      if (m->controlmem != NULL) {
+	msg = "only the first module can use control memory";
+	goto done;
+      }
+      int p = size == 0 ? 0 : -1;
+      for (int i = 0, run = 0; p < 0 && i < 4000; i++) {
+	run = used[i] ? 0 : run+1;
+	if (run == size)
+	  p = i-size+1;
+      }
+      if (p < 0) {
+	snprintf(err, sizeof(err), "no room in memory for module %d", k+1);
+	msg = err;
+	goto done;
+      }
+      base[k] = p - m->lo;
+    }
+    for (int i = m->lo; i < m->hi; i++)
+      used[i + base[k]] = true;
+
+    for (int i = 0; i < m->numsyms; i++) {
+      modsymbol *sym = &m->syms[i];
+      word val;
+      if (!(sym->flags & MODSYM_EXPORT))
+	continue;
+      if (lookupsym(sym->name, &val, &exports)) {
+	snprintf(err, sizeof(err), "%s is exported by two modules", sym->name);
+	msg = err;
+	goto done;
+      }
+      addsym(sym->name, sym->flags & MODSYM_REL ? FROMINT(INT(sym->val) + base[k]) : sym->val, &exports);
+    }
+  }
+
+  for (int k = 0; k < n; k++) {
+    module *m = &mods[k];
+    for (int i = 0; i < m->hi - m->lo; i++) {
+      word w = m->cells[i];
+      int reloc = m->relocs[i], delta = 0;
+      if (reloc == RELOC_REL)
+	delta = base[k];
+      else if (reloc == RELOC_BAD && base[k] != 0) {
+	snprintf(err, sizeof(err), "the address at %d of module %d can't be relocated", m->lo + i, k+1);
+	msg = err;
+	goto done;
+      }
+      else if (reloc >= RELOC_EXT) {
+	word val;
+	if (!lookupsym(m->syms[reloc-RELOC_EXT].name, &val, &exports)) {
+	  snprintf(err, sizeof(err), "%s is not exported by any module", m->syms[reloc-RELOC_EXT].name);
+	  msg = err;
+	  goto done;
+	}
+	delta = INT(val);
+      }
+      if (delta != 0 && !relocate(&w, delta)) {
+	snprintf(err, sizeof(err), "the address at %d of module %d is out of range", m->lo + i, k+1);
+	msg = err;
+	goto done;
+      }
+      mix->mem[m->lo + i + base[k]] = w;
+    }
+  }
+
+  // Only the first module's source is at hand, to show.
+  for (int i = 0; i < 4000; i++)
+    info->srcoffsets[i] = -1;
+  info->errline = 0;
+  for (int i = mods[0].lo; i < mods[0].hi; i++)
+    info->srcoffsets[i] = mods[0].srcoffsets[i - mods[0].lo];
+  if (mods[0].controlmem != NULL)
+    memcpy(mix->controlmem, mods[0].controlmem, 4000*sizeof(word));
+  mix->PC = mods[0].start;
+  for (int i = 0; i < mods[0].numsyms; i++)
+    if (!(mods[0].syms[i].flags & MODSYM_EXTERN))
+      addsym(mods[0].syms[i].name, mods[0].syms[i].val, ps);
+  for (int k = 0; k < n; k++) {
+    for (int i = 0; i < mods[k].numsyms; i++) {
+      word val;
+      if ((mods[k].syms[i].flags & MODSYM_EXPORT) && lookupsym(mods[k].syms[i].name, &val, &exports))
+	addsym(mods[k].syms[i].name, val, ps);
+    }
+  }
+
+done:
+  free(base);
+  freeparsestate(&exports);
+  return msg;
+}
@@ -0,0 +1,113 @@
+#ifndef _OBJECT_H
+#define _OBJECT_H
+#include "emulator.h"
+#include "assembler.h"
+
+// Assembled object format, so that a program can be loaded without
+// assembling it again.  The file starts with the header below,
+// followed by
+// - the memory image: mem[4000] and then controlmem[4000],
+// - the address-to-source map: the srcoffsets of sourceinfo, as 4000
+//   32-bit integers,
+// - numsyms objsymbols, for the symbols that were defined.
+// Everything is stored in host byte order, as in the binary card/tape
+// format.
+//
+// OBJMAGIC has to change whenever the format or the assembler's output
+// changes, so that stale cached objects are not used.
+#define OBJMAGIC "MIXOBJ02"
+typedef struct {
+  char magic[8];
+  uint64_t sourcehash;  // hashsource() of the MIXAL source
+  int32_t start;        // The address given to END
+  uint32_t numsyms;
+} objheader;
+
+typedef struct {
+  char name[12];
+  word val;
+} objsymbol;
+
+// Write the assembled program in mix, ps and info to filename.  The
+// file is written under a temporary name and renamed into place, so
+// other processes never see half of it.
+bool saveobject(char *filename, uint64_t hash, mix *mix, parsestate *ps, sourceinfo *info);
+
+// Load the program in filename into mix (setting the PC to the start
+// address), ps and info, with a single read.  If hash is nonzero, the
+// object must have been assembled from a source with that hash.
+// Return false, leaving mix, ps and info untouched, if the file could
+// not be read or does not match.
+bool loadobject(char *filename, uint64_t hash, mix *mix, parsestate *ps, sourceinfo *info);
+
+// The file in the object cache for a source with the given hash:
+// $MMM_CACHE/<hash>.<ext>, or ~/.cache/mmm/<hash>.<ext>.  The
+// directory is created if needed.  Return false if there is nowhere to
+// put it.
+bool objectcachepath(uint64_t hash, char *ext, char *path, size_t size);
+
+// Relocatable modules, for programs split over several MIXAL files
+// that are assembled separately and then linked.  A module can use
+// symbols of other modules by importing them, and make its own symbols
+// available by exporting them:
+//   SORT   EXT
+//          ENT  MAIN
+// Every location of a module is moved by the same distance when it is
+// linked, so each cell records how its A-field changes (RELOC_ABS
+// etc. in assembler.h).  An imported symbol is 0 until linking, and
+// the address of the symbol is then added to the A-fields using it.
+// Addresses in other fields, e.g. in a CON, are not relocated.
+//
+// A module file starts with the header below, followed by
+// - the cells lo to hi-1 of mem,
+// - the relocation of each of these cells, as 32-bit integers, with
+//   RELOC_EXT+i referring to the ith symbol of the module,
+// - the srcoffsets of each of these cells, as 32-bit integers,
+// - controlmem[4000], if the module uses control memory,
+// - numsyms modsymbols: the defined symbols, and the imported ones.
+#define MODMAGIC "MIXMOD02"
+typedef struct {
+  char magic[8];
+  uint64_t sourcehash;
+  int32_t start;
+  int32_t lo, hi;
+  uint32_t numsyms;
+  uint32_t control;     // Whether controlmem is included
+} modheader;
+
+#define MODSYM_REL    1  // The value is a location in the module
+#define MODSYM_EXPORT 2
+#define MODSYM_EXTERN 4  // Imported, and defined by another module
+typedef struct {
+  char name[12];
+  word val;
+  uint32_t flags;
+} modsymbol;
+
+typedef struct {
+  uint64_t sourcehash;
+  int start, lo, hi;
+  word *cells;          // hi-lo of each of these
+  int32_t *relocs;
+  int32_t *srcoffsets;
+  word *controlmem;     // NULL if the module doesn't use control memory
+  int numsyms;
+  modsymbol *syms;
+} module;
+
+// Make a module out of the program assembled into mix, ps and info.
+// Return an error message, or "" if there is none.
+char *makemodule(mix *mix, parsestate *ps, sourceinfo *info, uint64_t hash, module *m);
+void freemodule(module *m);
+// As saveobject() and loadobject(), for modules.
+bool savemodule(char *filename, module *m);
+bool loadmodule(char *filename, uint64_t hash, module *m);
+
+// Link the modules into mix, placing the first one where it was
+// assembled and each of the others into the first gap of memory it
+// fits in.  The program starts where the first module's END says, and
+// ps and info get the symbols and source map of the first module, and
+// the symbols exported by the others.  Return an error message, or ""
+// if there is none.
+char *linkmodules(module *mods, int n, mix *mix, parsestate *ps, sourceinfo *info);
+#endif
@@ -0,0 +1,244 @@
+#include "profile.h"
+
+static int findroot(int *parent, int x) {
+  while (parent[x] != x)
+    x = parent[x] = parent[parent[x]];
+  return x;
+}
+
+// Where the edge from block b to block t is looked for in edgeindex,
+// by Fibonacci hashing and then linear probing.
+static int edgeslot(int b, int t) {
+  return ((uint32_t)(b*4000 + t) * 2654435769u) >> (32-15);
+}
+
+// The first edge from block b to block t, or -1 if there is none.
+static int findedge(edgeprofile *p, int b, int t) {
+  for (int i = edgeslot(b, t); p->edgeindex[i] != 0; i = (i+1) & (EDGEHASH-1)) {
+    edge *ed = &p->g.edges[p->edgeindex[i]-1];
+    if (ed->from == b && ed->to == t)
+      return p->edgeindex[i]-1;
+  }
+  return -1;
+}
+
+// What mix calls when control doesn't go where the probe points of
+// the cell say (see emulator.h).
+static void probe(mix *mix, int from, int to, int time) {
+  edgeprofile *p = mix->probedata;
+  cfg *g = &p->g;
+  if (from == PROBE_INTERRUPT) {
+    // Control came to to, but leaves it without executing it.
+    if (0 <= to && to < 4000 && g->blockof[to] >= 0)
+      p->entries[to]--;
+    return;
+  }
+  int b = 0 <= from && from < 4000 ? g->blockof[from] : -1;
+  if (b >= 0)
+    p->extratimes[from] += time - p->celltimes[from];
+  else if (0 <= from && from < 4000) {
+    mix->execcounts[from]++;
+    mix->exectimes[from] += time;
+  }
+  if (mix->done || to < 0 || to >= 4000) {
+    if (b >= 0)
+      p->exits[from]++;
+    return;
+  }
+
+  int t = g->blockof[to];
+  if (b >= 0 && from != g->blocks[b].last && to == from+1)
+    return;
+  if (b >= 0 && t >= 0 && from == g->blocks[b].last && to == g->blocks[t].first) {
+    int e = findedge(p, b, t);
+    if (e >= 0) {
+      if (!p->intree[e])
+	p->edgecounts[e]++;
+      return;
+    }
+  }
+  if (b >= 0)
+    p->exits[from]++;
+  if (t >= 0)
+    p->entries[to]++;
+}
+
+void startprofile(edgeprofile *p, mix *mix, parsestate *ps) {
+  if (mix->probes != NULL)
+    profilecounts(p, mix);
+  cfg *g = &p->g;
+  buildcfg(mix->mem, mix->PC, mix->execcounts, ps, g);
+  memcpy(p->basecounts, mix->execcounts, sizeof(p->basecounts));
+  memcpy(p->basetimes, mix->exectimes, sizeof(p->basetimes));
+  memset(p->edgecounts, 0, sizeof(p->edgecounts));
+  memset(p->entries, 0, sizeof(p->entries));
+  memset(p->exits, 0, sizeof(p->exits));
+  memset(p->extratimes, 0, sizeof(p->extratimes));
+  for (int c = 0; c < 4000; c++)
+    p->celltimes[c] = fixedtime(mix->mem[c]);
+
+  // The spanning tree, made by adding edges that don't close a cycle,
+  // the edges in the deepest loops first, since counting them would
+  // cost the most (Kruskal's algorithm).
+  static int parent[4000];
+  int maxdepth = 0;
+  for (int b = 0; b < g->numblocks; b++) {
+    parent[b] = b;
+    maxdepth = max(maxdepth, g->blocks[b].depth);
+  }
+  for (int e = 0; e < g->numedges; e++)
+    p->intree[e] = false;
+  for (int depth = maxdepth; depth >= 0; depth--) {
+    for (int e = 0; e < g->numedges; e++) {
+      edge *ed = &g->edges[e];
+      if (p->intree[e] || max(g->blocks[ed->from].depth, g->blocks[ed->to].depth) != depth)
+	continue;
+      int x = findroot(parent, ed->from), y = findroot(parent, ed->to);
+      if (x != y) {
+	parent[x] = y;
+	p->intree[e] = true;
+      }
+    }
+  }
+
+  // Within a block, control is expected to go on to the next cell, and
+  // from the last cell of a block, along its first two edges, counting
+  // those outside the tree.  The cells outside the graph, which are
+  // counted directly, and IN/OUT/IOC, whose time varies, always call
+  // probe().
+  memset(p->edgeindex, 0, sizeof(p->edgeindex));
+  for (int c = 0; c < 4000; c++)
+    p->probes[c] = (probepoint){ { PROBE_NOWHERE, PROBE_NOWHERE }, { NULL, NULL } };
+  for (int b = 0; b < g->numblocks; b++) {
+    block *bl = &g->blocks[b];
+    for (int c = bl->first; c < bl->last; c++)
+      p->probes[c].to[0] = c+1;
+    for (int i = 0; i < bl->numedges; i++) {
+      int e = bl->firstedge + i;
+      int t = g->edges[e].to;
+      if (i < 2) {
+	p->probes[bl->last].to[i] = g->blocks[t].first;
+	p->probes[bl->last].count[i] = p->intree[e] ? NULL : &p->edgecounts[e];
+      }
+      if (findedge(p, b, t) < 0) {
+	int slot = edgeslot(b, t);
+	while (p->edgeindex[slot] != 0)
+	  slot = (slot+1) & (EDGEHASH-1);
+	p->edgeindex[slot] = e+1;
+      }
+    }
+  }
+  for (int c = 0; c < 4000; c++) {
+    byte C = getC(mix->mem[c]);
+    if (35 <= C && C <= 37)
+      p->probes[c].to[0] = p->probes[c].to[1] = PROBE_NOWHERE;
+  }
+
+  // Control is now at the start.
+  if (!mix->done && 0 <= mix->PC && mix->PC < 4000 && g->blockof[mix->PC] >= 0)
+    p->entries[mix->PC]++;
+  mix->probes = p->probes;
+  mix->probe = probe;
+  mix->probedata = p;
+}
+
+void profilecounts(edgeprofile *p, mix *mix) {
+  cfg *g = &p->g;
+  // Control has come to the cell at the PC, but not executed it yet.
+  int pending = -1;
+  if (!mix->done && 0 <= mix->PC && mix->PC < 4000 && g->blockof[mix->PC] >= 0) {
+    pending = mix->PC;
+    p->entries[pending]--;
+  }
+
+  // The flow into each block minus the flow out of it, as far as it
+  // is known, and the tree edges at each block
+  static long net[4000], flows[3*4000];
+  static int degree[4000], firsttree[4001], tree[2*3*4000], leaves[4000];
+  for (int b = 0; b < g->numblocks; b++) {
+    net[b] = 0;
+    degree[b] = 0;
+    for (int c = g->blocks[b].first; c <= g->blocks[b].last; c++)
+      net[b] += p->entries[c] - p->exits[c];
+  }
+  for (int e = 0; e < g->numedges; e++) {
+    edge *ed = &g->edges[e];
+    flows[e] = p->intree[e] ? 0 : p->edgecounts[e];
+    if (p->intree[e]) {
+      degree[ed->from]++;
+      degree[ed->to]++;
+    }
+    else {
+      net[ed->to] += flows[e];
+      net[ed->from] -= flows[e];
+    }
+  }
+  firsttree[0] = 0;
+  for (int b = 0; b < g->numblocks; b++)
+    firsttree[b+1] = firsttree[b] + degree[b];
+  int fill[4000];
+  memcpy(fill, firsttree, g->numblocks*sizeof(int));
+  for (int e = 0; e < g->numedges; e++) {
+    if (p->intree[e]) {
+      tree[fill[g->edges[e].from]++] = e;
+      tree[fill[g->edges[e].to]++] = e;
+    }
+  }
+
+  // Each leaf of the tree has only one edge whose flow isn't known,
+  // which has to make up the difference; removing the leaf then leaves
+  // a smaller tree.
+  static bool done[3*4000];
+  memset(done, 0, g->numedges*sizeof(bool));
+  int numleaves = 0;
+  for (int b = 0; b < g->numblocks; b++)
+    if (degree[b] == 1)
+      leaves[numleaves++] = b;
+  while (numleaves > 0) {
+    int v = leaves[--numleaves];
+    if (degree[v] != 1)
+      continue;
+    int e = -1;
+    for (int i = firsttree[v]; i < firsttree[v+1]; i++)
+      if (!done[tree[i]])
+	e = tree[i];
+    edge *ed = &g->edges[e];
+    done[e] = true;
+    int u = ed->to == v ? ed->from : ed->to;
+    flows[e] = ed->to == v ? -net[v] : net[v];
+    net[v] = 0;
+    if (ed->to == v)
+      net[u] -= flows[e];
+    else
+      net[u] += flows[e];
+    degree[v]--;
+    if (--degree[u] == 1)
+      leaves[numleaves++] = u;
+  }
+
+  // The count of a cell is the flow into its block, plus what came to
+  // the cells up to it, minus what left before it.
+  static long inflow[4000];
+  memset(inflow, 0, g->numblocks*sizeof(long));
+  for (int e = 0; e < g->numedges; e++)
+    inflow[g->edges[e].to] += flows[e];
+  for (int b = 0; b < g->numblocks; b++) {
+    long count = inflow[b];
+    for (int c = g->blocks[b].first; c <= g->blocks[b].last; c++) {
+      count += p->entries[c];
+      mix->execcounts[c] = p->basecounts[c] + count;
+      mix->exectimes[c] = p->basetimes[c] + count*p->celltimes[c] + p->extratimes[c];
+      count -= p->exits[c];
+    }
+  }
+
+  if (pending >= 0)
+    p->entries[pending]++;
+}
+
+void stopprofile(edgeprofile *p, mix *mix) {
+  profilecounts(p, mix);
+  mix->probes = NULL;
+  mix->probe = NULL;
+  mix->probedata = NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+#include "cfg.h"
+
+// Exact execution counts without counting every instruction, by
+// Kirchhoff's law (TAOCP 1.3.3 and 2.3.4.1): control flows into each
+// block of the control-flow graph as often as it flows out, so if the
+// edges outside a spanning tree of the graph are counted, the counts
+// of the tree edges, and hence of the blocks, follow.  After each step,
+// the emulator only checks whether control went where the graph says
+// it goes from the cell (see probepoint): to the next cell in a block,
+// or along one of the edges leaving the last cell of a block, whose
+// counter it then adds 1 to if the edge is outside the tree.  Only
+// steps that go anywhere else call the profiler.
+//
+// Control can also get around the graph, through jumps to indexed or
+// changed addresses, interrupts, or code that wasn't there when the
+// graph was built.  This is counted too, as control leaving one cell
+// and entering another, and the cells outside the graph are counted as
+// usual, so the counts stay exact.  The profiler is also called after
+// IN/OUT/IOC, whose time varies, and after blocks with more than two
+// edges out (the exits of subroutines called from several places); it
+// finds the edge taken in a hash table.  The time of a cell is worked out
+// from its instruction when profiling started, so it is only wrong if
+// the program changes the operation code or field of an instruction.
+#define EDGEHASH (1 << 15)  // A power of two, well over the number of edges
+
+typedef struct {
+  cfg g;
+  probepoint probes[4000];
+  int edgeindex[EDGEHASH];  // 1 + the edge from block b to t, at edgeslot(b, t)
+  bool intree[3*4000];      // Whether each edge of g is in the spanning tree
+  int edgecounts[3*4000];   // How often each edge outside the tree was taken
+  // How often control came to each cell other than along an edge, and
+  // how often it left each cell (after executing it) other than along
+  // an edge or to the next cell of the block
+  int entries[4000], exits[4000];
+  int celltimes[4000];      // fixedtime() of each cell
+  int extratimes[4000];     // The time IN/OUT/IOC waited for their units
+  // The counts and times of the cells before profiling started
+  int basecounts[4000], basetimes[4000];
+} edgeprofile;
+
+// Build the graph of the program in mix, starting at mix->PC, and
+// make mix count the edges instead of every cell from now on.  If mix
+// was already profiled with p, its counts so far are worked out first.
+void startprofile(edgeprofile *p, mix *mix, parsestate *ps);
+
+// Set execcounts and exectimes of mix to what they would be if every
+// cell had been counted.
+void profilecounts(edgeprofile *p, mix *mix);
+
+// profilecounts(), and go back to counting every cell.
+void stopprofile(edgeprofile *p, mix *mix);
+#endif
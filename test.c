@@ -1,5 +1,12 @@
+#include <unistd.h>
 #include "emulator.h"
 #include "assembler.h"
+#include "io.h"
+#include "charset.h"
+#include "object.h"
+#include "cfg.h"
+#include "profile.h"
+#include "advisor.h"
 
 void testemulator() {
   mix mix;
@@ -323,6 +330,147 @@ void testemulator() {
   shiftrightcirc(&mix.A, &mix.X, 34);
   assert(mix.A == WORD(true, 7, 8, 9, 10, 1));
   assert(mix.X == WORD(false, 2, 3, 4, 5, 6));
+
+  // TEST: binary shifts
+  mix.A = WORD(true, 0, 0, 0, 0, 1);
+  mix.X = WORD(false, 32, 0, 0, 0, 3);
+  shiftleftbinary(&mix.A, &mix.X, 1);
+  assert(mix.A == WORD(true, 0, 0, 0, 0, 3));
+  assert(mix.X == WORD(false, 0, 0, 0, 0, 6));
+  shiftrightbinary(&mix.A, &mix.X, 2);
+  assert(mix.A == WORD(true, 0, 0, 0, 0, 0));
+  assert(mix.X == WORD(false, 48, 0, 0, 0, 1));
+  shiftleftbinary(&mix.A, &mix.X, 60);
+  assert(mix.A == POS(0) && mix.X == NEG(0));
+
+  // TEST: floating point
+  word one = WORD(true, 33, 1, 0, 0, 0);
+  word half = WORD(true, 32, 32, 0, 0, 0);
+  w = POS(1);
+  assert(!flotword(&w) && w == one);
+  w = NEG(3);
+  assert(!flotword(&w) && w == WORD(false, 33, 3, 0, 0, 0));
+  w = one;
+  assert(!faddword(&w, half) && w == WORD(true, 33, 1, 32, 0, 0));
+  assert(!fmulword(&w, w) && w == WORD(true, 33, 2, 16, 0, 0));  // 1.5^2
+  w = one;
+  assert(!fsubword(&w, one) && w == POS(0));
+  w = one;
+  assert(!fdivword(&w, WORD(true, 33, 3, 0, 0, 0)) && w == WORD(true, 32, 21, 21, 21, 21));
+  assert(fdivword(&w, POS(0)));
+  w = WORD(true, 33, 2, 32, 0, 0);
+  assert(!fixword(&w) && w == POS(3));    // 2.5
+  w = WORD(false, 33, 2, 25, 0, 0);
+  assert(!fixword(&w) && w == NEG(2));    // -2.39
+  w = WORD(true, 63, 1, 0, 0, 0);
+  assert(fmulword(&w, w));                // Exponent overflow
+  // Adding something too small to matter
+  w = one;
+  assert(!faddword(&w, WORD(true, 26, 63, 63, 63, 63)) && w == one);
+  // Rounding to even: 1 + 64^-4/2
+  w = one;
+  assert(!faddword(&w, WORD(true, 29, 32, 0, 0, 0)) && w == one);
+  w = WORD(true, 33, 1, 0, 0, 1);
+  assert(!faddword(&w, WORD(true, 29, 32, 0, 0, 0)) && w == WORD(true, 33, 1, 0, 0, 2));
+  word eps = WORD(true, 31, 1, 0, 0, 0);  // 64^-2
+  assert(fcompareword(one, half, eps) == 1);
+  assert(fcompareword(half, one, eps) == -1);
+  assert(fcompareword(one, WORD(true, 33, 1, 0, 0, 63), eps) == 0);
+
+  // TEST: floating point instructions
+  initmix(&mix);
+  mix.mem[0] = eps;
+  mix.mem[1000] = one;
+  mix.mem[1001] = half;
+  mix.A = POS(2);
+  mix.mem[1] = INSTR(ADDR(0), 0, 6, 5);       // FLOT
+  mix.mem[2] = INSTR(ADDR(1001), 0, 6, 4);    // FDIV 1001
+  mix.mem[3] = INSTR(ADDR(1000), 0, 6, 2);    // FSUB 1000
+  mix.mem[4] = INSTR(ADDR(1000), 0, 6, 56);   // FCMP 1000
+  mix.mem[5] = INSTR(ADDR(0), 0, 7, 5);       // FIX
+  mix.mem[6] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  mix.PC = 1;
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.cmp == 1);
+  assert(mix.A == POS(3));
+  assert(mix.exectimes[1] == 3 && mix.exectimes[2] == 11 && mix.exectimes[4] == 4);
+
+  // TEST: NOP ignores its address and field
+  initmix(&mix);
+  mix.mem[0] = INSTR(ADDR(-3999), 0, 6, 0);    // NOP -3999(6)
+  mix.mem[1] = INSTR(ADDR(0), 0, 2, 5);        // HLT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.execcounts[0] == 1 && mix.exectimes[0] == 1);
+
+  // TEST: even/odd jumps
+  initmix(&mix);
+  mix.A = POS(12);
+  mix.mem[0] = INSTR(ADDR(3), 0, 7, 40);      // JAO 3
+  mix.mem[1] = INSTR(ADDR(1), 0, 7, 6);       // SRB 1
+  mix.mem[2] = INSTR(ADDR(1), 0, 6, 40);      // JAE 1
+  mix.mem[3] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.A == POS(3) && mix.X == POS(0));
+  assert(mix.exectimes[1] == 2*2);
+
+  // TEST: INT goes to location -12 in control state, and back again
+  initmix(&mix);
+  mix.overflow = true;
+  mix.mem[0] = INSTR(ADDR(5), 0, 2, 48);       // ENTA 5
+  mix.mem[1] = INSTR(ADDR(0), 0, 9, 5);        // INT
+  mix.mem[2] = INSTR(ADDR(0), 0, 2, 5);        // HLT
+  MEMORY(&mix, -12) = INSTR(ADDR(7), 0, 2, 48);   // ENTA 7
+  MEMORY(&mix, -11) = INSTR(ADDR(-9), 0, 5, 24);  // STA -9
+  MEMORY(&mix, -10) = INSTR(ADDR(0), 0, 9, 5);    // INT
+  onestep(&mix);
+  onestep(&mix);
+  assert(mix.controlstate && mix.PC == -12);
+  assert(MEMORY(&mix, -9) == POS(5));
+  assert(MEMORY(&mix, -1) == WORD(true, 4+0+1, 0, 0, 0, 2));
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(!mix.controlstate && mix.overflow);
+  assert(mix.A == POS(7));
+  assert(mix.execcounts[2] == 1);
+
+  // TEST: negative locations can't be used in normal state
+  initmix(&mix);
+  mix.mem[0] = INSTR(ADDR(-5), 0, 5, 8);       // LDA -5
+  onestep(&mix);
+  assert(mix.done && !strcmp(mix.err, "illegal address"));
+
+  // TEST: running stops at the cells in the breakpoint bitmap, and goes
+  // on from them
+  initmix(&mix);
+  mix.mem[0] = INSTR(ADDR(3), 0, 2, 49);       // ENT1 3
+  mix.mem[1] = INSTR(ADDR(1), 0, 0, 48);       // INCA 1
+  mix.mem[2] = INSTR(ADDR(1), 0, 1, 49);       // DEC1 1
+  mix.mem[3] = INSTR(ADDR(1), 0, 2, 41);       // J1P 1
+  mix.mem[4] = INSTR(ADDR(0), 0, 2, 5);        // HLT
+  uint32_t breaks[125] = {0};
+  breaks[0] = 1u << 1 | 1u << 4;
+  for (int i = 1; i <= 3; i++) {
+    assert(run(&mix, breaks));
+    assert(mix.PC == 1 && mix.A == POS(i-1));
+  }
+  assert(run(&mix, breaks) && mix.PC == 4 && !mix.done);
+  assert(!run(&mix, breaks) && mix.done && mix.err[0] == '\0');
+  assert(mix.A == POS(3) && mix.execcounts[1] == 3);
+}
+
+// Pass the profiler's calls on, counting them.
+static void (*profiler)(mix *mix, int from, int to, int time);
+static int profilercalls;
+static void countprofilercalls(mix *mix, int from, int to, int time) {
+  profilercalls++;
+  profiler(mix, from, to, time);
 }
 
 void testassembler() {
@@ -346,7 +494,7 @@ void testassembler() {
   assert(!parsesym(&line, sym));
 
   // TEST: parseOP
-  char op[4]; int opidx;
+  char op[5]; int opidx;
   line = "ALF\n";
   assert(parseOP(&line, op, &opidx));
 
@@ -360,6 +508,21 @@ void testassembler() {
   line = "TOOLONG\n";
   assert(!parseOP(&line, op, &opidx));
 
+  // TEST: every mnemonic is found, in either case
+  char oplower[8];
+  for (int i = 0; i < NUMMIXOPS; i++) {
+    sprintf(oplower, "%s\n", MIXOPS[i].name);
+    for (char *c = oplower; *c; c++)
+      *c = tolower(*c);
+    line = oplower;
+    assert(parseOP(&line, op, &opidx));
+    assert(opidx == i && !strcmp(op, MIXOPS[i].name));
+  }
+  line = "orig\n";
+  assert(parseOP(&line, op, &opidx) && opidx == -1);
+  line = "J7N\n";
+  assert(!parseOP(&line, op, &opidx));
+
   // TEST: parsenum
   int num;
   line = "00052\n";
@@ -377,9 +540,7 @@ void testassembler() {
   line = "UNDEFINED\n";
   assert(!parseatomic(&line, &w, &ps));
 
-  ps.numsyms = 1;
-  strcpy(ps.syms[0], "20BY20");
-  ps.symvals[0] = POS(1234);
+  addsym("20BY20", POS(1234), &ps);
   line = "20BY20\n";
   assert(parseatomic(&line, &w, &ps));
   assert(w == POS(1234));
@@ -474,18 +635,19 @@ void testassembler() {
 
   extraparseinfo extraparseinfo;
   // TEST: parseline
+  freeparsestate(&ps);
   initparsestate(&ps);
   line = "START NOP\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
   assert(ps.numsyms == 1);
-  assert(!strcmp(ps.syms[0], "START"));
-  assert(ps.symvals[0] == POS(ps.star-1));
+  assert(!strcmp(ps.syms[0].name, "START"));
+  assert(ps.syms[0].val == POS(ps.star-1));
 
   line = "TEN EQU 10\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
   assert(ps.numsyms == 2);
-  assert(!strcmp(ps.syms[1], "TEN"));
-  assert(ps.symvals[1] == POS(10));
+  assert(!strcmp(ps.syms[1].name, "TEN"));
+  assert(ps.syms[1].val == POS(10));
 
   line = " CON 1337\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
@@ -514,7 +676,31 @@ void testassembler() {
   assert(parseline(line, &ps, &mix, &extraparseinfo));
   assert(mix.mem[3000] == INSTR(ADDR(2000), 0, 13, 24));
 
+  line = " FADD 2000\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(mix.mem[3001] == INSTR(ADDR(2000), 0, 6, 1));
+  line = " FIX\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(mix.mem[3002] == INSTR(ADDR(0), 0, 7, 5));
+  line = " JXO 2000\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(mix.mem[3003] == INSTR(ADDR(2000), 0, 7, 47));
+  line = " INT\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(mix.mem[3004] == INSTR(ADDR(0), 0, 9, 5));
+
+  // TEST: code for control state is assembled at negative locations
+  line = " ORIG -12\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  line = " STA -9\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(MEMORY(&mix, -12) == INSTR(ADDR(-9), 0, 5, 24));
+  assert(ps.star == -11);
+  line = " ORIG -4000\n";
+  assert(!parseline(line, &ps, &mix, &extraparseinfo));
+
   // TEST: future references
+  freeparsestate(&ps);
   initparsestate(&ps);
   line = " JMP FUTURE\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
@@ -547,6 +733,7 @@ void testassembler() {
   assert(mix.PC == 1000);
 
   // TEST: local symbols
+  freeparsestate(&ps);
   initparsestate(&ps);
   line = "1H NOP\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
@@ -573,6 +760,7 @@ void testassembler() {
   assert(getA(mix.mem[2]) == (0|(1<<12)));
 
   // TEST: multiple of the same undefined symbol
+  freeparsestate(&ps);
   initparsestate(&ps);
   line = " JMP UNDEFINED\n";
   assert(parseline(line, &ps, &mix, &extraparseinfo));
@@ -582,9 +770,802 @@ void testassembler() {
   assert(parseline(line, &ps, &mix, &extraparseinfo));
   assert(getA(mix.mem[0]) == (2|(1<<12)));
   assert(getA(mix.mem[1]) == (2|(1<<12)));
+
+  // TEST: more symbols than used to fit, each referenced before and
+  // after it is defined
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  char buf[LINELEN];
+  for (int i = 0; i < 1500; i++) {
+    sprintf(buf, " JMP S%d\n", i);
+    assert(parseline(buf, &ps, &mix, &extraparseinfo));
+  }
+  for (int i = 0; i < 1500; i++) {
+    sprintf(buf, "S%d JMP S%d\n", i, 1499-i);
+    assert(parseline(buf, &ps, &mix, &extraparseinfo));
+  }
+  line = " END 0\n";
+  assert(parseline(line, &ps, &mix, &extraparseinfo));
+  assert(ps.numsyms == 1500);
+  for (int i = 0; i < 1500; i++) {
+    assert(getA(mix.mem[i]) == ((1500+i)|(1<<12)));
+    assert(getA(mix.mem[1500+i]) == ((1500+1499-i)|(1<<12)));
+  }
+  assert(lookupsym("S1234", &w, &ps) && w == POS(1500+1234));
+
+  // TEST: assembling a whole buffer, with a line longer than LINELEN
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  sourceinfo info;
+  char src[400];
+  sprintf(src, "* A PROGRAM\n ORIG 100\nSTART LDA X %0200d\n HLT\nX CON 5\n END START\n LDA\n", 0);
+  assert(assemble(src, strlen(src), &ps, &mix, &info));
+  assert(mix.PC == 100);
+  assert(mix.mem[100] == INSTR(ADDR(102), 0, 5, 8));
+  assert(mix.mem[102] == POS(5));
+  assert(info.srcoffsets[99] == -1);
+  assert(info.srcoffsets[100] == strchr(src, 'S') - src);
+  assert(!strncmp(src + info.srcoffsets[102], "X CON", 5));
+
+  // TEST: the line with an error is reported, and a blank doesn't run
+  // into the next line
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  char *bad = " NOP\nLABEL\n NOP\n";
+  assert(!assemble(bad, strlen(bad), &ps, &mix, &info));
+  assert(info.errline == 2);
+
+  // TEST: saving an object file and loading it back
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(src, strlen(src), &ps, &mix, &info));
+  uint64_t hash = hashsource(src, strlen(src));
+  char objname[] = "/tmp/mixobjXXXXXX";
+  close(mkstemp(objname));
+  assert(saveobject(objname, hash, &mix, &ps, &info));
+  word image[4000];
+  memcpy(image, mix.mem, sizeof(image));
+  parsestate ps2;
+  sourceinfo info2;
+  initmix(&mix);
+  initparsestate(&ps2);
+  assert(!loadobject(objname, hash+1, &mix, &ps2, &info2));
+  assert(loadobject(objname, hash, &mix, &ps2, &info2));
+  assert(!memcmp(mix.mem, image, sizeof(image)));
+  assert(mix.PC == 100);
+  assert(!memcmp(info2.srcoffsets, info.srcoffsets, sizeof(info.srcoffsets)));
+  assert(lookupsym("START", &w, &ps2) && w == POS(100));
+  assert(lookupsym("X", &w, &ps2) && w == POS(102));
+  remove(objname);
+  freeparsestate(&ps2);
+
+  // TEST: reassembling only the lines that changed gives the same
+  // memory as assembling from scratch
+  char *versions[] = {
+    "N EQU 5\n ORIG 100\nSTART LDA =N=\n ENT1 N\n JMP 1F\n JMP LATER\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // Changed instruction, and a different literal
+    "N EQU 5\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\n JMP 1F\n JMP LATER\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // Changed EQU, used by a literal, an instruction and a CON
+    "N EQU 9\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\n JMP 1F\n JMP LATER\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // Jumps to a different symbol, and to an undefined symbol that
+    // already has a cell
+    "N EQU 9\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\n JMP LATER\n JMP Y\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+  };
+  word fresh[4000];
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(versions[0], strlen(versions[0]), &ps, &mix, &info));
+  for (int v = 1; v < 4; v++) {
+    assert(reassemble(versions[v], strlen(versions[v]), &ps, &mix, &info));
+    initparsestate(&ps2);
+    memcpy(image, mix.mem, sizeof(image));
+    initmix(&mix);
+    assert(assemble(versions[v], strlen(versions[v]), &ps2, &mix, &info2));
+    memcpy(fresh, mix.mem, sizeof(fresh));
+    assert(!memcmp(image, fresh, sizeof(fresh)));
+    assert(!memcmp(info.srcoffsets, info2.srcoffsets, sizeof(info.srcoffsets)));
+    memcpy(mix.mem, image, sizeof(image));
+    freeparsestate(&ps2);
+  }
+  assert(lookupsym("N", &w, &ps) && w == POS(9));
+
+  // TEST: changes that move code or need new cells are refused
+  char *refused[] = {
+    // A new label
+    "N EQU 9\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\nNEW JMP LATER\n JMP Y\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // A different ORIG
+    "N EQU 9\n ORIG 200\nSTART LDA =N+1=\n ENT2 N\n JMP LATER\n JMP Y\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // A new undefined symbol
+    "N EQU 9\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\n JMP LATER\n JMP Z\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+    // A new line
+    "N EQU 9\n ORIG 100\nSTART LDA =N+1=\n ENT2 N\n JMP LATER\n JMP Y\n NOP\n"
+    "1H LDA X\n ST1 Y\nLATER HLT\nX CON N\n END START\n",
+  };
+  for (int v = 0; v < 4; v++) {
+    freeparsestate(&ps);
+    initparsestate(&ps);
+    initmix(&mix);
+    assert(assemble(versions[3], strlen(versions[3]), &ps, &mix, &info));
+    assert(!reassemble(refused[v], strlen(refused[v]), &ps, &mix, &info));
+  }
+  freeparsestate(&ps);
+
+  // TEST: macros, REPT and IF
+  char *macrosrc =
+    "SWAP MAC X,Y\n LDA X\n LDX Y\n STA Y\n STX X\n ENDM\n"
+    "SUM MAC N\nI REPT N\n INCA I+1\n ENDR\n ENDM\n"
+    "DEBUG EQU 0\n ORIG 100\nSTART SWAP A,B\n SUM 3\n IF DEBUG\n HLT 1\n ELSE\n"
+    " IF 1\n HLT 2\n FI\n FI\nA CON 1\nB CON 2\nK REPT 3\n CON K*K\n ENDR\n"
+    "I REPT 12\n1H JMP 1F\n ENDR\n1H HLT\n END START\n";
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(macrosrc, strlen(macrosrc), &ps, &mix, &info));
+  assert(mix.mem[100] == INSTR(ADDR(108), 0, 5, 8));   // LDA A
+  assert(mix.mem[101] == INSTR(ADDR(109), 0, 5, 15));  // LDX B
+  assert(mix.mem[102] == INSTR(ADDR(109), 0, 5, 24));  // STA B
+  assert(mix.mem[103] == INSTR(ADDR(108), 0, 5, 31));  // STX A
+  assert(mix.mem[104] == INSTR(ADDR(1), 0, 0, 48));    // INCA 1
+  assert(mix.mem[106] == INSTR(ADDR(3), 0, 0, 48));    // INCA 3
+  assert(mix.mem[107] == INSTR(ADDR(2), 0, 2, 5));     // HLT 2
+  assert(mix.mem[110] == POS(0) && mix.mem[111] == POS(1) && mix.mem[112] == POS(4));
+  for (int i = 0; i < 12; i++)
+    assert(mix.mem[113+i] == INSTR(ADDR(114+i), 0, 0, 39));  // JMP 1F
+  assert(mix.mem[125] == INSTR(ADDR(0), 0, 2, 5));
+  assert(info.srcoffsets[101] == strstr(macrosrc, "START") - macrosrc);
+  // Lines that aren't part of a macro can still be reassembled.
+  char *changed = strdup(macrosrc);
+  strstr(changed, "B CON 2")[6] = '5';
+  assert(reassemble(changed, strlen(changed), &ps, &mix, &info));
+  assert(mix.mem[109] == POS(5));
+  strstr(changed, "STX X")[4] = 'Y';
+  assert(!reassemble(changed, strlen(changed), &ps, &mix, &info));
+  free(changed);
+  freeparsestate(&ps);
+  char *badmacros[] = {
+    "M MAC\n NOP\n END 0\n",              // No ENDM
+    " IF 1\n NOP\n END 0\n",              // No FI
+    "M MAC\n M\n ENDM\n M\n END 0\n",   // M uses itself
+    "M MAC X\n NOP X\n ENDM\n M 1,2\n END 0\n",
+    " ENDR\n END 0\n",
+  };
+  for (int i = 0; i < 5; i++) {
+    initparsestate(&ps);
+    assert(!assemble(badmacros[i], strlen(badmacros[i]), &ps, &mix, &info));
+    assert(info.errline > 0);
+    freeparsestate(&ps);
+  }
+  // A REPT inside a REPT doesn't change how often the outer one repeats.
+  char *nested = " REPT 3\n REPT 2\n CON 7\n ENDR\n CON 9\n ENDR\n HLT\n END 0\n";
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(nested, strlen(nested), &ps, &mix, &info));
+  for (int i = 0; i < 9; i++)
+    assert(mix.mem[i] == POS(i%3 == 2 ? 9 : 7));
+  assert(mix.mem[9] == INSTR(ADDR(0), 0, 2, 5));
+  freeparsestate(&ps);
+
+  // TEST: literals with the same value share a cell, and so do the uses
+  // of an undefined symbol
+  char *pooled[] = {
+    " ORIG 10\nSTART LDA =5=\n LDA =5=\n LDA =-1=\n LDA =0=\n STA X\n STA X\n LDA =5=\n END START\n",
+    // The cell of =5= is shared
+    " ORIG 10\nSTART LDA =6=\n LDA =5=\n LDA =-1=\n LDA =0=\n STA X\n STA X\n LDA =5=\n END START\n",
+    // =5= already has a cell
+    " ORIG 10\nSTART LDA =5=\n LDA =5=\n LDA =5=\n LDA =0=\n STA X\n STA X\n LDA =5=\n END START\n",
+    " ORIG 10\nSTART LDA =5=\n LDA =5=\n LDA =-2=\n LDA =0=\n STA X\n STA X\n LDA =5=\n END START\n",
+  };
+  for (int v = 0; v < 4; v++) {
+    initparsestate(&ps);
+    initmix(&mix);
+    assert(assemble(pooled[0], strlen(pooled[0]), &ps, &mix, &info));
+    assert(ps.pooled == 3 && ps.star == 21);
+    assert(mix.mem[10] == INSTR(ADDR(17), 0, 5, 8) && mix.mem[11] == mix.mem[10]);
+    assert(mix.mem[16] == mix.mem[10] && mix.mem[17] == POS(5));
+    assert(mix.mem[12] == INSTR(ADDR(18), 0, 5, 8) && mix.mem[18] == NEG(1));
+    assert(mix.mem[13] == INSTR(ADDR(19), 0, 5, 8) && mix.mem[19] == POS(0));
+    assert(mix.mem[14] == INSTR(ADDR(20), 0, 5, 24) && mix.mem[15] == mix.mem[14]);
+    assert(reassemble(pooled[v], strlen(pooled[v]), &ps, &mix, &info) == (v == 0 || v == 3));
+    freeparsestate(&ps);
+  }
+  assert(mix.mem[12] == INSTR(ADDR(18), 0, 5, 8) && mix.mem[18] == NEG(2));
+
+  // TEST: linking a program with a module assembled separately, which
+  // is moved to the first free cells
+  char *mainsrc = "SQUARE EXT\nTABLE EXT\n ORIG 2\nSTART JMP SQUARE\n STA TABLE+1\n"
+    " LDA =7=\n JMP 1F\n1H HLT\n END START\n";
+  char *libsrc = " ENT SQUARE\n ENT TABLE\nSQUARE STJ 1F\n MUL TABLE\n LDA =3=\n"
+    "1H JMP *\nTABLE CON 4\nTWICE EQU TABLE*2\n LDA TWICE\n END 0\n";
+  module mods[2];
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(mainsrc, strlen(mainsrc), &ps, &mix, &info));
+  assert(ps.relocs[2] == RELOC_EXT + 0 && ps.relocs[3] == RELOC_EXT + 1);
+  assert(ps.relocs[4] == RELOC_REL && ps.relocs[5] == RELOC_REL && ps.relocs[7] == RELOC_ABS);
+  assert(makemodule(&mix, &ps, &info, 1, &mods[0])[0] == '\0');
+  assert(mods[0].lo == 2 && mods[0].hi == 8);
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(libsrc, strlen(libsrc), &ps, &mix, &info));
+  assert(ps.relocs[5] == RELOC_BAD);
+  assert(makemodule(&mix, &ps, &info, 2, &mods[1])[0] == '\0');
+  char modname[] = "/tmp/mixmodXXXXXX";
+  close(mkstemp(modname));
+  assert(savemodule(modname, &mods[1]));
+  freemodule(&mods[1]);
+  assert(!loadmodule(modname, 3, &mods[1]));
+  assert(loadmodule(modname, 2, &mods[1]));
+  remove(modname);
+  // TWICE can't be moved
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(!strcmp(linkmodules(mods, 2, &mix, &ps, &info), "the address at 5 of module 2 can't be relocated"));
+  mods[1].relocs[5] = RELOC_ABS;
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(linkmodules(mods, 2, &mix, &ps, &info)[0] == '\0');
+  // The module goes to 8-14, with its literal after it.
+  assert(mix.PC == 2);
+  assert(mix.mem[2] == INSTR(ADDR(8), 0, 0, 39));    // JMP SQUARE
+  assert(mix.mem[3] == INSTR(ADDR(13), 0, 5, 24));   // STA TABLE+1
+  assert(mix.mem[4] == INSTR(ADDR(7), 0, 5, 8));     // LDA =7=
+  assert(mix.mem[8] == INSTR(ADDR(11), 0, 2, 32));   // STJ 1F
+  assert(mix.mem[11] == INSTR(ADDR(11), 0, 0, 39));  // JMP *
+  assert(mix.mem[12] == POS(4));
+  assert(mix.mem[10] == INSTR(ADDR(14), 0, 5, 8));   // LDA =3=
+  assert(mix.mem[14] == POS(3));
+  assert(lookupsym("START", &w, &ps) && w == POS(2));
+  assert(lookupsym("TABLE", &w, &ps) && w == POS(12));
+  assert(info.srcoffsets[2] == strstr(mainsrc, "START") - mainsrc && info.srcoffsets[8] == -1);
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.mem[13] == POS(3) && mix.A == POS(7));
+  // Without the module, SQUARE and TABLE are missing.
+  freeparsestate(&ps);
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(!strcmp(linkmodules(mods, 1, &mix, &ps, &info), "SQUARE is not exported by any module"));
+  freemodule(&mods[0]);
+  freemodule(&mods[1]);
+  freeparsestate(&ps);
+
+  // TEST: the control-flow graph of a program with a subroutine called
+  // from a loop, and a loop inside that
+  char *loops = "MAIN ENT1 10\nLOOP JMP SUB\n ENT2 3\n2H DEC2 1\n J2P 2B\n DEC1 1\n"
+    " J1P LOOP\n JMP SUB\n HLT\nSUB STJ EXIT\n LDA =5=\n JANZ 1F\n MOVE 0(3)\n"
+    "1H ADD =1=\nEXIT JMP *\nDATA CON 0\n END MAIN\n";
+  static cfg g;
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(loops, strlen(loops), &ps, &mix, &info));
+  buildcfg(mix.mem, mix.PC, NULL, &ps, &g);
+  int firsts[] = {0, 1, 2, 3, 5, 7, 8, 9, 12, 13};
+  assert(g.numblocks == 10);
+  for (int b = 0; b < g.numblocks; b++)
+    assert(g.blocks[b].first == firsts[b]);
+  assert(g.blockof[15] == -1 && g.blockof[16] == -1 && g.blockof[4] == 3);
+  assert(g.numroutines == 2);
+  assert(!strcmp(g.routines[0].name, "MAIN") && !strcmp(g.routines[1].name, "SUB"));
+  assert(g.routines[1].entry == 7 && g.routines[1].exit == 14);
+  assert(fixedtime(mix.mem[12]) == 7 && g.blocks[8].time == 7);
+  assert(g.blocks[7].time == 5 && g.blocks[6].time == 10);
+  // Block 1 calls SUB, which returns to blocks 2 and 6
+  block *bl = &g.blocks[1];
+  assert(bl->numedges == 1 && g.edges[bl->firstedge].kind == EDGE_CALL && g.edges[bl->firstedge].to == 7);
+  bl = &g.blocks[9];
+  assert(bl->numedges == 2 && g.edges[bl->firstedge].kind == EDGE_RETURN);
+  assert(g.edges[bl->firstedge].to == 2 && g.edges[bl->firstedge+1].to == 6);
+  assert(g.blocks[8].routine == 1 && g.blocks[6].routine == 0);
+  // Loops
+  assert(g.blocks[3].depth == 2 && g.blocks[3].header == 3);
+  assert(g.blocks[2].depth == 1 && g.blocks[4].depth == 1 && g.blocks[4].header == 1);
+  assert(g.blocks[0].depth == 0 && g.blocks[5].depth == 0 && g.blocks[8].depth == 0);
+  // Code only reached through an indexed jump comes in with a profile
+  int counts[4000] = {0};
+  mix.mem[5] = INSTR(ADDR(0), 1, 0, 39);  // JMP 0,1
+  counts[16] = 1;
+  buildcfg(mix.mem, mix.PC, NULL, &ps, &g);
+  assert(g.blocks[g.blockof[5]].unknownexit && g.blockof[6] == -1);
+  buildcfg(mix.mem, mix.PC, counts, &ps, &g);
+  assert(g.blockof[16] >= 0 && g.blocks[g.blockof[16]].first == 16);
+  freeparsestate(&ps);
+
+  // TEST: counting only the edges outside a spanning tree gives the
+  // same counts as counting every cell, even when control gets around
+  // the graph through an indexed jump and a changed instruction
+  char *profiled[] = {loops,
+    "TABLE JMP C0\n JMP C1\n JMP C2\nSTART ENT4 20\nLOOP JMP SUB\n INC2 1\n CMP2 =3=\n"
+    " JL 1F\n ENT2 0\n1H JMP TABLE,2\nC0 INCA 1\n JMP NEXT\nC1 INCA 2\n JMP NEXT\n"
+    "C2 ENT1 BUF\n MOVE TABLE(2)\nNEXT DEC4 1\n J4P LOOP\n ENT3 2\n2H INCA 1\nMOD ENT5 0\n"
+    " INCX 1\nSKIP LDA JINSTR\n STA MOD\n DEC3 1\n J3P 2B\n HLT\nJINSTR JMP SKIP\n"
+    "SUB STJ EXIT\n INCX 1\nEXIT JMP *\nBUF CON 0\n CON 0\n END START\n",
+    "START ENT4 50\nLOOP JMP SUB\n JMP SUB\n JMP SUB\n ENT3 100\n2H DEC3 1\n J3P 2B\n"
+    " DEC4 1\n J4P LOOP\n HLT\nSUB STJ EXIT\n INCX 1\nEXIT JMP *\n END START\n"};
+  static edgeprofile prof;
+  static struct mix full;
+  for (int i = 0; i < 3; i++) {
+    initparsestate(&ps);
+    initmix(&full);
+    assert(assemble(profiled[i], strlen(profiled[i]), &ps, &full, &info));
+    initmix(&mix);
+    memcpy(mix.mem, full.mem, sizeof(mix.mem));
+    mix.PC = full.PC;
+    startprofile(&prof, &mix, &ps);
+    int counted = 0;
+    for (int e = 0; e < prof.g.numedges; e++)
+      counted += !prof.intree[e];
+    assert(counted < prof.g.numedges);
+    // Part of the way, and then to the end
+    for (int step = 0; step < 30; step++) {
+      onestep(&full);
+      onestep(&mix);
+    }
+    profilecounts(&prof, &mix);
+    assert(!memcmp(mix.execcounts, full.execcounts, sizeof(full.execcounts)));
+    assert(!memcmp(mix.exectimes, full.exectimes, sizeof(full.exectimes)));
+    // Starting again adds the code executed so far to the graph.
+    startprofile(&prof, &mix, &ps);
+    profiler = mix.probe;
+    mix.probe = countprofilercalls;
+    profilercalls = 0;
+    while (!full.done)
+      onestep(&full);
+    while (!mix.done)
+      onestep(&mix);
+    assert(full.err[0] == '\0' && mix.err[0] == '\0');
+    stopprofile(&prof, &mix);
+    assert(mix.probes == NULL);
+    assert(!memcmp(mix.execcounts, full.execcounts, sizeof(full.execcounts)));
+    assert(!memcmp(mix.exectimes, full.exectimes, sizeof(full.exectimes)));
+    freeparsestate(&ps);
+    if (i == 1)
+      assert(full.execcounts[4] == 20 && full.execcounts[28] == 20);
+  }
+  // The profiler is only called for the third of the returns from SUB
+  // and at the end, not in the loops.
+  assert(full.execcounts[5] == 5000);
+  assert(profilercalls <= 50+1);
+
+  // TEST: the advisor finds each kind of rewrite, with the time it
+  // would have saved
+  char *slow = " ORIG 100\nX CON 0\nLIMIT CON 50\nZERO CON 0\nCODE CON 3\nSRC CON 1\n CON 2\n"
+    " ORIG SRC+20\nDST CON 0\n ORIG 0\nSTART ENT4 100\nLOOP LDA X\n ADD =3=\n STA X\n"
+    " LDA X\n CMPA ZERO\n JE 1F\n1H LDA SRC\n STA DST\n LDA SRC+1\n STA DST+1\n JMP SUB\n"
+    " LD1 CODE\n CMP1 =1=\n JE 2F\n CMP1 =2=\n JE 2F\n CMP1 =3=\n JE 2F\n2H DEC4 1\n"
+    " J4P LOOP\n ENT2 10\n3H LDA SRC,2\n STA DST,2\n DEC2 1\n J2P 3B\n ENT3 5\n4H LDX LIMIT\n"
+    " DEC3 1\n J3P 4B\n HLT\nSUB STJ EXIT\n INCX 1\nEXIT JMP *\n END START\n";
+  initparsestate(&ps);
+  initmix(&mix);
+  assert(assemble(slow, strlen(slow), &ps, &mix, &info));
+  word slowimage[4000];
+  memcpy(slowimage, mix.mem, sizeof(slowimage));
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  buildcfg(slowimage, 0, mix.execcounts, &ps, &g);
+  advice advices[10];
+  int numadvices = advise(slowimage, &g, mix.execcounts, &ps, advices, 10);
+  struct { int kind, cell; long saved; } expected[] = {
+    {ADVICE_INLINE, 11, 400}, {ADVICE_TABLE, 13, 400}, {ADVICE_RELOAD, 4, 200},
+    {ADVICE_REGJUMP, 5, 200}, {ADVICE_MOVE, 7, 200}, {ADVICE_LITERAL, 2, 100},
+    {ADVICE_MOVE, 22, 38}, {ADVICE_INVARIANT, 27, 8}};
+  assert(numadvices == 8);
+  for (int i = 0; i < numadvices; i++) {
+    assert(advices[i].kind == expected[i].kind && advices[i].cell == expected[i].cell);
+    assert(advices[i].saved == expected[i].saved);
+  }
+  assert(!strcmp(advices[3].text, "CMPA 0102 is a comparison with 0; replace it and JE by JAZ"));
+  assert(!strcmp(advices[5].text, "ADD =3= in a loop; use INCA 3"));
+  assert(advise(slowimage, &g, mix.execcounts, &ps, advices, 2) == 2 && advices[1].kind == ADVICE_TABLE);
+  freeparsestate(&ps);
+}
+
+static void countprinted(const char *text, size_t len, void *data) {
+  *(size_t *)data += len;
+}
+
+void testio() {
+  mix mix;
+  char filename[] = "/tmp/mixtapeXXXXXX";
+  close(mkstemp(filename));
+
+  // TEST: tape OUT followed by tape IN, with and without the IO worker
+  for (int async = 0; async <= 1; async++) {
+    initmix(&mix);
+    mix.asyncio = async;
+    mix.INtimes[0] = 100;
+    mix.OUTtimes[0] = 100;
+    mix.IOCtimes[0] = 10;
+    mix.seektimes[0] = 5;
+    assert(openblockdevice(&mix.tapefiles[0], filename, 100, true));
+    for (int i = 0; i < 100; i++)
+      mix.mem[1000+i] = WORD(i%2, i%64, 1, 2, 3, 4);
+    mix.mem[0] = INSTR(ADDR(1000), 0, 0, 37);  // OUT 1000(0)
+    mix.mem[1] = INSTR(ADDR(1), 0, 0, 34);     // JBUS 1(0)
+    mix.mem[2] = INSTR(ADDR(0), 0, 2, 5);      // HLT
+    mix.mem[3] = INSTR(ADDR(0), 0, 0, 35);     // IOC 0(0)
+    mix.mem[4] = INSTR(ADDR(2000), 0, 0, 36);  // IN 2000(0)
+    mix.mem[5] = INSTR(ADDR(5), 0, 0, 34);     // JBUS 5(0)
+    mix.mem[6] = INSTR(ADDR(0), 0, 2, 5);      // HLT
+    while (!mix.done)
+      onestep(&mix);
+    assert(mix.err[0] == '\0');
+    mix.done = false;
+    while (!mix.done)
+      onestep(&mix);
+    assert(mix.err[0] == '\0');
+    for (int i = 0; i < 100; i++)
+      assert(mix.mem[2000+i] == mix.mem[1000+i]);
+    closeblockdevice(&mix.tapefiles[0]);
+  }
+
+  // TEST: the same round trip on a memory-mapped binary tape
+  FILE *fp = fopen(filename, "w");
+  binheader header = { BINMAGIC, 100, 0 };
+  fwrite(&header, sizeof(header), 1, fp);
+  fclose(fp);
+  mix.done = false;
+  mix.PC = 0;
+  assert(openblockdevice(&mix.tapefiles[0], filename, 100, true));
+  assert(mix.tapefiles[0].map != NULL);
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.tapefiles[0].numblocks == 1);
+  mix.done = false;
+  for (int i = 0; i < 100; i++)
+    mix.mem[2000+i] = POS(0);
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  for (int i = 0; i < 100; i++)
+    assert(mix.mem[2000+i] == mix.mem[1000+i]);
+  closeblockdevice(&mix.tapefiles[0]);
+  assert(openblockdevice(&mix.tapefiles[0], filename, 100, true));
+  assert(mix.tapefiles[0].numblocks == 1);
+  assert(mix.tapefiles[0].blocks[5] == mix.mem[1005]);
+  closeblockdevice(&mix.tapefiles[0]);
+
+  // TEST: IOC on tapes, with the seek time charged to the device
+  for (int binary = 0; binary <= 1; binary++) {
+    fp = fopen(filename, "w");
+    if (binary) {
+      header.numblocks = 5;
+      fwrite(&header, sizeof(header), 1, fp);
+    }
+    word block[100];
+    for (int i = 0; i < 5; i++) {
+      for (int j = 0; j < 100; j++)
+	block[j] = POS(i);
+      if (binary)
+	fwrite(block, sizeof(word), 100, fp);
+      else
+	writetextblock(fp, block, false);
+    }
+    fclose(fp);
+    initmix(&mix);
+    mix.INtimes[0] = 100;
+    mix.IOCtimes[0] = 10;
+    mix.seektimes[0] = 5;
+    assert(openblockdevice(&mix.tapefiles[0], filename, 100, true));
+    mix.mem[0] = INSTR(ADDR(3), 0, 0, 35);     // IOC 3(0)
+    mix.mem[1] = INSTR(ADDR(1000), 0, 0, 36);  // IN 1000(0)
+    mix.mem[2] = INSTR(ADDR(-2), 0, 0, 35);    // IOC -2(0)
+    mix.mem[3] = INSTR(ADDR(2000), 0, 0, 36);  // IN 2000(0)
+    mix.mem[4] = INSTR(ADDR(4), 0, 0, 34);     // JBUS 4(0)
+    mix.mem[5] = INSTR(ADDR(0), 0, 2, 5);      // HLT
+    onestep(&mix);
+    assert(mix.iothreads[0].totaltime == 10 + 5*3);
+    while (!mix.done)
+      onestep(&mix);
+    assert(mix.err[0] == '\0');
+    assert(mix.mem[1000] == POS(3));
+    assert(mix.mem[2000] == POS(2));
+    assert(mix.tapefiles[0].pos == 3);
+    closeblockdevice(&mix.tapefiles[0]);
+  }
+
+  // TEST: disks transfer the block given by rX, with the seek time
+  // charged to the device
+  fp = fopen(filename, "w");
+  header.numblocks = 0;
+  fwrite(&header, sizeof(header), 1, fp);
+  fclose(fp);
+  initmix(&mix);
+  mix.INtimes[8] = 100;
+  mix.OUTtimes[8] = 100;
+  mix.seektimes[8] = 5;
+  assert(openblockdevice(&mix.diskfiles[0], filename, 100, true));
+  for (int i = 0; i < 100; i++)
+    mix.mem[1000+i] = WORD(false, 1, 2, 3, 4, i%64);
+  mix.X = POS(3);
+  mix.mem[0] = INSTR(ADDR(1000), 0, 8, 37);  // OUT 1000(8)
+  mix.mem[1] = INSTR(ADDR(1), 0, 8, 34);     // JBUS 1(8)
+  mix.mem[2] = INSTR(ADDR(2000), 0, 8, 36);  // IN 2000(8)
+  mix.mem[3] = INSTR(ADDR(3), 0, 8, 34);     // JBUS 3(8)
+  mix.mem[4] = INSTR(ADDR(0), 0, 2, 5);      // HLT
+  onestep(&mix);
+  assert(mix.iothreads[8].totaltime == 100 + 5*3);
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.diskfiles[0].numblocks == 4);
+  assert(mix.diskfiles[0].blocks[0] == POS(0));
+  for (int i = 0; i < 100; i++)
+    assert(mix.mem[2000+i] == mix.mem[1000+i]);
+  mix.X = POS(4);
+  mix.PC = 2;
+  mix.done = false;
+  while (!mix.done)
+    onestep(&mix);
+  assert(!strcmp(mix.err, "read past the end of disk"));
+  // A negative block is an error for OUT and IOC alike
+  for (int C = 35; C <= 37; C += 2) {
+    mix.X = NEG(3);
+    mix.mem[0] = INSTR(ADDR(1000), 0, 8, C);  // OUT 1000(8) or IOC 1000(8)
+    mix.PC = 0;
+    mix.done = false;
+    mix.err = "";
+    mix.iothreads[8].err = "";
+    while (!mix.done)
+      onestep(&mix);
+    assert(!strcmp(mix.err, "negative block number for disk"));
+    assert(mix.diskfiles[0].numblocks == 4);
+  }
+  closeblockdevice(&mix.diskfiles[0]);
+  remove(filename);
+
+  // TEST: punching a card, and reading it back from paper tape
+  initmix(&mix);
+  mix.OUTtimes[17] = 100;
+  mix.INtimes[20] = 100;
+  mix.streamfiles[0].out = tmpfile();
+  for (int i = 0; i < 16; i++)
+    mix.mem[1000+i] = WORD(true, 1, 2, 3, 4, i);
+  mix.mem[0] = INSTR(ADDR(1000), 0, 17, 37);  // OUT 1000(17)
+  mix.mem[1] = INSTR(ADDR(1), 0, 17, 34);     // JBUS 1(17)
+  mix.mem[2] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  mix.mem[3] = INSTR(ADDR(2000), 0, 20, 36);  // IN 2000(20)
+  mix.mem[4] = INSTR(ADDR(4), 0, 20, 34);     // JBUS 4(20)
+  mix.mem[5] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  mix.streamfiles[3].in = mix.streamfiles[0].out;
+  mix.streamfiles[0].out = NULL;
+  rewind(mix.streamfiles[3].in);
+  mix.done = false;
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  for (int i = 0; i < 14; i++)
+    assert(mix.mem[2000+i] == mix.mem[1000+i]);
+  closedevices(&mix);
+
+  // TEST: printing into memory, with a page eject in between
+  initmix(&mix);
+  mix.printer.keep = true;
+  mix.OUTtimes[18] = 100;
+  mix.IOCtimes[18] = 100;
+  for (int i = 0; i < 24; i++)
+    mix.mem[1000+i] = WORD(true, 1, 2, 3, 4, 5);
+  mix.mem[0] = INSTR(ADDR(1000), 0, 18, 37);  // OUT 1000(18)
+  mix.mem[1] = INSTR(ADDR(0), 0, 18, 35);     // IOC 0(18)
+  mix.mem[2] = INSTR(ADDR(1000), 0, 18, 37);  // OUT 1000(18)
+  mix.mem[3] = INSTR(ADDR(3), 0, 18, 34);     // JBUS 3(18)
+  mix.mem[4] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.printer.len == 2*121+1);
+  assert(!strncmp(mix.printer.buf, "ABCDEABCDE", 10));
+  assert(mix.printer.buf[119] == 'E' && mix.printer.buf[120] == '\n');
+  assert(mix.printer.buf[121] == '\f');
+  assert(!strncmp(mix.printer.buf + 122, mix.printer.buf, 121));
+
+  // TEST: the printer only hands lines to its callback at the halt
+  mix.printer.keep = false;
+  mix.printer.len = 0;
+  size_t printed = 0;
+  mix.printer.callback = countprinted;
+  mix.printer.data = &printed;
+  mix.PC = 0;
+  mix.done = false;
+  while (!mix.done) {
+    assert(printed == 0);
+    onestep(&mix);
+  }
+  assert(printed == 2*121+1);
+  closedevices(&mix);
+
+  // TEST: the printer interrupts the program when the line is printed,
+  // instead of the program waiting with JBUS
+  initmix(&mix);
+  mix.printer.keep = true;
+  mix.interrupts = true;
+  mix.OUTtimes[18] = 100;
+  mix.mem[0] = INSTR(ADDR(1000), 0, 18, 37);  // OUT 1000(18)
+  mix.mem[1] = INSTR(ADDR(1), 0, 1, 49);      // INC1 1
+  mix.mem[2] = INSTR(ADDR(500), 0, 5, 8);     // LDA 500
+  mix.mem[3] = INSTR(ADDR(1), 0, 1, 40);      // JAZ 1
+  mix.mem[4] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  MEMORY(&mix, -38) = INSTR(ADDR(1), 0, 2, 48);    // ENTA 1
+  MEMORY(&mix, -37) = INSTR(ADDR(500), 0, 5, 24);  // STA 500
+  MEMORY(&mix, -36) = INSTR(ADDR(0), 0, 9, 5);     // INT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.mem[500] == POS(1));
+  assert(mix.printer.len == 121);
+  assert(INT(mix.Is[0]) > 10);
+  assert(mix.iothreads[18].timer == 0);
+  closedevices(&mix);
+
+  // TEST: recording the transfers into a journal, and replaying them
+  // without the card file
+  char cardname[] = "/tmp/mixcardsXXXXXX";
+  char journalname[] = "/tmp/mixjournalXXXXXX";
+  fp = fdopen(mkstemp(cardname), "w");
+  fputs("HELLO WORLD\n", fp);
+  fclose(fp);
+  char journalname2[] = "/tmp/mixjournalXXXXXX";
+  close(mkstemp(journalname));
+  close(mkstemp(journalname2));
+  long recordedtime;
+  // Recording the same run twice gives the same journal, with and
+  // without the worker thread.
+  for (int k = 0; k < 2; k++) {
+    initmix(&mix);
+    mix.asyncio = k == 0;
+    mix.INtimes[16] = 100;
+    assert(openblockdevice(&mix.cardfile, cardname, 16, false));
+    assert(openjournal(&mix, k == 0 ? journalname : journalname2, false));
+    mix.mem[0] = INSTR(ADDR(1000), 0, 16, 36);  // IN 1000(16)
+    mix.mem[1] = INSTR(ADDR(1), 0, 16, 34);     // JBUS 1(16)
+    mix.mem[2] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+    while (!mix.done)
+      onestep(&mix);
+    assert(mix.err[0] == '\0');
+    recordedtime = mix.time;
+    closedevices(&mix);
+  }
+  char journal[200], journal2[200];
+  fp = fopen(journalname, "r");
+  int journallen = fread(journal, 1, sizeof(journal), fp);
+  fclose(fp);
+  fp = fopen(journalname2, "r");
+  assert(fread(journal2, 1, sizeof(journal2), fp) == journallen);
+  fclose(fp);
+  assert(journallen == 8 + sizeof(journalentry) + 16*sizeof(word));
+  assert(!memcmp(journal, journal2, journallen));
+  remove(journalname2);
+  remove(cardname);
+  initmix(&mix);
+  mix.INtimes[16] = 100;
+  assert(openjournal(&mix, journalname, true));
+  mix.mem[0] = INSTR(ADDR(1000), 0, 16, 36);  // IN 1000(16)
+  mix.mem[1] = INSTR(ADDR(1), 0, 16, 34);     // JBUS 1(16)
+  mix.mem[2] = INSTR(ADDR(0), 0, 2, 5);       // HLT
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.time == recordedtime);
+  assert(mix.mem[1000] == WORD(true, 8, 5, 13, 13, 16));  // HELLO
+  assert(mix.mem[1001] == WORD(true, 0, 26, 16, 19, 13)); //  WORL
+  // A program doing something else doesn't match the journal
+  assert(openjournal(&mix, journalname, true));
+  mix.mem[0] = INSTR(ADDR(1100), 0, 16, 36);  // IN 1100(16)
+  mix.PC = 0;
+  mix.done = false;
+  while (!mix.done)
+    onestep(&mix);
+  assert(!strcmp(mix.err, "transfer does not match the journal"));
+  closedevices(&mix);
+  remove(journalname);
+
+  // TEST: loading a deck with the GO button, skipping the loading
+  // routine and leaving the data card after the transfer card
+  char deckname[] = "/tmp/mixdeckXXXXXX";
+  fp = fdopen(mkstemp(deckname), "w");
+  fputs(" O O6 Z O6    I C O4 0 EH A  F F CF 0  E   EU 0 IH G BB   EJ  CA. Z EU   EH E BA\n", fp);
+  fputs("   EU 2A-H S BB  C U 1AEH 2AEN V  E  CLU  ABG Z EH E BB J B. A  9               \n", fp);
+  char card[81];
+  sprintf(card, "PROG 3%04d%010d%010d%010d", 100,
+	  (int)MAG(INSTR(ADDR(1000), 0, 16, 36)),  // IN 1000(16)
+	  (int)MAG(INSTR(ADDR(101), 0, 16, 34)),   // JBUS 101(16)
+	  (int)MAG(INSTR(ADDR(0), 0, 2, 5)));      // HLT
+  fprintf(fp, "%-80s\n", card);
+  sprintf(card, "PROG 1%04d000000001K", 200);  // -12
+  fprintf(fp, "%-80s\n", card);
+  sprintf(card, "TRANS0%04d", 100);
+  fprintf(fp, "%-80s\n", card);
+  fputs("DATA\n", fp);
+  fclose(fp);
+  initmix(&mix);
+  mix.INtimes[16] = 100;
+  assert(openblockdevice(&mix.cardfile, deckname, 16, false));
+  assert(loaddeck(&mix, true));
+  assert(mix.PC == 100);
+  assert(mix.time == 5*100);
+  assert(mix.mem[200] == NEG(12));
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.mem[1000] == WORD(true, 4, 1, 23, 1, 0));  // DATA
+  // Pressing GO again reads the deck from its first card.
+  resetmix(&mix);
+  assert(loaddeck(&mix, false));
+  assert(mix.PC == 100 && mix.mem[200] == NEG(12));
+  closedevices(&mix);
+
+  // TEST: a deck written as mmm's C command does is loaded as it is
+  word program[32];
+  for (int i = 0; i < 32; i++)
+    program[i] = POS(0);
+  program[0] = INSTR(ADDR(20), 0, 5, 8);   // LDA 20
+  program[1] = INSTR(ADDR(21), 0, 5, 1);   // ADD 21
+  program[2] = INSTR(ADDR(0), 0, 2, 5);    // HLT
+  program[20] = POS(40);
+  program[21] = POS(2);
+  fp = fopen(deckname, "w");
+  writedeck(fp, program, 32);
+  fclose(fp);
+  initmix(&mix);
+  mix.INtimes[16] = 100;
+  assert(openblockdevice(&mix.cardfile, deckname, 16, false));
+  mix.mem[3000] = POS(1);
+  resetmix(&mix);
+  assert(loaddeck(&mix, true));
+  assert(mix.PC == 0 && mix.time == 3*100);
+  assert(!memcmp(mix.mem, program, sizeof(program)) && mix.mem[3000] == POS(0));
+  while (!mix.done)
+    onestep(&mix);
+  assert(mix.err[0] == '\0');
+  assert(mix.A == POS(42));
+  closedevices(&mix);
+  remove(deckname);
+
+  // TEST: the character tables agree with mixchr() and mixord()
+  for (int c = 0; c < 256; c++)
+    assert(ASCIITOMIX[c] == mixord(c));
+  for (byte b = 0; b < 64; b++) {
+    unsigned char extra;
+    unsigned char c = mixchr(b, &extra);
+    if (!extra)
+      assert(MIXTOASCII[b] == c);
+    assert(mixord(MIXTOASCII[b]) == b);
+  }
+
+  // TEST: bulk translation, including the tails that don't fill a vector
+  char chars[5*37];
+  word words[37], back[37];
+  for (int i = 0; i < 37; i++)
+    words[i] = (i*0x1234567) & ONES(30);
+  wordstoascii(words, chars, 37);
+  for (int i = 0; i < 5*37; i++)
+    assert(chars[i] == MIXTOASCII[(words[i/5] >> 6*(4-i%5)) & ONES(6)]);
+  asciitowords(chars, back, 37);
+  for (int i = 0; i < 37; i++)
+    assert(back[i] == words[i]);
+  byte codes[5];
+  asciitomix("a?\x80~ ", codes, 5);
+  assert(codes[0] == 56 && codes[1] == 63 && codes[2] == 63 && codes[3] == 63 && codes[4] == 0);
 }
 
 int main() {
   testemulator();
   testassembler();
+  testio();
 }
\ No newline at end of file